@@ -1,998 +1,3236 @@
 #ifndef AVL_MAP_H
 #define AVL_MAP_H
 
+#include <algorithm>
 #include <functional>
+#include <iterator>
 #include <stdexcept>
 #include <iostream>
+#include <cstring>
+#include <cstddef>
+#include <limits>
+#include <new>
+#include <stdint.h>
+#include <string>
+#include <vector>
 #if __cplusplus >= 201103L
 # define NOEXCEPT noexcept
+# include <atomic>
 # include <initializer_list>
+# include <memory>
 # include <tuple>
+# include <type_traits>
 #else
 # define NOEXCEPT
 #endif
+#if __cplusplus >= 201703L
+# include <string_view>
+#endif
 
-template <typename key,
-typename T,
-typename compare = std::less<key>,
-typename alloc = std::allocator<std::pair<const key, T> > >
-class avl_tree{
+// Operation counters, compiled in only when AVL_MAP_STATS is defined. Without
+// it the counting sites expand to nothing and avl_tree has no stats member.
+#ifdef AVL_MAP_STATS
+struct avl_tree_stats
+{
+    uint64_t comparisons;         // calls of the key comparator
+    uint64_t descents;            // root-to-leaf searches
+    uint64_t descent_steps;       // nodes visited by those searches
+    uint64_t single_rotations;
+    uint64_t double_rotations;
+    uint64_t rebalance_steps;     // nodes visited by rebalance()
+    uint64_t relaxed_steps;       // steps of deferred rebalancing
+    uint64_t allocations;         // nodes and values allocated
+    uint64_t deallocations;       // nodes and values freed
+    uint64_t iterator_increments; // ++ and -- on iterators from this tree
+    
+    avl_tree_stats() { reset(); }
+    void reset() { std::memset(this, 0, sizeof(*this)); }
+};
+# define AVL_MAP_COUNT(field) (++stats_.field)
+# define AVL_MAP_STATS_ONLY(x) x
+// iterators remember the stats of the tree that created them
+# define AVL_MAP_STATS_PARAM , avl_tree_stats* s = 0
+# define AVL_MAP_STATS_INIT(v) , stats_(v)
+# define AVL_MAP_STATS_ARG , &stats_
+#else
+# define AVL_MAP_COUNT(field) ((void)0)
+# define AVL_MAP_STATS_ONLY(x)
+# define AVL_MAP_STATS_PARAM
+# define AVL_MAP_STATS_INIT(v)
+# define AVL_MAP_STATS_ARG
+#endif
+
+// hint that the memory at p is read soon
+#if defined(__GNUC__)
+# define AVL_MAP_PREFETCH(p) __builtin_prefetch(p)
+#else
+# define AVL_MAP_PREFETCH(p) ((void)0)
+#endif
+
+// Shape of the tree as returned by avl_tree::shape_report(). Depths count
+// edges from the root, so the root has depth 0.
+struct avl_tree_shape
+{
+    size_t size;
+    size_t height;
+    size_t max_depth;
+    double average_depth;
+    std::vector<size_t> depth_histogram; // number of elements at each depth
+    double bytes_per_element;            // nodes, values and the tree object,
+                                         // excluding allocator overhead
+};
+
+#if __cplusplus >= 201103L
+// Heterogeneous lookup, as in C++14 std::map: when the comparator declares
+// is_transparent, lookups and erase accept any type it can compare with
+// key_type (say std::string_view for std::string keys) without building a
+// temporary key.
+template <typename...>
+struct avl_void { typedef void type; };
+
+template <typename C, typename = void>
+struct avl_is_transparent : std::false_type {};
+
+template <typename C>
+struct avl_is_transparent<C, typename avl_void<typename C::is_transparent>::type>
+: std::true_type {};
+#endif
+
+// Key normalizers for prefix caching. A normalizer maps keys to unsigned
+// integers whose order agrees with the comparator: a < b implies
+// norm(a) <= norm(b). Nodes then cache norm(key) next to the links, and
+// descents compare the cached integers, loading the key itself only when
+// they tie. A normalizer provides
+//
+//     typedef <unsigned integral type> prefix_type;
+//     enum { exact = 0 or 1 };    // 1 if equal prefixes imply equal keys
+//     prefix_type operator()(const K&) const;
+//
+// for the key type and, with a transparent comparator, every probe type.
+// Select one with avl_prefix_traits.
+
+// The 8 bytes of a string key that follow its first Skip bytes, big-endian
+// so that integer order is byte order (std::less<std::string> compares
+// bytes as unsigned char). Skip may only cover a part every key shares,
+// e.g. 8 for "https://" URLs, which would otherwise tie at every level.
+template <size_t Skip = 0>
+struct avl_string_prefix
+{
+    typedef uint64_t prefix_type;
+    enum { exact = 0 };
+    
+    prefix_type operator()(const std::string& s) const
+    {
+        return load(s.data(), s.size());
+    }
     
-	friend class node;
-    friend class value_compare;
+    prefix_type operator()(const char* s) const
+    {
+        return load(s, std::strlen(s));
+    }
     
-public:
-    typedef key                                          key_type;
-    typedef T										     mapped_type;
-    typedef std::pair<const key, T>                      value_type;
-    typedef compare                                      key_compare;
-    typedef alloc                                        allocator_type;
-    typedef typename allocator_type::pointer             pointer;
-    typedef typename allocator_type::const_pointer       const_pointer;
-    typedef typename allocator_type::reference           reference;
-    typedef typename allocator_type::const_reference     const_reference;
-    typedef size_t                                       size_type;
+#if __cplusplus >= 201703L
+    prefix_type operator()(std::string_view s) const
+    {
+        return load(s.data(), s.size());
+    }
+#endif
     
-    class value_compare : public std::binary_function<value_type, value_type, bool>
+    static prefix_type load(const char* p, size_t n)
     {
-    protected:
-        compare comp;
-        value_compare (compare c) : comp(c) {}  // constructed with tree's comparison object
-    public:
-        bool operator() (const value_type& x, const value_type& y) const
-        {
-            return comp(x.first, y.first);
+        if (n <= Skip) return 0;
+        p += Skip;
+        n -= Skip;
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        if (n >= sizeof(prefix_type)){
+            prefix_type v;
+            std::memcpy(&v, p, sizeof(v));
+            return __builtin_bswap64(v);
         }
-    };
+#endif
+        // shorter keys are padded with zero bytes, so "ab" and "ab\0" tie
+        prefix_type v = 0;
+        for (size_t i = 0; i < sizeof(prefix_type); ++i)
+            v = (v << 8) | (i < n ? (unsigned char)p[i] : 0);
+        return v;
+    }
+};
+
+// Integral keys compared with std::less: the prefix is the key itself, so
+// descents never load a value.
+struct avl_integer_prefix
+{
+    typedef uint64_t prefix_type;
+    enum { exact = 1 };
+    
+    template <typename K>
+    prefix_type operator()(const K& k) const
+    {
+        // flipping the sign bit makes unsigned order match signed order
+        if (std::numeric_limits<K>::is_signed)
+            return (prefix_type)(int64_t)k ^ ((prefix_type)1 << 63);
+        return (prefix_type)k;
+    }
+};
+
+// Balancing rules, the balance_policy of the traits below. Both keep one
+// integer per node in the height field and give the same trees as long as
+// nothing is erased.
+//
+// avl_height_balance is the classic AVL tree: the field is the exact height
+// and sibling heights differ by at most one.
+//
+// avl_weak_balance is the weak AVL (WAVL) tree of Haeupler, Sen and Tarjan:
+// the field is a rank, every child is one or two ranks below its parent
+// (an empty subtree has rank 0) and leaves have rank 1. Inserts rebalance
+// exactly as AVL; an erase demotes ranks on the way up and stops after at
+// most two rotations, with O(1) amortized rank changes. Heights stay below
+// 2 log2(n), against 1.44 log2(n) for AVL.
+struct avl_height_balance {};
+struct avl_weak_balance {};
+
+#if __cplusplus >= 201103L
+// Concurrency of avl_tree, the concurrency member of the traits below: void
+// for a tree used by one thread at a time, or avl_single_writer for one
+// writer thread beside any number of lock-free readers (avl_tree::reader).
+// Needs the GCC/Clang __atomic builtins.
+struct avl_single_writer {};
+#endif
+
+// Subtree digests, for avl_tree::diff(). A digest functor maps a key and
+// its mapped value to a 64-bit hash:
+//
+//     uint64_t operator()(const key_type&, const mapped_type&) const;
+//
+// Each node keeps the digest of its element, mixed, and the sum of those
+// over its subtree. A sum rather than a hash of the children's hashes,
+// because two trees holding the same elements need not have the same
+// shape: summed digests are the same for a key range whatever the shape,
+// so one tree's subtree can be checked against the other's range.
+inline uint64_t avl_digest_mix(uint64_t x)
+{
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+#if __cplusplus >= 201103L
+// std::hash of the key and of the mapped value
+struct avl_std_digest
+{
+    template <typename K, typename T>
+    uint64_t operator()(const K& k, const T& v) const
+    {
+        return avl_digest_mix(std::hash<K>()(k)) ^ std::hash<T>()(v);
+    }
+};
+#endif
+
+// what avl_tree::diff() reports for a key
+enum avl_diff_kind
+{
+    avl_diff_inserted = 1,  // only in the other tree
+    avl_diff_removed,       // only in this tree
+    avl_diff_changed        // in both, with different mapped values
+};
+
+// Compile-time options of avl_tree, its last template argument. Derive from
+// avl_default_traits and redefine the members to change.
+struct avl_default_traits
+{
+    // normalizer whose output nodes cache, void for none
+    typedef void key_normalizer;
+    // hash function of the point lookup index, void for none
+    typedef void hasher;
+    // avl_height_balance or avl_weak_balance
+    typedef avl_height_balance balance_policy;
+    // digest functor of the subtree digests diff() needs, void for none
+    typedef void digest;
+    // void, or avl_single_writer for lock-free readers
+    typedef void concurrency;
+};
+
+template <typename Normalizer>
+struct avl_prefix_traits : avl_default_traits
+{
+    typedef Normalizer key_normalizer;
+};
+
+template <typename Hash>
+struct avl_hash_traits : avl_default_traits
+{
+    typedef Hash hasher;
+};
+
+template <typename Policy>
+struct avl_balance_traits : avl_default_traits
+{
+    typedef Policy balance_policy;
+};
+
+template <typename Digest>
+struct avl_digest_traits : avl_default_traits
+{
+    typedef Digest digest;
+};
+
+template <typename Concurrency>
+struct avl_concurrency_traits : avl_default_traits
+{
+    typedef Concurrency concurrency;
+};
+
+// The cached prefix, a base of avl_tree's node. Empty without a normalizer,
+// where every comparison is undecided and falls through to the comparator.
+template <typename Normalizer>
+struct avl_key_prefix
+{
+    typedef typename Normalizer::prefix_type prefix_type;
+    enum { exact_prefix = Normalizer::exact };
+    
+    prefix_type prefix;
+    
+    template <typename K>
+    static prefix_type make_prefix(const K& k)
+    {
+        return Normalizer()(k);
+    }
     
-private:
-    struct node
+    template <typename K>
+    void set_prefix(const K& k)
     {
-        value_type* value;
-		size_type height;
-        node* parent; // needed by find(), insert(), etc. (the rb tree uses it too by the way)
-        node* left;
-        node* right;
-        int balance;
-        node()
-        {
-			value = 0;
-            parent = 0;
-            left = 0;
-            right = 0;
-            height = 1;
-            balance = 0;
-        }
-        
-        node(value_type &v, node &p, node &l, node &r){
-        	value = v;
-        	parent = p;
-        	left = l;
-        	right = r;
-        	update_balance();
-        }
-        
-        size_t left_height(){
-        	if (left!=0) return left->height; else return 0;
-        }
-        size_t right_height(){
-            if (right!=0) return right->height; else return 0;
+        prefix = Normalizer()(k);
+    }
+    
+    // <0 if the probe orders before this node's key, >0 if after, 0 if
+    // the prefixes cannot tell
+    int prefix_order(prefix_type p) const
+    {
+        return p < prefix ? -1 : (prefix < p ? 1 : 0);
+    }
+    
+    template <typename K>
+    bool prefix_matches(const K& k) const
+    {
+        return prefix == Normalizer()(k);
+    }
+};
+
+template <>
+struct avl_key_prefix<void>
+{
+    typedef int prefix_type;
+    enum { exact_prefix = 0 };
+    
+    template <typename K>
+    static prefix_type make_prefix(const K&)
+    {
+        return 0;
+    }
+    
+    template <typename K>
+    void set_prefix(const K&) {}
+    
+    int prefix_order(prefix_type) const
+    {
+        return 0;
+    }
+    
+    template <typename K>
+    bool prefix_matches(const K&) const
+    {
+        return true;
+    }
+};
+
+// The digests, a base of avl_tree's node; empty without a digest functor.
+template <typename Digest>
+struct avl_node_digest
+{
+    enum { has_digest = 1 };
+    
+    uint64_t own_digest;    // of this node's element
+    uint64_t digest;        // sum over the subtree
+    
+    avl_node_digest():own_digest(0), digest(0){}
+    
+    template <typename V>
+    void set_own_digest(const V& v)
+    {
+        own_digest = avl_digest_mix(Digest()(v.first, v.second));
+    }
+    
+    void swap_own_digest(avl_node_digest& other)
+    {
+        std::swap(own_digest, other.own_digest);
+    }
+    
+    void sum_digests(const avl_node_digest* l, const avl_node_digest* r)
+    {
+        digest = own_digest + (l != 0 ? l->digest : 0) + (r != 0 ? r->digest : 0);
+    }
+    
+    // whether both digests are what set_own_digest and sum_digests would set
+    template <typename V>
+    bool digests_match(const V& v, const avl_node_digest* l, const avl_node_digest* r) const
+    {
+        return own_digest == avl_digest_mix(Digest()(v.first, v.second))
+            && digest == own_digest + (l != 0 ? l->digest : 0) + (r != 0 ? r->digest : 0);
+    }
+};
+
+template <>
+struct avl_node_digest<void>
+{
+    enum { has_digest = 0 };
+    
+    template <typename V>
+    void set_own_digest(const V&) {}
+    void swap_own_digest(avl_node_digest&) {}
+    void sum_digests(const avl_node_digest*, const avl_node_digest*) {}
+    template <typename V>
+    bool digests_match(const V&, const avl_node_digest*, const avl_node_digest*) const
+    {
+        return true;
+    }
+};
+
+// Synchronization, a base of avl_tree's node. Every link the tree changes
+// while readers may be descending is stored through publish(), and a node
+// whose subtree is about to lose keys is bracketed by begin_shrink() and
+// end_shrink(); all of it is plain or empty for one thread at a time.
+template <typename Concurrency>
+struct avl_node_sync
+{
+    enum { shared = 0 };
+    
+    template <typename P>
+    static void publish(P& link, P x)
+    {
+        link = x;
+    }
+    
+    void begin_shrink() {}
+    void end_shrink() {}
+    bool quiescent() const { return true; }
+};
+
+#if __cplusplus >= 201103L
+// With a single writer, links are release stores that readers load with
+// acquire, and the version counts the writer's moves of keys out of the
+// node's subtree, odd while one is under way (see avl_tree::shared_descend).
+template <>
+struct avl_node_sync<avl_single_writer>
+{
+    enum { shared = 1 };
+    
+    unsigned version;
+    
+    avl_node_sync() : version(0) {}
+    
+    template <typename P>
+    static void publish(P& link, P x)
+    {
+        __atomic_store_n(&link, x, __ATOMIC_RELEASE);
+    }
+    
+    template <typename P>
+    static P acquire(const P& link)
+    {
+        return __atomic_load_n(&link, __ATOMIC_ACQUIRE);
+    }
+    
+    // only the writer changes versions, so it can read them plainly
+    void begin_shrink()
+    {
+        __atomic_store_n(&version, version + 1, __ATOMIC_RELAXED);
+    }
+    
+    void end_shrink()
+    {
+        __atomic_store_n(&version, version + 1, __ATOMIC_RELEASE);
+    }
+    
+    unsigned read_version() const
+    {
+        return __atomic_load_n(&version, __ATOMIC_ACQUIRE);
+    }
+    
+    // no move under way
+    bool quiescent() const
+    {
+        return (version & 1) == 0;
+    }
+};
+#endif
+
+// Epoch-based reclamation of the nodes and values that readers may still
+// hold; nothing for one thread at a time, where they are freed at once.
+template <typename Concurrency>
+class avl_epochs
+{
+public:
+    enum { shared = 0 };
+    
+    uint64_t current() const { return 0; }
+    uint64_t advance() { return 0; }
+};
+
+#if __cplusplus >= 201103L
+// Each reader claims a slot and, while it reads, announces there the epoch
+// it started in. The writer stamps what it unlinks with the epoch current
+// then, and frees it once the epoch has moved on and every announced epoch
+// is later than the stamp, when no reader can still reach it.
+template <>
+class avl_epochs<avl_single_writer>
+{
+public:
+    enum { shared = 1, max_readers = 128 };
+    
+    avl_epochs() : epoch_(1), slots_(new slot[max_readers]) {}
+    
+    // claims a free slot
+    size_t join() const
+    {
+        for (size_t i = 0; i < max_readers; ++i){
+            bool expected = false;
+            if (!slots_[i].used.load(std::memory_order_relaxed)
+                && slots_[i].used.compare_exchange_strong(expected, true, std::memory_order_acquire))
+                return i;
         }
-        
-        void __print(){
-        	std::cout << value->first << "<->" << value->second << "-height:" << height;
-        	if (parent != 0) std::cout << "-parent:" << parent->value->first
-                << "-left:" << (this==parent->left);
-        	std::cout << std::endl;
-        	if (left != 0 && left->height > 0) left->__print();
-        	if (right != 0 && right->height > 0) right->__print();
+        throw std::length_error("avl_tree: too many readers");
+    }
+    
+    void quit(size_t i) const
+    {
+        slots_[i].used.store(false, std::memory_order_release);
+    }
+    
+    // The fence orders the announcement before the reader's loads of the
+    // tree: a writer that then finds the slot empty has unlinked its nodes
+    // before the reader could see them.
+    void pin(size_t i) const
+    {
+        slots_[i].epoch.store(epoch_.load(std::memory_order_acquire), std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+    }
+    
+    void unpin(size_t i) const
+    {
+        slots_[i].epoch.store(0, std::memory_order_release);
+    }
+    
+    uint64_t current() const
+    {
+        return epoch_.load(std::memory_order_relaxed);
+    }
+    
+    // Starts a new epoch and returns the oldest one a reader may still be in.
+    uint64_t advance()
+    {
+        uint64_t oldest = epoch_.fetch_add(1, std::memory_order_seq_cst) + 1;
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        for (size_t i = 0; i < max_readers; ++i){
+            uint64_t e = slots_[i].epoch.load(std::memory_order_acquire);
+            if (e != 0 && e < oldest) oldest = e;
         }
+        return oldest;
+    }
+    
+private:
+    // two cache lines each, so that readers never share one
+    struct slot
+    {
+        std::atomic<uint64_t> epoch;
+        std::atomic<bool> used;
+        char pad[112];
         
-        void update_balance(){
-        	size_type lh = 0;
-        	size_type rh = 0;
-        	if (left) lh = left->height;
-        	if (right) rh = right->height;
-        	height = std::max(lh, rh) + 1;
-        	balance = (int)(lh - rh);
+        slot() : epoch(0), used(false) {}
+    };
+    
+    std::atomic<uint64_t> epoch_;
+    std::unique_ptr<slot[]> slots_;
+};
+#endif
+
+// Hash side index of avl_tree: an open addressing table from key to node,
+// so that find, count, at and operator[] on a present key cost one probe
+// instead of a descent. Linear probing with backward shift deletion (no
+// tombstones), at most 3/4 full. Slots keep the full hash, so a probe only
+// loads a key when the hashes match; matches are confirmed with the tree's
+// comparator (equivalence), which the hash must agree with.
+template <typename Node, typename Hash>
+class avl_hash_index
+{
+public:
+    enum { enabled = 1 };
+    
+    avl_hash_index() : size_(0) {}
+    
+    template <typename K, typename Compare>
+    Node* find(const K& k, const Compare& comp) const
+    {
+        if (size_ == 0) return 0;
+        size_t h = Hash()(k);
+        size_t mask = slots_.size() - 1;
+        for (size_t i = h & mask; slots_[i].node != 0; i = (i + 1) & mask){
+            const slot& s = slots_[i];
+            if (s.hash == h && !comp(k, s.node->value->first) && !comp(s.node->value->first, k))
+                return s.node;
         }
-        
-        ~node()
-        {
-			if (value != 0) delete value;
+        return 0;
+    }
+    
+    void insert(Node* n)
+    {
+        if ((size_ + 1) * 4 > slots_.size() * 3) grow();
+        place(Hash()(n->value->first), n);
+        ++size_;
+    }
+    
+    // n must be indexed under its current key
+    void erase(Node* n)
+    {
+        size_t mask = slots_.size() - 1;
+        size_t i = locate(n);
+        // shift later entries of the probe run back into the hole
+        for (size_t j = (i + 1) & mask; slots_[j].node != 0; j = (j + 1) & mask){
+            size_t home = slots_[j].hash & mask;
+            if (((j - home) & mask) >= ((j - i) & mask)){
+                slots_[i] = slots_[j];
+                i = j;
+            }
         }
-    };
+        slots_[i].node = 0;
+        --size_;
+    }
+    
+    // from now on the key indexed by from lives in to
+    void relink(Node* from, Node* to)
+    {
+        slots_[locate(from)].node = to;
+    }
+    
+    void clear()
+    {
+        std::vector<slot>().swap(slots_);
+        size_ = 0;
+    }
+    
+    void swap(avl_hash_index& other)
+    {
+        slots_.swap(other.slots_);
+        std::swap(size_, other.size_);
+    }
+    
+    size_t memory() const
+    {
+        return slots_.capacity() * sizeof(slot);
+    }
+    
+    size_t size() const
+    {
+        return size_;
+    }
+    
+private:
+    struct slot
+    {
+        Node* node;
+        size_t hash;
+    };
+    
+    std::vector<slot> slots_;   // power of two entries
+    size_t size_;
+    
+    size_t locate(const Node* n) const
+    {
+        size_t mask = slots_.size() - 1;
+        size_t i = Hash()(n->value->first) & mask;
+        while (slots_[i].node != n) i = (i + 1) & mask;
+        return i;
+    }
+    
+    void place(size_t h, Node* n)
+    {
+        size_t mask = slots_.size() - 1;
+        size_t i = h & mask;
+        while (slots_[i].node != 0) i = (i + 1) & mask;
+        slots_[i].node = n;
+        slots_[i].hash = h;
+    }
+    
+    void grow()
+    {
+        slot empty = { 0, 0 };
+        std::vector<slot> old(slots_.empty() ? 16 : slots_.size() * 2, empty);
+        old.swap(slots_);
+        for (size_t i = 0; i < old.size(); ++i)
+            if (old[i].node != 0) place(old[i].hash, old[i].node);
+    }
+};
+
+template <typename Node>
+class avl_hash_index<Node, void>
+{
+public:
+    enum { enabled = 0 };
+    
+    template <typename K, typename Compare>
+    Node* find(const K&, const Compare&) const { return 0; }
+    void insert(Node*) {}
+    void erase(Node*) {}
+    void relink(Node*, Node*) {}
+    void clear() {}
+    void swap(avl_hash_index&) {}
+    size_t memory() const { return 0; }
+    size_t size() const { return 0; }
+};
+
+#if __cplusplus >= 201103L
+// avl_tree::node_type: owns an element taken out of a tree by extract(),
+// node and value together, until it is inserted into a tree of the same
+// type or destroyed. Moving elements this way neither allocates nor copies.
+// Destroying a handle frees them as the tree would; with AVL_MAP_STATS it
+// counts them against the tree they came from, which must still exist.
+template <typename Node, typename Key, typename T, typename Alloc, typename Tree>
+class avl_node_handle
+{
+    friend Tree;
+public:
+    typedef Key                                          key_type;
+    typedef T                                            mapped_type;
+    typedef Alloc                                        allocator_type;
+    
+    avl_node_handle() NOEXCEPT : node_(0) AVL_MAP_STATS_INIT(0) {}
+    
+    avl_node_handle(avl_node_handle&& nh) NOEXCEPT : node_(nh.node_) AVL_MAP_STATS_INIT(nh.stats_)
+    {
+        nh.node_ = 0;
+    }
+    
+    avl_node_handle& operator=(avl_node_handle&& nh) NOEXCEPT
+    {
+        if (this != &nh){
+            reset();
+            node_ = nh.node_;
+            AVL_MAP_STATS_ONLY(stats_ = nh.stats_;)
+            nh.node_ = 0;
+        }
+        return *this;
+    }
+    
+    avl_node_handle(const avl_node_handle&) = delete;
+    avl_node_handle& operator=(const avl_node_handle&) = delete;
+    
+    ~avl_node_handle()
+    {
+        reset();
+    }
+    
+    bool empty() const NOEXCEPT
+    {
+        return node_ == 0;
+    }
+    
+    explicit operator bool() const NOEXCEPT
+    {
+        return node_ != 0;
+    }
+    
+    // the key may be changed before the handle is inserted again
+    key_type& key() const
+    {
+        return const_cast<key_type&>(node_->value->first);
+    }
+    
+    mapped_type& mapped() const
+    {
+        return node_->value->second;
+    }
+    
+    allocator_type get_allocator() const
+    {
+        return allocator_type();
+    }
+    
+    void swap(avl_node_handle& nh) NOEXCEPT
+    {
+        std::swap(node_, nh.node_);
+        AVL_MAP_STATS_ONLY(std::swap(stats_, nh.stats_);)
+    }
+    
+private:
+    explicit avl_node_handle(Node* n AVL_MAP_STATS_PARAM) : node_(n) AVL_MAP_STATS_INIT(s) {}
+    
+    void reset()
+    {
+        if (node_ != 0){
+#ifdef AVL_MAP_STATS
+            Tree::free_node(node_, stats_);
+#else
+            Tree::free_node(node_);
+#endif
+        }
+        node_ = 0;
+    }
+    
+    Node* node_;
+    AVL_MAP_STATS_ONLY(avl_tree_stats* stats_;)
+};
+#endif
+
+// On-disk layout written by avl_tree::save() and read back by avl_tree::load()
+// or mapped read-only by mapped_avl_map (avlmap_mmap.h). The header is followed
+// by `count` fixed-size records sorted by key, so the file body is a sorted
+// array that can be binary searched in place. Integers are in host byte order.
+struct avl_map_file_header
+{
+    enum { current_version = 1, byte_order_mark = 0x01020304 };
+    
+    char magic[8];          // "AVLMAP\0\0"
+    uint32_t version;
+    uint32_t byte_order;    // byte_order_mark as written by the producer
+    uint32_t header_size;   // offset of the first record
+    uint32_t record_size;
+    uint32_t key_size;
+    uint32_t mapped_size;
+    uint32_t mapped_offset; // offset of the mapped value inside a record
+    uint32_t reserved0;
+    uint64_t count;
+    char reserved[16];
+    
+    static const char* expected_magic() { return "AVLMAP\0\0"; }
+    
+    // throws std::runtime_error unless the header describes records of
+    // the given shape in a format this build understands
+    void validate(uint32_t rec_size, uint32_t k_size,
+                  uint32_t m_size, uint32_t m_offset) const
+    {
+        if (std::memcmp(magic, expected_magic(), sizeof(magic)) != 0)
+            throw std::runtime_error("avl map file: bad magic");
+        if (byte_order != byte_order_mark)
+            throw std::runtime_error("avl map file: byte order mismatch");
+        if (version != current_version)
+            throw std::runtime_error("avl map file: unsupported version");
+        if (header_size < sizeof(avl_map_file_header) || record_size != rec_size
+            || key_size != k_size || mapped_size != m_size || mapped_offset != m_offset)
+            throw std::runtime_error("avl map file: record layout mismatch");
+    }
+};
+
+// A single persisted element. Key and mapped value must be trivially copyable.
+template <typename key, typename T>
+struct avl_map_record
+{
+    key first;
+    T second;
+};
+
+template <typename key,
+typename T,
+typename compare = std::less<key>,
+typename alloc = std::allocator<std::pair<const key, T> >,
+typename traits = avl_default_traits>
+class avl_tree{
+    
+	friend class node;
+    friend class value_compare;
+    
+public:
+    typedef key                                          key_type;
+    typedef T										     mapped_type;
+    typedef std::pair<const key, T>                      value_type;
+    typedef compare                                      key_compare;
+    typedef alloc                                        allocator_type;
+    typedef traits                                       traits_type;
+    typedef typename allocator_type::pointer             pointer;
+    typedef typename allocator_type::const_pointer       const_pointer;
+    typedef typename allocator_type::reference           reference;
+    typedef typename allocator_type::const_reference     const_reference;
+    typedef size_t                                       size_type;
+    
+    class value_compare : public std::binary_function<value_type, value_type, bool>
+    {
+    protected:
+        compare comp;
+        value_compare (compare c) : comp(c) {}  // constructed with tree's comparison object
+    public:
+        bool operator() (const value_type& x, const value_type& y) const
+        {
+            return comp(x.first, y.first);
+        }
+    };
+    
+private:
+    typedef avl_key_prefix<typename traits::key_normalizer> key_prefix;
+    typedef typename traits::balance_policy balance_policy;
+    typedef typename key_prefix::prefix_type prefix_type;
+    typedef avl_node_digest<typename traits::digest> node_digest;
+    typedef avl_node_sync<typename traits::concurrency> node_sync;
+    typedef avl_epochs<typename traits::concurrency> epochs;
+    
+    struct node : key_prefix, node_digest, node_sync
+    {
+        value_type* value;
+		size_type height;
+        node* parent; // needed by find(), insert(), etc. (the rb tree uses it too by the way)
+        node* left;
+        node* right;
+        // The two fields share one word.
+        // balance is the left subtree's height minus the right one's,
+        // clamped to [-2, 2]. Rebalancing only needs its sign and whether
+        // it is more than one. Under relaxed balancing, stored heights can
+        // differ by more than 8 bits can hold, so the value is clamped.
+        // queued is the number of entries the node has on the relaxed
+        // balancing list. It saturates at 2^24 - 1 (max_queued) and then
+        // stays there until unlink() clears it.
+        signed balance : 8;
+        unsigned queued : 24;
+        node()
+        {
+			value = 0;
+            parent = 0;
+            left = 0;
+            right = 0;
+            height = 1;
+            balance = 0;
+            queued = 0;
+        }
+        
+        node(value_type &v, node &p, node &l, node &r){
+        	value = v;
+        	parent = p;
+        	left = l;
+        	right = r;
+        	update_balance();
+        }
+        
+        size_t left_height(){
+        	if (left!=0) return left->height; else return 0;
+        }
+        size_t right_height(){
+            if (right!=0) return right->height; else return 0;
+        }
+        
+        void __print(){
+        	std::cout << value->first << "<->" << value->second << "-height:" << height;
+        	if (parent != 0) std::cout << "-parent:" << parent->value->first
+                << "-left:" << (this==parent->left);
+        	std::cout << std::endl;
+        	if (left != 0 && left->height > 0) left->__print();
+        	if (right != 0 && right->height > 0) right->__print();
+        }
+        
+        void update_balance(){
+        	size_type lh = 0;
+        	size_type rh = 0;
+        	if (left) lh = left->height;
+        	if (right) rh = right->height;
+        	height = std::max(lh, rh) + 1;
+        	balance = lh > rh ? (int)std::min<size_type>(lh - rh, 2)
+        	: -(int)std::min<size_type>(rh - lh, 2);
+        	this->sum_digests(left, right);
+        }
+    };
+    
+    // nodes and values are allocated through default constructed copies of
+    // alloc, the allocator get_allocator() returns, rebound to their types
+#if __cplusplus >= 201103L
+    typedef typename std::allocator_traits<alloc>::template rebind_alloc<node> node_allocator;
+    typedef typename std::allocator_traits<alloc>::template rebind_alloc<value_type> value_allocator;
+#else
+    typedef typename alloc::template rebind<node>::other node_allocator;
+    typedef typename alloc::template rebind<value_type>::other value_allocator;
+#endif
+    
+public:
+    class const_iterator;
+    class iterator
+    :public std::iterator<std::bidirectional_iterator_tag, node>
+    {
+        friend class avl_tree;
+		friend class const_iterator;
+    public:
+        
+        iterator(node* n AVL_MAP_STATS_PARAM):node_(n)
+        AVL_MAP_STATS_INIT(s){}
+        
+        iterator():node_(0) AVL_MAP_STATS_INIT(0){}
+        
+        ~iterator(){}
+        
+        iterator(const iterator& it)
+        {
+            node_ = it.node_;
+            AVL_MAP_STATS_ONLY(stats_ = it.stats_;)
+        }
+        
+        iterator& operator=(const iterator& it)
+        {
+            node_ = it.node_;
+            AVL_MAP_STATS_ONLY(stats_ = it.stats_;)
+            return *this;
+        }
+        
+        iterator& operator++()
+        {
+            AVL_MAP_STATS_ONLY(if (stats_) ++stats_->iterator_increments;)
+            if(node_->right != 0)
+            {
+                node_ = node_->right;
+                while(node_->left != 0)
+                    node_ = node_->left;
+            }
+            else
+            {
+                node* temp;
+                do{
+                    temp = node_;
+                    node_ = node_->parent;
+                    if (node_!=0 && node_->left == temp) break;
+                } while(node_->parent != 0);
+            }
+            return *this;
+        }
+        
+        iterator operator++(int)
+        {
+            AVL_MAP_STATS_ONLY(if (stats_) ++stats_->iterator_increments;)
+            iterator temp1 = *this;
+            if(node_->right != 0)
+            {
+                node_ = node_->right;
+                while(node_->left != 0)
+                    node_ = node_->left;
+            }
+            else
+            {
+                node* temp;
+                do{
+                    temp = node_;
+                    node_ = node_->parent;
+                    if (node_!=0 && node_->left == temp) break;
+                } while(node_->parent != 0);
+            }
+            return temp1;
+        }
+        
+        iterator& operator--() {
+            AVL_MAP_STATS_ONLY(if (stats_) ++stats_->iterator_increments;)
+            if (node_ -> left != 0){
+                node_ = node_->left;
+                while(node_->right != 0) node_ = node_->right;
+            } else {
+                node* temp;
+                do {
+                    temp = node_;
+                    node_ = node_->parent;
+                    if (node_!=0 && node_->right == temp) break;
+                } while(node_->parent != 0);
+            }
+            return *this;
+        }
+        
+        iterator operator--(int) {
+            AVL_MAP_STATS_ONLY(if (stats_) ++stats_->iterator_increments;)
+            iterator temp1 = *this;
+            if (node_ -> left != 0){
+                node_ = node_->left;
+                while(node_->right != 0) node_ = node_->right;
+            } else {
+                node* temp;
+                do{
+                    temp = node_;
+                    node_ = node_->parent;
+                    if (node_!=0 && node_->right == temp) break;
+                } while(node_->parent != 0);
+            }
+            return temp1;
+        }
+        
+        // A mapped value assigned through the reference is not seen by the
+        // digests; a tree with a digest in its traits changes values with
+        // replace() instead.
+        typename avl_tree::reference operator*() const
+        {
+            return *(node_->value);
+        }
+        
+        typename avl_tree::pointer operator->() const
+        {
+            return node_->value;
+        }
+        
+        bool operator==(const iterator& it) const
+        {
+            return node_ == it.node_;
+        }
+        
+        bool operator!=(const iterator& it) const
+        {
+            return node_ != it.node_;
+        }
+        
+    private:
+        node* node_;
+        AVL_MAP_STATS_ONLY(avl_tree_stats* stats_;)
+    };
+	typedef iterator avliter;
+    class const_iterator
+    :public std::iterator<std::bidirectional_iterator_tag, node>
+    {
+        friend class avl_tree;
+	public:
+        
+        const_iterator(node* n AVL_MAP_STATS_PARAM):node_(n)
+        AVL_MAP_STATS_INIT(s){}
+        
+        const_iterator():node_(0) AVL_MAP_STATS_INIT(0){}
+        
+        ~const_iterator(){}
+        
+        const_iterator(const const_iterator& it)
+        {
+            node_ = it.node_;
+            AVL_MAP_STATS_ONLY(stats_ = it.stats_;)
+        }
+        
+        const_iterator& operator=(const avliter& it){
+            node_ = it.node_;
+            AVL_MAP_STATS_ONLY(stats_ = it.stats_;)
+            return *this;
+        }
+        
+        const_iterator& operator=(const const_iterator& it)
+        {
+            node_ = it.node_;
+            AVL_MAP_STATS_ONLY(stats_ = it.stats_;)
+            return *this;
+        }
+        
+        const_iterator& operator++()
+        {
+            AVL_MAP_STATS_ONLY(if (stats_) ++stats_->iterator_increments;)
+            if(node_->right != 0)
+            {
+                node_ = node_->right;
+                while(node_->left != 0)
+                    node_ = node_->left;
+            }
+            else
+            {
+                node* temp;
+                do{
+                    temp = node_;
+                    node_ = node_->parent;
+                    if (node_!=0 && node_->left == temp) break;
+                }while(node_->parent != 0);
+            }
+            return *this;
+        }
+        
+        const_iterator operator++(int)
+        {
+            AVL_MAP_STATS_ONLY(if (stats_) ++stats_->iterator_increments;)
+            const_iterator temp1 = *this;
+            if(node_->right != 0)
+            {
+                node_ = node_->right;
+                while(node_->left != 0)
+                    node_ = node_->left;
+            }
+            else
+            {
+                node* temp;
+                do{
+                    temp = node_;
+                    node_ = node_->parent;
+                    if (node_!=0 && node_->left == temp) break;
+                }while(node_->parent != 0);
+            }
+            return temp1;
+        }
+        
+        const_iterator& operator--() {
+            AVL_MAP_STATS_ONLY(if (stats_) ++stats_->iterator_increments;)
+            if (node_ -> left != 0){
+                node_ = node_->left;
+                while(node_->right != 0) node_ = node_->right;
+            } else {
+                node* temp;
+                do{
+                    temp = node_;
+                    node_ = node_->parent;
+                    if (node_!=0 && node_->right == temp) break;
+                }while(node_->parent != 0);
+            }
+            return *this;
+        }
+        
+        const_iterator operator--(int) {
+            AVL_MAP_STATS_ONLY(if (stats_) ++stats_->iterator_increments;)
+            const_iterator temp1 = *this;
+            if (node_ -> left != 0){
+                node_ = node_->left;
+                while(node_->right != 0) node_ = node_->right;
+            } else {
+                node* temp;
+                do{
+                    temp = node_;
+                    node_ = node_->parent;
+                    if (node_!=0 && node_->right == temp) break;
+                }while(node_->parent != 0);
+            }
+            return temp1;
+        }
+        
+        const_reference operator*() const
+        {
+            return *node_->value;
+        }
+        
+        const_pointer operator->() const
+        {
+            return node_->value;
+        }
+        
+        bool operator==(const iterator& it) const
+        {
+            return node_ == it.node_;
+        }
+        
+        bool operator==(const const_iterator& it) const
+        {
+            return node_ == it.node_;
+        }
+        
+        bool operator!=(const avliter& it) const{
+            return node_ != it.node_;
+        }
+        
+        bool operator!=(const const_iterator& it) const{
+            return node_ != it.node_;
+        }
+        
+    private:
+        node* node_;
+        AVL_MAP_STATS_ONLY(avl_tree_stats* stats_;)
+    };
+    
+    // Resumable in-order copy of a key range, from scan_from() or
+    // scan_after(). It keeps the ancestors still to visit on its own stack
+    // instead of climbing parent links, and prefetches the right child of
+    // the next node while copying the current one. The end of the range is
+    // found by comparing each key with the upper bound, through the cached
+    // prefixes where the traits have them, rather than by a second descent.
+    // Any change to the tree invalidates the cursor; to page across
+    // changes, start the next page with scan_after(last_key()).
+    class scan_cursor
+    {
+        friend class avl_tree;
+    public:
+        // Copies up to n elements into the columns keys and values, either
+        // of which may be null to skip it, and returns how many it copied.
+        size_type next(key_type* keys, mapped_type* values, size_type n)
+        {
+            size_type i = 0;
+            for (; i < n && !done(); ++i){
+                const value_type* v = step();
+                if (keys != 0) keys[i] = v->first;
+                if (values != 0) values[i] = v->second;
+            }
+            return i;
+        }
+        
+        // Writes up to n elements to out and returns out past the last one.
+        template <class OutputIterator>
+        OutputIterator next(OutputIterator out, size_type n)
+        {
+            for (; n > 0 && !done(); --n) *out++ = *step();
+            return out;
+        }
+        
+        bool done() const
+        {
+            return stack_.empty();
+        }
+        
+        // key of the last element copied; at least one must have been
+        const key_type& last_key() const
+        {
+            return last_->first;
+        }
+        
+    private:
+        const avl_tree* tree_;
+        key_type hi_;
+        prefix_type hi_prefix_;
+        std::vector<node*> stack_;  // the next node on top of its pending ancestors, empty when done
+        const value_type* last_;
+        
+        scan_cursor(const avl_tree* t, const key_type& hi)
+        :tree_(t), hi_(hi), hi_prefix_(key_prefix::make_prefix(hi)), last_(0){}
+        
+        // the stack's top is in range or the stack is empty
+        void check_top()
+        {
+            node* y = stack_.back();
+            if (tree_->less_node(hi_, hi_prefix_, y)) stack_.clear();
+        }
+        
+        const value_type* step()
+        {
+            node* x = stack_.back();
+            stack_.pop_back();
+            // barriers have no value and end the spine
+            for (node* y = x->right; y != 0 && y->value != 0; y = y->left){
+                // y's value and right subtree come after everything below y->left
+                AVL_MAP_PREFETCH(y->value);
+                if (y->right != 0) AVL_MAP_PREFETCH(y->right);
+                stack_.push_back(y);
+            }
+            if (!stack_.empty()) check_top();
+            last_ = x->value;
+            return last_;
+        }
+    };
+public:
+    typedef std::reverse_iterator<iterator>             reverse_iterator;
+    typedef std::reverse_iterator<const_iterator>       const_reverse_iterator;
+    typedef std::iterator_traits<iterator>              difference_type;
+    
+private:
+    typedef avl_hash_index<node, typename traits::hasher> hash_index;
+    
+    node* root_;
+    node* min_node_;
+    node* max_node_;
+    node* left_barrier;
+    node* right_barrier;
+    key_compare key_compare_;
+    size_type node_count_;
+    hash_index index_;
+    bool relaxed_;
+    size_type piggyback_budget_;
+    size_type max_pending_;
+    std::vector<node*> pending_;   // relaxed balancing: nodes to revisit
+    enum { max_queued = (1 << 24) - 1 };
+    epochs epochs_;
+    // single-writer mode: what was unlinked, by epoch, until no reader can
+    // hold it; a node with its value, or a replaced value alone
+    struct retired
+    {
+        uint64_t epoch;
+        node* n;
+        value_type* value;
+    };
+    std::vector<retired> retired_;
+    enum { retire_batch = 64 };    // retirements between reclaims
+#ifdef AVL_MAP_STATS
+    mutable avl_tree_stats stats_;
+#endif
+    
+public:
+	explicit avl_tree(const key_compare& comp = key_compare())
+    :key_compare_(comp), node_count_(0)
+	{
+        initialize();
+	}
+    
+	template <class InputIterator>
+	avl_tree(InputIterator first, InputIterator last,
+			 const key_compare& comp = key_compare())
+    :key_compare_(comp), node_count_(0)
+	{
+        initialize();
+		insert(first, last);
+	}
+    
+	avl_tree(const avl_tree& n)
+    :key_compare_(n.key_compare_), node_count_(0)
+    {
+		initialize();
+		insert(n.begin(), n.end());
+	}
+    
+	void erase(iterator first, iterator last){
+		while (first != last) erase(first++);
+	}
+    
+	void erase(iterator i){
+		retire_node(unlink(i.node_));
+	}
+    
+	size_type erase(const key_type& k){
+		return erase_key(k);
+	}
+    
+#if __cplusplus >= 201103L
+	template <typename K, typename C = key_compare,
+	typename = typename std::enable_if<avl_is_transparent<C>::value
+	&& !std::is_convertible<K, iterator>::value
+	&& !std::is_convertible<K, const_iterator>::value>::type>
+	size_type erase(const K& k){
+		return erase_key(k);
+	}
+#endif
+    
+#if __cplusplus >= 201103L
+    typedef avl_node_handle<node, key, T, alloc, avl_tree> node_type;
+    friend node_type;
+    
+    struct insert_return_type
+    {
+        iterator position;
+        bool inserted;
+        node_type node;     // the handle, if its key was already present
+    };
+    
+    // Unlinks the element from the tree without freeing it. As with erase,
+    // iterators to the element's predecessor are invalidated too.
+    node_type extract(iterator i)
+    {
+        return node_type(unlink(i.node_) AVL_MAP_STATS_ARG);
+    }
+    
+    // an empty handle if k is absent
+    node_type extract(const key_type& k)
+    {
+        return extract_key(k);
+    }
+    
+    template <typename K, typename C = key_compare,
+    typename = typename std::enable_if<avl_is_transparent<C>::value
+    && !std::is_convertible<K, iterator>::value
+    && !std::is_convertible<K, const_iterator>::value>::type>
+    node_type extract(const K& k)
+    {
+        return extract_key(k);
+    }
+    
+    // Links the handle's node into the tree unless its key is present, in
+    // which case the handle is returned in insert_return_type::node.
+    insert_return_type insert(node_type&& nh)
+    {
+        insert_return_type r;
+        r.inserted = false;
+        if (nh.empty()){
+            r.position = end();
+            return r;
+        }
+        remove_barrier();
+        std::pair<node*, bool> pos = get_insert_pos(nh.key());
+        if (pos.second){
+            r.position = iterator(pos.first AVL_MAP_STATS_ARG);
+            r.node = std::move(nh);
+        } else {
+            r.position = link_node(pos.first, nh.node_);
+            r.inserted = true;
+            nh.node_ = 0;
+        }
+        add_barrier();
+        return r;
+    }
+    
+    iterator insert(iterator _where, node_type&& nh)
+    {
+        return insert(std::move(nh)).position;
+    }
+#endif
+    
+    // Moves every element of source whose key is absent here into this
+    // tree by relinking its node: no allocation and no copy or move of keys
+    // and values. Elements with keys present here stay in source.
+    void merge(avl_tree& source)
+    {
+        if (&source == this) return;
+        iterator i = source.begin();
+        while (i != source.end()){
+            node* n = i.node_;
+            ++i;
+            remove_barrier();
+            std::pair<node*, bool> pos = get_insert_pos(n->value->first);
+            if (!pos.second) link_node(pos.first, source.unlink(n));
+            add_barrier();
+        }
+    }
+    
+    // Ordered-queue access, e.g. for a timer queue keyed by deadline. The
+    // extremes are cached, so peeks are O(1) and pops skip the descent;
+    // neither end node has two children, so a pop never swaps values and
+    // its rebalancing stops after O(1) amortized steps. The map must not be
+    // empty, except for drain_until().
+    value_type& peek_min()
+    {
+        return *min_node_->value;
+    }
+    
+    const value_type& peek_min() const
+    {
+        return *min_node_->value;
+    }
+    
+    value_type& peek_max()
+    {
+        return *max_node_->value;
+    }
+    
+    const value_type& peek_max() const
+    {
+        return *max_node_->value;
+    }
+    
+    value_type pop_min()
+    {
+        return take_value(unlink(min_node_));
+    }
+    
+    value_type pop_max()
+    {
+        return take_value(unlink(max_node_));
+    }
+    
+    // Pops every element whose key is not greater than k, in key order,
+    // writing them to out; with deadlines as keys, every timer due by k.
+    template <class OutputIterator>
+    OutputIterator drain_until(const key_type& k, OutputIterator out)
+    {
+        while (node_count_ > 0 && !key_less(k, min_node_->value->first)){
+            *out = take_value(unlink(min_node_));
+            ++out;
+        }
+        return out;
+    }
+    
+private:
+    // The value of a detached node, which is freed.
+    value_type take_value(node* n){
+#if __cplusplus >= 201103L
+        value_type v(take(*n->value, std::integral_constant<bool, node_sync::shared>()));
+#else
+        value_type v(*n->value);
+#endif
+        retire_node(n);
+        return v;
+    }
+    
+#if __cplusplus >= 201103L
+    // readers may still be reading a retired value, which is then copied
+    static value_type&& take(value_type& v, std::false_type)
+    {
+        return std::move(v);
+    }
+    
+    static const value_type& take(value_type& v, std::true_type)
+    {
+        return v;
+    }
+#endif
+    
+    // Takes the element of a out of the tree and returns the node holding
+    // it, detached. That is a itself unless a has two children, in which
+    // case a takes over the value of its in-order predecessor, which has no
+    // right child, and the predecessor's node is unlinked instead. In the
+    // single-writer mode, where readers may hold either value, the
+    // predecessor's node takes a's place instead and a is unlinked.
+    node* unlink(node* a){
+		remove_barrier();
+		index_.erase(a);
+		node* b = a;
+		node* child = 0;
+		node* parent;
+		if (node_sync::shared && a->left != 0 && a->right != 0){
+			a->begin_shrink();
+			parent = replace_with_predecessor(a);
+		} else {
+			if (a->left != 0 && a->right != 0){
+				b = a->left;
+				while (b->right != 0) b = b->right;
+				index_.relink(b, a);
+				value_type* temp = a->value;
+				a->value = b->value;
+				b->value = temp;
+				a->set_prefix(a->value->first);
+				a->swap_own_digest(*b);
+			}
+			child = (b->left != 0) ? b->left : b->right;
+			parent = b->parent;
+			b->begin_shrink();
+			if (child != 0) child->parent = parent;
+			replace_child(parent, b, child);
+		}
+		b->parent = 0;
+		node_sync::publish(b->left, (node*)0);
+		node_sync::publish(b->right, (node*)0);
+		b->end_shrink();
+		--node_count_;
+		if (b->queued != 0){
+			b->queued = 0;
+			pending_.erase(std::remove(pending_.begin(), pending_.end(), b), pending_.end());
+		}
+		// without a swap the neighbours of an extreme are at hand: the
+		// successor of the minimum is the leftmost node of its right subtree,
+		// or else its parent, and symmetrically for the maximum; look before
+		// rebalancing moves nodes around
+		if (a == b && min_node_ == a){
+			min_node_ = (child != 0) ? child : parent;
+			while (child != 0 && min_node_->left != 0) min_node_ = min_node_->left;
+		} else if (a == b && max_node_ == a){
+			max_node_ = (child != 0) ? child : parent;
+			while (child != 0 && max_node_->right != 0) max_node_ = max_node_->right;
+		}
+		refresh_digests(parent);
+		fix_after_erase(parent);
+		// a value swap can move the minimum into a, so check both nodes
+		if (min_node_ == a || min_node_ == b){
+			min_node_ = root_;
+			while (min_node_ != 0 && min_node_->left != 0) min_node_ = min_node_->left;
+		}
+		if (max_node_ == a || max_node_ == b){
+			max_node_ = root_;
+			while (max_node_ != 0 && max_node_->right != 0) max_node_ = max_node_->right;
+		}
+		add_barrier();
+		return b;
+	}
+    
+    // Links a's in-order predecessor b into a's place, for unlink() in the
+    // single-writer mode, and returns the node rebalancing starts from:
+    // b's old parent, or b if that was a. b takes a's height, so the tree
+    // is then as after the value swap. The nodes between a and b lose b
+    // from their subtrees and are marked for the readers meanwhile; b is
+    // out of the tree while its links change, so no reader meets a cycle.
+    node* replace_with_predecessor(node* a){
+		node* l = a->left;
+		node* b = l;
+		while (b->right != 0) b = b->right;
+		node* start = (b == l) ? b : b->parent;
+		for (node* x = l; x != b; x = x->right) x->begin_shrink();
+		b->begin_shrink();
+		if (b != l){
+			node_sync::publish(start->right, b->left);
+			if (b->left != 0) b->left->parent = start;
+			node_sync::publish(b->left, l);
+			l->parent = b;
+		}
+		node_sync::publish(b->right, a->right);
+		a->right->parent = b;
+		b->parent = a->parent;
+		b->height = a->height;
+		b->balance = a->balance;
+		replace_child(a->parent, a, b);
+		b->end_shrink();
+		for (node* x = l; x != b; x = x->right){
+			x->end_shrink();
+			if (x == start) break;
+		}
+		// a's place may be waiting for relaxed balancing
+		if (a->queued != 0) queue_node(b);
+		return start;
+	}
+    
+    // Points the link to old, parent's or the root, at x.
+    void replace_child(node* parent, node* old, node* x){
+		if (parent == 0) node_sync::publish(root_, x);
+		else if (parent->left == old) node_sync::publish(parent->left, x);
+		else node_sync::publish(parent->right, x);
+	}
+    
+    // Frees a detached node, or in the single-writer mode queues it until
+    // no reader can hold it.
+    void retire_node(node* n){
+		if (!epochs::shared){
+			delete_node(n);
+			return;
+		}
+		retired r = { epochs_.current(), n, 0 };
+		retired_.push_back(r);
+		if (retired_.size() % retire_batch == 0) reclaim();
+	}
+    
+    void retire_value(value_type* v){
+		retired r = { epochs_.current(), 0, v };
+		retired_.push_back(r);
+		if (retired_.size() % retire_batch == 0) reclaim();
+	}
+    
+    // frees the first n retired entries
+    void free_retired(size_type n){
+		for (size_type i = 0; i < n; ++i){
+			if (retired_[i].n != 0) delete_node(retired_[i].n);
+			else {
+				AVL_MAP_COUNT(deallocations);
+				delete_value(retired_[i].value);
+			}
+		}
+		retired_.erase(retired_.begin(), retired_.begin() + n);
+	}
+    
+public:
+    
+	template <class InputIterator>
+	void insert(InputIterator first, InputIterator last)
+	{
+		for(; first != last; ++first)
+		{
+			insert(*first);
+		}
+    }
+	
+	// The position is searched from the hint, as by lower_bound(_where, k),
+	// so inserting a sorted run with each result as the next hint costs
+	// O(log d) per key d positions from the previous one.
+	iterator insert(iterator _where, const value_type& val){
+		remove_barrier();
+		std::pair<node*, bool> pos = get_insert_pos_near(_where.node_, val.first);
+		iterator it = pos.second ? iterator(right_barrier AVL_MAP_STATS_ARG)
+		: insert_impl(pos.first, new_value(val));
+		add_barrier();
+		return it;
+	}
+    
+    std::pair<iterator, bool>
+    insert(const value_type& val)
+	{
+    	remove_barrier();
+        std::pair<node*, bool> pos = get_insert_pos(val.first);
+        iterator it = pos.second ? iterator(pos.first AVL_MAP_STATS_ARG)
+        : insert_impl(pos.first, new_value(val));
+        add_barrier();
+        return std::pair<iterator, bool>(it, !pos.second);
+	}
+	
+	std::pair<iterator, bool>
+	emplace(const value_type& val){
+		return insert(val);
+	}
+	
+	std::pair<iterator, bool>
+	emplace_hint(const_iterator where, const value_type& val){
+		return insert(val);
+	}
+	
+	std::pair<iterator, bool>
+	emplace_hint(iterator where, const value_type& val){
+		return insert(val);
+	}
+	
+    // With a digest in the traits, a value assigned through the returned
+    // reference leaves the digests stale: insert the key this way if need
+    // be, then store the value with replace().
+    mapped_type&
+    operator[](const key_type& k)
+    {
+        return subscript(k);
+    }
+    
+#if __cplusplus >= 201103L
+    // builds a key_type from k only when the key has to be inserted
+    template <typename K, typename C = key_compare,
+    typename = typename std::enable_if<avl_is_transparent<C>::value>::type>
+    mapped_type&
+    operator[](const K& k)
+    {
+        return subscript(k);
+    }
+#endif
+    
+    
+    ~avl_tree(){
+        clear();
+        delete_node(left_barrier);
+        delete_node(right_barrier);
+    }
+    
+    //
+    
+    void __print(){
+    	if (root_ != 0) root_->__print();
+    }
+    
+    // Walks the whole tree; O(n).
+    avl_tree_shape shape_report() const
+    {
+        avl_tree_shape r;
+        r.size = node_count_;
+        r.average_depth = 0;
+        shape_walk(root_, 0, r);
+        // counted rather than read from the root, whose height is stale
+        // while relaxed balancing has work pending
+        r.height = r.depth_histogram.size();
+        r.max_depth = r.depth_histogram.empty() ? 0 : r.depth_histogram.size() - 1;
+        if (node_count_ > 0){
+            r.average_depth /= (double)node_count_;
+            // two barrier nodes besides one node per element
+            r.bytes_per_element = (double)((node_count_ + 2) * sizeof(node)
+                                           + node_count_ * sizeof(value_type)
+                                           + index_.memory()
+                                           + sizeof(*this)) / (double)node_count_;
+        } else {
+            r.bytes_per_element = 0;
+        }
+        return r;
+    }
+    
+    // Checks the links, the key order, the size, the barriers and every
+    // height, balance, prefix, digest and index entry against what the
+    // tree's rules say they should be, and throws std::logic_error naming
+    // the first that is not. While relaxed balancing has work pending only
+    // the nodes off the list are held to the balance rule. For tests; O(n).
+    void check_invariants() const
+    {
+        if (root_ != 0 && root_->parent != 0) invariant_failed("root parent link");
+        const node* prev = 0;
+        size_type count = 0, queued = 0;
+        bool saturated = false;
+        check_walk(root_, 0, prev, count, queued, saturated);
+        if (count != node_count_) invariant_failed("size");
+        if (hash_index::enabled && index_.size() != node_count_) invariant_failed("hash index size");
+        if (!saturated && queued != pending_.size()) invariant_failed("queued counts");
+        if (!relaxed_ && !pending_.empty()) invariant_failed("pending list");
+        check_barrier(left_barrier);
+        check_barrier(right_barrier);
+        if (node_count_ == 0){
+            if (root_ != 0 || left_barrier->parent != 0 || right_barrier->parent != 0)
+                invariant_failed("empty tree");
+            return;
+        }
+        const node* first = root_;
+        while (first->left != 0 && first->left->value != 0) first = first->left;
+        const node* last = root_;
+        while (last->right != 0 && last->right->value != 0) last = last->right;
+        if (min_node_ != first || max_node_ != last) invariant_failed("min or max node");
+        if (min_node_->left != left_barrier || left_barrier->parent != min_node_
+            || max_node_->right != right_barrier || right_barrier->parent != max_node_)
+            invariant_failed("barrier links");
+    }
+    
+    // Relaxed balancing, for write bursts. While it is on, insert and erase
+    // only link or unlink their node and queue its parent, whose height may
+    // now be off; the height updates and rotations happen later, one node
+    // per step, as the eager pass would do them but stopping as soon as a
+    // height no longer changes. Every mutation runs up to
+    // piggyback_budget steps, newest work first, and rebalance_some() runs
+    // more, e.g. from an idle loop or from a thread holding the writers'
+    // lock. Lookups are unaffected apart from the height, which stays within
+    // about one level per queued step of the AVL bound; a mutation that
+    // takes the list past max_pending works it back down to the cap. The
+    // steps follow the AVL rules under either balance_policy: what they
+    // build also satisfies the weak AVL rank rule.
+    void relax_balancing(size_type piggyback_budget = 2, size_type max_pending = 256)
+    {
+        relaxed_ = true;
+        piggyback_budget_ = piggyback_budget;
+        max_pending_ = max_pending;
+    }
+    
+    // Runs everything queued and goes back to rebalancing eagerly.
+    void strict_balancing()
+    {
+        rebalance_some((size_type)-1);
+        relaxed_ = false;
+    }
+    
+    bool relaxed_balancing() const NOEXCEPT
+    {
+        return relaxed_;
+    }
+    
+    // Number of rebalancing steps queued.
+    size_type rebalance_pending() const NOEXCEPT
+    {
+        return pending_.size();
+    }
+    
+    // Runs up to budget rebalancing steps and returns the number still
+    // queued. A step can queue more than it takes off the list; any
+    // excess over max_pending is worked off before returning.
+    size_type rebalance_some(size_type budget)
+    {
+        if (pending_.empty()) return 0;
+        remove_barrier();
+        for (; budget > 0 && !pending_.empty(); --budget) settle_step();
+        while (pending_.size() > max_pending_) settle_step();
+        add_barrier();
+        return pending_.size();
+    }
+    
+#ifdef AVL_MAP_STATS
+    const avl_tree_stats& stats() const NOEXCEPT
+    {
+        return stats_;
+    }
+    
+    void reset_stats() NOEXCEPT
+    {
+        stats_.reset();
+    }
+#endif
+    
+    
+	bool operator== (const avl_tree& rhs ){
+		if (size() != rhs.size()) return false;
+		else {
+			if (size() == 0) return true;
+			iterator i = begin();
+			const_iterator j = rhs.begin();
+			while (i != end() && j != rhs.end()){
+				if ((*i) != (*j)) return false;
+				i++; j++;
+			}
+			return true;
+		}
+	}
+    
+	bool operator!= (const avl_tree& rhs ){
+		if (size() != rhs.size()) return true;
+		else {
+			if (size() == 0) return false;
+			iterator i = begin();
+			const_iterator j = rhs.begin();
+			while (i != end() && j != rhs.end()){
+				if ((*i) != (*j)) return true;
+				i++; j++;
+			}
+			return false;
+		}
+	}
+    
+	bool operator< (const avl_tree& rhs ){
+		if (size() == 0) return false;
+		iterator i = begin();
+		const_iterator j = rhs.begin();
+		while (i != end() && j != rhs.end()){
+			if ((*i) < (*j)) return true;
+			else if ((*i) > (*j)) return false;
+			i++; j++;
+		}
+		if (i == end()){
+			if (j == rhs.end()) return false;
+			else return true;
+		} else return false;
+	}
+    
+	bool operator<= (const avl_tree& rhs ){
+		if (size() == 0) return false;
+		iterator i = begin();
+		const_iterator j = rhs.begin();
+		while (i != end() && j != rhs.end()){
+			if ((*i) < (*j)) return true;
+			else if ((*i) > (*j)) return false;
+			i++; j++;
+		}
+		if (i == end()){
+			if (j == rhs.end()) return true;
+			else return true;
+		} else return false;
+	}
+    
+	bool operator> (const avl_tree& rhs ){
+		if (size() == 0) return false;
+		iterator i = begin();
+		const_iterator j = rhs.begin();
+		while (i != end() && j != rhs.end()){
+			if ((*i) < (*j)) return false;
+			else if ((*i) > (*j)) return true;
+			i++; j++;
+		}
+		if (i == end()){
+			if (j == rhs.end()) return false;
+			else return false;
+		} else return true;
+	}
+    
+	bool operator>= (const avl_tree& rhs ){
+		if (size() == 0) return false;
+		iterator i = begin();
+		const_iterator j = rhs.begin();
+		while (i != end() && j != rhs.end()){
+			if ((*i) < (*j)) return false;
+			else if ((*i) > (*j)) return true;
+			i++; j++;
+		}
+		if (i == end()){
+			if (j == rhs.end()) return true;
+			else return false;
+		} else return true;
+	}
+    
+	avl_tree& operator= (const avl_tree& n){
+		clear();
+		const_iterator it;
+		for (it = n.begin(); it != n.end(); it++){
+			insert(*it);
+		}
+		return *this;
+	}
+    
+    // A copy, so it cannot change the digests; values of a tree with a
+    // digest in its traits are changed with replace().
+    mapped_type at(const key_type &k){
+    	iterator res = find(k);
+    	if (res == end()) throw std::out_of_range("key doesn't exist");
+    	return res.node_->value->second;
+    }
+    
+    const mapped_type& at(const key_type &k) const{
+    	const_iterator res = find(k);
+    	if (res == end()) throw std::out_of_range("key doesn't exist");
+    	return res->second;
+    }
+    
+    
+    
+	const_iterator begin() const NOEXCEPT
+	{
+        return const_iterator(empty() ? right_barrier : min_node_
+                              AVL_MAP_STATS_ARG);
+	}
+    
+	iterator begin() NOEXCEPT
+    {
+        return iterator(empty() ? right_barrier : min_node_
+                        AVL_MAP_STATS_ARG);
+    }
+    
+	const_iterator cbegin() const NOEXCEPT
+	{
+        return begin();
+	}
+    
+    reverse_iterator rbegin() NOEXCEPT
+    {
+        return reverse_iterator(iterator(max_node_));
+    }
+    
+    const_reverse_iterator rbegin() const NOEXCEPT
+    {
+        return const_reverse_iterator(iterator(max_node_));
+    }
+    
+    const_reverse_iterator crbegin() const NOEXCEPT
+    {
+        return const_reverse_iterator(iterator(max_node_));
+    }
+    
+    //
+    
+    iterator end() NOEXCEPT
+    {
+        return iterator(right_barrier);
+    }
+    
+    const_iterator end() const NOEXCEPT
+    {
+        return const_iterator(right_barrier);
+    }
+    
+    const_iterator cend() const NOEXCEPT
+    {
+        return const_iterator(right_barrier);
+    }
+    
+    reverse_iterator rend() NOEXCEPT
+    {
+        return reverse_iterator(left_barrier);
+    }
+    
+    const_reverse_iterator rend() const NOEXCEPT
+    {
+        return const_reverse_iterator(left_barrier);
+    }
+    
+    const_reverse_iterator crend() const NOEXCEPT
+    {
+        return const_reverse_iterator(left_barrier);
+    }
+    
+    //
+    
+    bool empty() const NOEXCEPT
+    {
+        return (node_count_ == 0);
+    }
+    
+    void clear(){
+    	remove_barrier();
+    	index_.clear();
+    	free_mem(root_);
+    	root_ = 0;
+    	min_node_ = 0;
+    	max_node_ = 0;
+    	node_count_ = 0;
+    	pending_.clear();
+    	free_retired(retired_.size());
+    }
+    
+    size_type size() const NOEXCEPT
+    {
+        return node_count_;
+    }
+    
+    iterator find(const key_type& k)
+    {
+        return iterator(find_node(k) AVL_MAP_STATS_ARG);
+    }
+    
+    const_iterator find(const key_type& k) const
+    {
+        return const_iterator(find_node(k) AVL_MAP_STATS_ARG);
+    }
+    
+    iterator lower_bound(const key_type& k)
+    {
+        return iterator(lower_bound_node(k) AVL_MAP_STATS_ARG);
+    }
+    
+    const_iterator lower_bound(const key_type& k) const
+    {
+        return const_iterator(lower_bound_node(k) AVL_MAP_STATS_ARG);
+    }
+    
+    iterator upper_bound(const key_type& k)
+    {
+        return iterator(upper_bound_node(k) AVL_MAP_STATS_ARG);
+    }
+    
+    const_iterator upper_bound(const key_type& k) const
+	{
+		return const_iterator(upper_bound_node(k) AVL_MAP_STATS_ARG);
+	}
+    
+    // Finger search: lower_bound(k) and find(k), starting from finger
+    // instead of the root. The cost is logarithmic in the distance between
+    // the finger and the result, so probes near a previous result are cheap.
+    iterator lower_bound(iterator finger, const key_type& k)
+    {
+        prefix_type p = key_prefix::make_prefix(k);
+        return iterator(lower_bound_near(finger.node_, k, p) AVL_MAP_STATS_ARG);
+    }
+    
+    const_iterator lower_bound(const_iterator finger, const key_type& k) const
+    {
+        prefix_type p = key_prefix::make_prefix(k);
+        return const_iterator(lower_bound_near(finger.node_, k, p) AVL_MAP_STATS_ARG);
+    }
+    
+    iterator find(iterator finger, const key_type& k)
+    {
+        return iterator(find_near(finger.node_, k) AVL_MAP_STATS_ARG);
+    }
     
-public:
-    class const_iterator;
-    class iterator
-    :public std::iterator<std::bidirectional_iterator_tag, node>
+    const_iterator find(const_iterator finger, const key_type& k) const
     {
-        friend class avl_tree;
-		friend class const_iterator;
-    public:
-        
-        iterator(node* n):node_(n){}
-        
-        iterator():node_(0){}
-        
-        ~iterator(){}
-        
-        iterator(const iterator& it)
-        {
-            node_ = it.node_;
-        }
-        
-        iterator& operator=(const iterator& it)
-        {
-            node_ = it.node_;
-            return *this;
-        }
-        
-        iterator& operator++()
-        {
-            if(node_->right != 0)
-            {
-                node_ = node_->right;
-                while(node_->left != 0)
-                    node_ = node_->left;
-            }
-            else
-            {
-                node* temp;
-                do{
-                    temp = node_;
-                    node_ = node_->parent;
-                    if (node_!=0 && node_->left == temp) break;
-                } while(node_->parent != 0);
-            }
-            return *this;
-        }
-        
-        iterator operator++(int)
-        {
-            iterator temp1 = *this;
-            if(node_->right != 0)
-            {
-                node_ = node_->right;
-                while(node_->left != 0)
-                    node_ = node_->left;
-            }
-            else
-            {
-                node* temp;
-                do{
-                    temp = node_;
-                    node_ = node_->parent;
-                    if (node_!=0 && node_->left == temp) break;
-                } while(node_->parent != 0);
-            }
-            return temp1;
-        }
-        
-        iterator& operator--() {
-            if (node_ -> left != 0){
-                node_ = node_->left;
-                while(node_->right != 0) node_ = node_->right;
-            } else {
-                node* temp;
-                do {
-                    temp = node_;
-                    node_ = node_->parent;
-                    if (node_!=0 && node_->right == temp) break;
-                } while(node_->parent != 0 && node_ == node_->parent->left);
-            }
-            return *this;
-        }
-        
-        iterator operator--(int) {
-            iterator temp1 = *this;
-            if (node_ -> left != 0){
-                node_ = node_->left;
-                while(node_->right != 0) node_ = node_->right;
-            } else {
-                node* temp;
-                do{
-                    temp = node_;
-                    node_ = node_->parent;
-                    if (node_!=0 && node_->right == temp) break;
-                } while(node_->parent != 0 && node_ == node_->parent->left);
-            }
-            return temp1;
-        }
-        
-        typename avl_tree::reference operator*() const
-        {
-            return *(node_->value);
+        return const_iterator(find_near(finger.node_, k) AVL_MAP_STATS_ARG);
+    }
+    
+    // Writes lower_bound(k) for each k in [first, last), which must be
+    // sorted ascending, searching each from the previous result. For a
+    // merge join of a sorted stream against the map, O(m log(n/m)) rather
+    // than O(m log n) for m keys. With a transparent comparator the keys
+    // may be of any type it accepts.
+    template <class InputIterator, class OutputIterator>
+    OutputIterator lower_bound_sorted(InputIterator first, InputIterator last,
+                                      OutputIterator out)
+    {
+        node* finger = empty() ? right_barrier : min_node_;
+        for (; first != last; ++first){
+            // once past the end, every later key is too
+            if (finger != right_barrier)
+                finger = lower_bound_near(finger, *first, key_prefix::make_prefix(*first));
+            *out++ = iterator(finger AVL_MAP_STATS_ARG);
         }
-        
-        typename avl_tree::pointer operator->() const
-        {
-            return node_->value;
+        return out;
+    }
+    
+    template <class InputIterator, class OutputIterator>
+    OutputIterator lower_bound_sorted(InputIterator first, InputIterator last,
+                                      OutputIterator out) const
+    {
+        node* finger = empty() ? right_barrier : min_node_;
+        for (; first != last; ++first){
+            if (finger != right_barrier)
+                finger = lower_bound_near(finger, *first, key_prefix::make_prefix(*first));
+            *out++ = const_iterator(finger AVL_MAP_STATS_ARG);
         }
-        
-        bool operator==(const iterator& it) const
-        {
-            return node_ == it.node_;
+        return out;
+    }
+    
+    // Copies the elements with keys in [lo, hi] to out in key order, at
+    // most limit of them, and returns out past the last one: the loop from
+    // lower_bound(lo) to upper_bound(hi), without the parent climbing.
+    template <class OutputIterator>
+    OutputIterator scan(const key_type& lo, const key_type& hi, OutputIterator out,
+                        size_type limit = std::numeric_limits<size_type>::max()) const
+    {
+        scan_cursor c = scan_from(lo, hi);
+        return c.next(out, limit);
+    }
+    
+    // Writes lower_bound(k) for each k in [first, last), in any order.
+    // The descents run interleaved, a group of keys one level at a time
+    // with the next level prefetched, so that their cache misses overlap
+    // instead of following each other. For batches of lookups into a tree
+    // much larger than the cache; a sorted batch dense enough that
+    // neighbouring keys are a few positions apart is better served by
+    // lower_bound_sorted().
+    template <class ForwardIterator, class OutputIterator>
+    OutputIterator lower_bound_batch(ForwardIterator first, ForwardIterator last,
+                                     OutputIterator out)
+    {
+        node* found[batch_group];
+        while (first != last){
+            size_type n = lower_bound_group(first, last, found);
+            for (size_type i = 0; i < n; ++i) *out++ = iterator(found[i] AVL_MAP_STATS_ARG);
         }
-        
-        bool operator!=(const iterator& it) const
-        {
-            return node_ != it.node_;
+        return out;
+    }
+    
+    template <class ForwardIterator, class OutputIterator>
+    OutputIterator lower_bound_batch(ForwardIterator first, ForwardIterator last,
+                                     OutputIterator out) const
+    {
+        node* found[batch_group];
+        while (first != last){
+            size_type n = lower_bound_group(first, last, found);
+            for (size_type i = 0; i < n; ++i) *out++ = const_iterator(found[i] AVL_MAP_STATS_ARG);
         }
-        
-    private:
-        node* node_;
+        return out;
+    }
+    
+    // A scan_cursor over the keys in [lo, hi].
+    scan_cursor scan_from(const key_type& lo, const key_type& hi) const
+    {
+        return make_scan_cursor(lo, hi, false);
+    }
+    
+    // A scan_cursor over the keys in (k, hi], for the page after one that
+    // ended at k.
+    scan_cursor scan_after(const key_type& k, const key_type& hi) const
+    {
+        return make_scan_cursor(k, hi, true);
+    }
+    
+    // One difference found by diff(): the element of the other tree for
+    // an inserted or changed key, of this tree for a removed one.
+    struct diff_entry
+    {
+        avl_diff_kind kind;
+        const value_type* element;
     };
-	typedef iterator avliter;
-    class const_iterator
-    :public std::iterator<std::bidirectional_iterator_tag, node>
+    
+    // Writes the differences that turn this tree into other to out, in key
+    // order, and returns out past the last one. Needs a digest in the
+    // traits. Each subtree of this tree is compared by digest with the
+    // same key range of other and skipped if they agree, so the cost is
+    // O((d + 1) log^2 n) for d differences rather than a walk of both
+    // trees. Inserted keys cost O(log n) each: a run of them is found in
+    // other by an upper_bound descent and listed by iterator steps, each
+    // O(log n) at worst.
+    template <class OutputIterator>
+    OutputIterator diff(const avl_tree& other, OutputIterator out) const
     {
-	public:
-        
-        const_iterator(node* n):node_(n){}
-        
-        const_iterator():node_(0){}
-        
-        ~const_iterator(){}
-        
-        const_iterator(const const_iterator& it)
-        {
-            node_ = it.node_;
-        }
-        
-        const_iterator& operator=(const avliter& it){
-            node_ = it.node_;
-            return *this;
-        }
-        
-        const_iterator& operator=(const const_iterator& it)
-        {
-            node_ = it.node_;
-            return *this;
+        assert_digest();
+        return diff_subtree(other, root_, 0, 0, out);
+    }
+    
+    // Digest of the whole content, equal for trees with the same elements
+    // whatever their shapes. Needs a digest in the traits.
+    uint64_t content_digest() const
+    {
+        assert_digest();
+        return root_ != 0 ? root_->digest : 0;
+    }
+    
+    // Mapped values assigned in place, through an iterator or operator[],
+    // are not seen by the digests until their element is rehashed; every
+    // other change, replace() included, keeps them current.
+    void rehash(iterator i)
+    {
+        i.node_->set_own_digest(*i.node_->value);
+        refresh_digests(i.node_);
+    }
+    
+    // Stores v as the mapped value of i. In the single-writer mode, where
+    // readers may be reading the old value, a new value is published whole
+    // and the old one reclaimed later; otherwise this assigns in place.
+    void replace(iterator i, const mapped_type& v)
+    {
+        node* x = i.node_;
+        if (!epochs::shared) x->value->second = v;
+        else {
+            value_type* old = x->value;
+            node_sync::publish(x->value, new_value(value_type(old->first, v)));
+            retire_value(old);
         }
-        
-        const_iterator& operator++()
+        x->set_own_digest(*x->value);
+        refresh_digests(x);
+    }
+    
+    // Single-writer mode: frees what was unlinked before every current
+    // reader started. Done every 64 erases anyway.
+    void reclaim()
+    {
+        if (retired_.empty()) return;
+        uint64_t oldest = epochs_.advance();
+        size_type n = 0;
+        while (n < retired_.size() && retired_[n].epoch < oldest) ++n;
+        free_retired(n);
+    }
+    
+#if __cplusplus >= 201103L
+    // Lock-free reads beside one writer, for trees whose traits have
+    // avl_single_writer as concurrency. Every reading thread registers a
+    // reader with the tree (at most 128 at a time) and reads inside a
+    // read_guard, which keeps what it returns from being freed:
+    //
+    //     tree_type::reader r(tree);
+    //     {
+    //         tree_type::read_guard g(r);
+    //         const tree_type::value_type* v = g.find(k);  // valid in g
+    //     }
+    //
+    // find and contains are linearizable. lower_bound returns an element
+    // present at some point of the call. The writer thread uses the rest
+    // of the interface as usual, except that mapped values readers may see
+    // change through replace(), and that clear, swap, assignment, load,
+    // extract, node handles and merge need every read_guard closed.
+    class read_guard;
+    
+    class reader
+    {
+        friend class read_guard;
+    public:
+        explicit reader(const avl_tree& t) : tree_(&t), slot_(t.epochs_.join())
         {
-            if(node_->right != 0)
-            {
-                node_ = node_->right;
-                while(node_->left != 0)
-                    node_ = node_->left;
-            }
-            else
-            {
-                node* temp;
-                do{
-                    temp = node_;
-                    node_ = node_->parent;
-                    if (node_!=0 && node_->left == temp) break;
-                }while(node_->parent != 0);
-            }
-            return *this;
+            static_assert(epochs::shared, "readers need avl_single_writer as concurrency");
         }
         
-        const_iterator operator++(int)
+        ~reader()
         {
-            const_iterator temp1 = *this;
-            if(node_->right != 0)
-            {
-                node_ = node_->right;
-                while(node_->left != 0)
-                    node_ = node_->left;
-            }
-            else
-            {
-                node* temp;
-                do{
-                    temp = node_;
-                    node_ = node_->parent;
-                    if (node_!=0 && node_->left == temp) break;
-                }while(node_->parent != 0);
-            }
-            return temp1;
-        }
-        
-        const_iterator& operator--() {
-            if (node_ -> left != 0){
-                node_ = node_->left;
-                while(node_->right != 0) node_ = node_->right;
-            } else {
-                node* temp;
-                do{
-                    temp = node_;
-                    node_ = node_->parent;
-                    if (node_!=0 && node_->right == temp) break;
-                }while(node_->parent != 0 && node_ == node_->parent->left);
-            }
-            return *this;
-        }
-        
-        const_iterator operator--(int) {
-            const_iterator temp1 = *this;
-            if (node_ -> left != 0){
-                node_ = node_->left;
-                while(node_->right != 0) node_ = node_->right;
-            } else {
-                node* temp;
-                do{
-                    temp = node_;
-                    node_ = node_->parent;
-                    if (node_!=0 && node_->right == temp) break;
-                }while(node_->parent != 0 && node_ == node_->parent->left);
-            }
-            return temp1;
+            tree_->epochs_.quit(slot_);
         }
         
-        const_reference operator*() const
-        {
-            return *node_->value;
-        }
+    private:
+        const avl_tree* tree_;
+        size_t slot_;
         
-        const_pointer operator->() const
+        reader(const reader&);
+        reader& operator= (const reader&);
+    };
+    
+    // One at a time per reader.
+    class read_guard
+    {
+    public:
+        explicit read_guard(const reader& r) : tree_(r.tree_), slot_(r.slot_)
         {
-            return node_->value;
+            tree_->epochs_.pin(slot_);
         }
         
-        bool operator==(const iterator& it) const
+        ~read_guard()
         {
-            return node_ == it.node_;
+            tree_->epochs_.unpin(slot_);
         }
         
-        bool operator==(const const_iterator& it) const
+        // the element with key k, or null
+        const value_type* find(const key_type& k) const
         {
-            return node_ == it.node_;
+            return tree_->shared_value(tree_->shared_search(k, true));
         }
         
-        bool operator!=(const avliter& it) const{
-            return node_ != it.node_;
+        bool contains(const key_type& k) const
+        {
+            return tree_->shared_search(k, true) != 0;
         }
         
-        bool operator!=(const const_iterator& it) const{
-            return node_ != it.node_;
+        // the first element whose key is not less than k, or null
+        const value_type* lower_bound(const key_type& k) const
+        {
+            return tree_->shared_value(tree_->shared_search(k, false));
         }
         
     private:
-        node* node_;
+        const avl_tree* tree_;
+        size_t slot_;
+        
+        read_guard(const read_guard&);
+        read_guard& operator= (const read_guard&);
     };
-public:
-    typedef std::reverse_iterator<iterator>             reverse_iterator;
-    typedef std::reverse_iterator<const_iterator>       const_reverse_iterator;
-    typedef std::iterator_traits<iterator>              difference_type;
-    
-private:
-    node* root_;
-    node* min_node_;
-    node* max_node_;
-    node* left_barrier;
-    node* right_barrier;
-    key_compare key_compare_;
-    size_type node_count_;
-    
-public:
-	explicit avl_tree(const key_compare& comp = key_compare())
-    :key_compare_(comp), node_count_(0)
-	{
-        initialize();
-	}
+#endif
     
-	template <class InputIterator>
-	avl_tree(InputIterator first, InputIterator last,
-			 const key_compare& comp = key_compare())
-    :key_compare_(comp), node_count_(0)
-	{
-        initialize();
-		insert(first, last);
-	}
+    void swap(avl_tree& m){
+        std::swap(key_compare_, m.key_compare_);
+        index_.swap(m.index_);
+        node* mroot = m.root_;
+        node* mmin_node_ = m.min_node_;
+        node* mmax_node_ = m.max_node_;
+        node* mleft_barrier = m.left_barrier;
+        node* mright_barrier = m.right_barrier;
+        size_type mnode_count_ = m.node_count_;
+        
+        m.root_ = root_;
+        m.min_node_ = min_node_;
+        m.max_node_ = max_node_;
+        m.left_barrier = left_barrier;
+        m.right_barrier = right_barrier;
+        m.node_count_ = node_count_;
+        std::swap(relaxed_, m.relaxed_);
+        std::swap(piggyback_budget_, m.piggyback_budget_);
+        std::swap(max_pending_, m.max_pending_);
+        pending_.swap(m.pending_);
+        
+        root_ = mroot;
+        min_node_ = mmin_node_;
+        max_node_ = mmax_node_;
+        left_barrier = mleft_barrier;
+        right_barrier = mright_barrier;
+        node_count_ = mnode_count_;
+    }
     
-	avl_tree(const avl_tree<key, T>& n){
-		node_count_ = 0;
-		initialize();
-		insert(n.begin(), n.end());
-	}
+    std::pair<iterator,iterator>
+    equal_range(const key_type& k)
+    {
+        return std::pair<iterator, iterator>(lower_bound(k), upper_bound(k));
+    }
     
-	template <class InputIterator>
-	void erase(InputIterator first, InputIterator last){
-		for (; first != last; ++first) erase(*first);
-	}
+    std::pair<const_iterator,const_iterator>
+    equal_range(const key_type& k) const
+    {
+        return std::pair<const_iterator, const_iterator>(lower_bound(k), upper_bound(k));
+    }
     
-	void erase(iterator i){
-		node* a = i.node_;
-		iterator j = i;
-		if (a->left != 0){
-			j--;
-			node* b = j.node_;
-			value_type* temp = a->value;
-			a->value = b->value;
-			b->value = temp;
-			node* parent = b->parent;
-			if (parent->left == b) parent->left = 0; else parent->right = 0;
-			b->parent = 0;
-			delete b;
-			rebalance(parent);
-		} else if (a->right != 0) {
-			j++;
-			node* b = j.node_;
-			value_type* temp = a->value;
-			a->value = b->value;
-			b->value = temp;
-			node* parent = b->parent;
-			if (parent->left == b) parent->left = 0; else parent->right = 0;
-			b->parent = 0;
-			delete b;
-			rebalance(parent);
-		} else {
-			node* parent = a->parent;
-			if (parent->left == a) parent->left = 0; else parent->right = 0;
-			a->parent = 0;
-			delete a;
-			rebalance(parent);
-		}
-	}
+#if __cplusplus >= 201103L
+    template <typename K, typename C = key_compare,
+    typename = typename std::enable_if<avl_is_transparent<C>::value>::type>
+    iterator find(const K& k)
+    {
+        return iterator(find_node(k) AVL_MAP_STATS_ARG);
+    }
     
-	size_type erase(const key_type& k){
-		iterator temp = find(k);
-		if (temp == end()) return 0;
-		else {
-			erase(temp);
-			return 1;
-		}
-	}
+    template <typename K, typename C = key_compare,
+    typename = typename std::enable_if<avl_is_transparent<C>::value>::type>
+    const_iterator find(const K& k) const
+    {
+        return const_iterator(find_node(k) AVL_MAP_STATS_ARG);
+    }
     
-	template <class InputIterator>
-	void insert(InputIterator first, InputIterator last)
-	{
-		for(; first != last; ++first)
-		{
-			insert(*first);
-		}
+    template <typename K, typename C = key_compare,
+    typename = typename std::enable_if<avl_is_transparent<C>::value>::type>
+    iterator lower_bound(const K& k)
+    {
+        return iterator(lower_bound_node(k) AVL_MAP_STATS_ARG);
     }
-	
-	iterator insert(iterator _where, const value_type& val){
-		std::pair<iterator, bool> res = insert(val);
-		if (res.second) return res.first;
-		else return end();
-	}
     
-    std::pair<iterator, bool>
-    insert(const value_type& val)
-	{
-    	remove_barrier();
-    	typedef std::pair<iterator, bool> _Res;
-        std::pair<iterator, iterator> __res = get_insert_pos(val.first);
-        
-        if (__res.first != 0){
-        	_Res result = _Res(insert_impl(__res.second.node_, val), true);
-        	add_barrier();
-        	return result;
-        }
-        add_barrier();
-        return _Res(__res.second, false);
-	}
-	
-	std::pair<iterator, bool>
-	emplace(const value_type& val){
-		return insert(val);
-	}
-	
-	std::pair<iterator, bool>
-	emplace_hint(const_iterator where, const value_type& val){
-		return insert(val);
-	}
-	
-	std::pair<iterator, bool>
-	emplace_hint(iterator where, const value_type& val){
-		return insert(val);
-	}
-	
-    mapped_type&
-    operator[](const key_type& k)
+    template <typename K, typename C = key_compare,
+    typename = typename std::enable_if<avl_is_transparent<C>::value>::type>
+    const_iterator lower_bound(const K& k) const
     {
-        
-        iterator i = lower_bound(k);
-        // i->first is greater than or equivalent to k.
-        if (i == end() || key_comp()(k, i->first))
-            i = (insert(value_type(k, mapped_type()))).first;
-        return i->second;
+        return const_iterator(lower_bound_node(k) AVL_MAP_STATS_ARG);
     }
     
+    template <typename K, typename C = key_compare,
+    typename = typename std::enable_if<avl_is_transparent<C>::value>::type>
+    iterator upper_bound(const K& k)
+    {
+        return iterator(upper_bound_node(k) AVL_MAP_STATS_ARG);
+    }
     
-    ~avl_tree(){
-        free_mem(root_);
+    template <typename K, typename C = key_compare,
+    typename = typename std::enable_if<avl_is_transparent<C>::value>::type>
+    const_iterator upper_bound(const K& k) const
+    {
+        return const_iterator(upper_bound_node(k) AVL_MAP_STATS_ARG);
     }
     
-    //
+    template <typename K, typename C = key_compare,
+    typename = typename std::enable_if<avl_is_transparent<C>::value>::type>
+    std::pair<iterator,iterator>
+    equal_range(const K& k)
+    {
+        return std::pair<iterator, iterator>(lower_bound(k), upper_bound(k));
+    }
     
-    void __print(){
-    	root_->__print();
+    template <typename K, typename C = key_compare,
+    typename = typename std::enable_if<avl_is_transparent<C>::value>::type>
+    std::pair<const_iterator,const_iterator>
+    equal_range(const K& k) const
+    {
+        return std::pair<const_iterator, const_iterator>(lower_bound(k), upper_bound(k));
     }
     
+    template <typename K, typename C = key_compare,
+    typename = typename std::enable_if<avl_is_transparent<C>::value>::type>
+    size_type count(const K& k) const
+    {
+        return find_node(k) == right_barrier ? 0 : 1;
+    }
+#endif
     
-	bool operator== (const avl_tree& rhs ){
-		if (size() != rhs.size()) return false;
-		else {
-			if (size() == 0) return true;
-			iterator i = begin();
-			const_iterator j = rhs.begin();
-			while (i != end() && j != rhs.end()){
-				if ((*i) != (*j)) return false;
-				i++; j++;
-			}
-			return true;
-		}
+	allocator_type get_allocator() const NOEXCEPT
+	{
+		return allocator_type();
 	}
     
-	bool operator!= (const avl_tree& rhs ){
-		if (size() != rhs.size()) return true;
-		else {
-			if (size() == 0) return false;
-			iterator i = begin();
-			const_iterator j = rhs.begin();
-			while (i != end() && j != rhs.end()){
-				if ((*i) != (*j)) return true;
-				i++; j++;
-			}
-			return false;
-		}
+	size_type max_size() const NOEXCEPT
+	{
+		return get_allocator().size();
 	}
     
-	bool operator< (const avl_tree& rhs ){
-		if (size() == 0) return false;
-		iterator i = begin();
-		const_iterator j = rhs.begin();
-		while (i != end() && j != rhs.end()){
-			if ((*i) < (*j)) return true;
-			else if ((*i) > (*j)) return false;
-			i++; j++;
-		}
-		if (i == end()){
-			if (j == rhs.end()) return false;
-			else return true;
-		} else return false;
-	}
+	key_compare key_comp() const
+    {
+        return key_compare_;
+    }
     
-	bool operator<= (const avl_tree& rhs ){
-		if (size() == 0) return false;
-		iterator i = begin();
-		const_iterator j = rhs.begin();
-		while (i != end() && j != rhs.end()){
-			if ((*i) < (*j)) return true;
-			else if ((*i) > (*j)) return false;
-			i++; j++;
-		}
-		if (i == end()){
-			if (j == rhs.end()) return true;
-			else return true;
-		} else return false;
+	value_compare value_comp() const
+	{
+		return value_compare(key_compare_());
 	}
     
-	bool operator> (const avl_tree& rhs ){
-		if (size() == 0) return false;
-		iterator i = begin();
-		const_iterator j = rhs.begin();
-		while (i != end() && j != rhs.end()){
-			if ((*i) < (*j)) return false;
-			else if ((*i) > (*j)) return true;
-			i++; j++;
-		}
-		if (i == end()){
-			if (j == rhs.end()) return false;
-			else return false;
-		} else return true;
-	}
+    size_type count(const key_type& k) const
+    {
+        return find_node(k) == right_barrier ? 0 : 1;
+    }
     
-	bool operator>= (const avl_tree& rhs ){
-		if (size() == 0) return false;
-		iterator i = begin();
-		const_iterator j = rhs.begin();
-		while (i != end() && j != rhs.end()){
-			if ((*i) < (*j)) return false;
-			else if ((*i) > (*j)) return true;
-			i++; j++;
-		}
-		if (i == end()){
-			if (j == rhs.end()) return true;
-			else return false;
-		} else return true;
-	}
+    // Writes the map in avl_map_file_header format. Key and mapped types
+    // must be trivially copyable; open the stream in binary mode.
+    void save(std::ostream& os) const
+    {
+        assert_trivially_copyable();
+        avl_map_file_header h = make_file_header();
+        os.write(reinterpret_cast<const char*>(&h), sizeof(h));
+        char buf[sizeof(record_type)];
+        std::memset(buf, 0, sizeof(buf));
+        for (const_iterator it = begin(); it != end(); ++it){
+            std::memcpy(buf + offsetof(record_type, first), &it->first, sizeof(key_type));
+            std::memcpy(buf + offsetof(record_type, second), &it->second, sizeof(mapped_type));
+            os.write(buf, sizeof(buf));
+        }
+        if (!os) throw std::runtime_error("avl map file: write failed");
+    }
+    
+    // Replaces the content with a map written by save(). The tree is built
+    // directly from the sorted records in O(n), without per-element descents.
+    void load(std::istream& is)
+    {
+        assert_trivially_copyable();
+        avl_map_file_header h;
+        if (!is.read(reinterpret_cast<char*>(&h), sizeof(h)))
+            throw std::runtime_error("avl map file: truncated header");
+        h.validate(sizeof(record_type), sizeof(key_type), sizeof(mapped_type),
+                   offsetof(record_type, second));
+        is.ignore(h.header_size - sizeof(h));
+        clear();
+        if (h.count == 0) return;
+        
+        node* top = 0;
+        const value_type* last = 0;
+        try {
+            build_sorted(is, (size_type)h.count, 0, top, last);
+        } catch (...) {
+            index_.clear();
+            free_mem(top);
+            throw;
+        }
+        root_ = top;
+        node_count_ = (size_type)h.count;
+        min_node_ = root_;
+        while (min_node_->left != 0) min_node_ = min_node_->left;
+        max_node_ = root_;
+        while (max_node_->right != 0) max_node_ = max_node_->right;
+        add_barrier();
+    }
+private: // helper functions
+    typedef avl_map_record<key_type, mapped_type> record_type;
+    
+    static void assert_trivially_copyable()
+    {
+#if __cplusplus >= 201103L
+        static_assert(std::is_trivially_copyable<key_type>::value
+                      && std::is_trivially_copyable<mapped_type>::value,
+                      "save()/load() need trivially copyable key and mapped types");
+#endif
+    }
+    
+    avl_map_file_header make_file_header() const
+    {
+        avl_map_file_header h;
+        std::memset(&h, 0, sizeof(h));
+        std::memcpy(h.magic, avl_map_file_header::expected_magic(), sizeof(h.magic));
+        h.version = avl_map_file_header::current_version;
+        h.byte_order = avl_map_file_header::byte_order_mark;
+        h.header_size = sizeof(h);
+        h.record_size = sizeof(record_type);
+        h.key_size = sizeof(key_type);
+        h.mapped_size = sizeof(mapped_type);
+        h.mapped_offset = offsetof(record_type, second);
+        h.count = node_count_;
+        return h;
+    }
+    
+    // Builds a perfectly balanced subtree of n nodes into slot, reading the
+    // records in order. slot is assigned before recursing so that a partial
+    // tree can be released by the caller if reading throws.
+    void build_sorted(std::istream& is, size_type n, node* parent,
+                      node*& slot, const value_type*& last)
+    {
+        node* x = new_node();
+        x->parent = parent;
+        slot = x;
+        size_type nleft = n / 2;
+        if (nleft > 0) build_sorted(is, nleft, x, x->left, last);
+        record_type r;
+        if (!is.read(reinterpret_cast<char*>(&r), sizeof(r)))
+            throw std::runtime_error("avl map file: truncated records");
+        if (last != 0 && !key_less(last->first, r.first))
+            throw std::runtime_error("avl map file: records not strictly sorted");
+        x->value = new_value(value_type(r.first, r.second));
+        x->set_prefix(r.first);
+        x->set_own_digest(*x->value);
+        index_.insert(x);
+        last = x->value;
+        if (n - nleft - 1 > 0) build_sorted(is, n - nleft - 1, x, x->right, last);
+        x->update_balance();
+    }
+    
+
+    // an empty tree has no root; the barriers are linked in while there
+    // are elements
+    void initialize(){
+    	root_ = 0;
+    	min_node_ = 0;
+    	max_node_ = 0;
+    	left_barrier = new_node();
+    	left_barrier->height = 0;
+    	right_barrier = new_node();
+    	right_barrier->height = 0;
+    	relaxed_ = false;
+    	piggyback_budget_ = 0;
+    	max_pending_ = 0;
+    }
     
-	avl_tree& operator= (const avl_tree& n){
-		clear();
-		const_iterator it;
-		for (it = n.begin(); it != n.end(); it++){
-			insert(*it);
-		}
-		return *this;
-	}
+    node* new_node(){
+        AVL_MAP_COUNT(allocations);
+        node_allocator a;
+        return ::new ((void*)a.allocate(1)) node();
+    }
     
-    mapped_type at(const key_type &k){
-    	iterator res = find(k);
-    	if (res == end()) throw std::out_of_range("key doesn't exist");
-    	return res.node_->value->second;
+    value_type* new_value(const value_type& v){
+        AVL_MAP_COUNT(allocations);
+        return construct_value(v.first, v.second);
     }
     
+    // a value with key k and a default constructed mapped value
+    template <typename K>
+    value_type* new_value_for(const K& k){
+        AVL_MAP_COUNT(allocations);
+        return construct_value(key_type(k), mapped_type());
+    }
     
+    template <typename K, typename M>
+    static value_type* construct_value(const K& k, const M& m){
+        value_allocator a;
+        value_type* v = a.allocate(1);
+        try {
+            ::new ((void*)v) value_type(k, m);
+        } catch (...) {
+            a.deallocate(v, 1);
+            throw;
+        }
+        return v;
+    }
     
-	const_iterator begin() const NOEXCEPT
-	{
-        return const_iterator(min_node_);
-	}
+    void delete_node(node* n){
+        free_node(n AVL_MAP_STATS_ARG);
+    }
     
-	iterator begin() NOEXCEPT
-    {
-        return iterator(min_node_);
+    // Frees a node and its value, counted against s. Node handles free
+    // theirs here too, with the stats of the tree they came from.
+    static void free_node(node* n AVL_MAP_STATS_PARAM){
+        AVL_MAP_STATS_ONLY(if (s != 0) s->deallocations += (n->value != 0) ? 2 : 1;)
+        if (n->value != 0) delete_value(n->value);
+        n->~node();
+        node_allocator().deallocate(n, 1);
     }
     
-	const_iterator cbegin() const NOEXCEPT
-	{
-        return const_iterator(min_node_);
-	}
+    static void delete_value(value_type* v){
+        v->~value_type();
+        value_allocator().deallocate(v, 1);
+    }
     
-    reverse_iterator rbegin() NOEXCEPT
+    template <typename K1, typename K2>
+    bool key_less(const K1& a, const K2& b) const
     {
-        return reverse_iterator(iterator(max_node_));
+        AVL_MAP_COUNT(comparisons);
+        return key_compare_(a, b);
     }
     
-    const_reverse_iterator rbegin() const NOEXCEPT
+    void shape_walk(const node* n, size_t depth, avl_tree_shape& r) const
     {
-        return const_reverse_iterator(iterator(max_node_));
+        if (n == 0 || n->value == 0) return; // empty root or a barrier
+        if (r.depth_histogram.size() <= depth) r.depth_histogram.resize(depth + 1);
+        ++r.depth_histogram[depth];
+        r.average_depth += (double)depth;
+        shape_walk(n->left, depth + 1, r);
+        shape_walk(n->right, depth + 1, r);
     }
     
-    const_reverse_iterator crbegin() const NOEXCEPT
+    // in order, so that prev is the node before n
+    void check_walk(const node* n, const node* parent, const node*& prev,
+                    size_type& count, size_type& queued, bool& saturated) const
     {
-        return const_reverse_iterator(iterator(max_node_));
+        if (n == 0 || n->value == 0) return; // empty subtree or a barrier
+        if (n->parent != parent) invariant_failed("parent link");
+        check_walk(n->left, n, prev, count, queued, saturated);
+        if (prev != 0 && !key_compare_(prev->value->first, n->value->first))
+            invariant_failed("key order");
+        prev = n;
+        ++count;
+        queued += n->queued;
+        if (n->queued == max_queued) saturated = true;
+        if (!n->prefix_matches(n->value->first)) invariant_failed("prefix");
+        if (!n->digests_match(*n->value, n->left, n->right)) invariant_failed("digest");
+        if (hash_index::enabled && index_.find(n->value->first, key_compare_) != n)
+            invariant_failed("hash index entry");
+        if (!n->quiescent()) invariant_failed("version");
+        if (n->queued == 0) check_balance(n, balance_policy());
+        check_walk(n->right, n, prev, count, queued, saturated);
     }
     
-    //
+    static size_type stored_height(const node* n){
+        return n != 0 ? n->height : 0;
+    }
     
-    iterator end() NOEXCEPT
+    // Heights are exact as far as the children's stored heights go, which
+    // by induction makes them exact when it holds for every node. Relaxed
+    // steps follow these rules under either policy.
+    static void check_balance(const node* n, avl_height_balance){
+        size_type lh = stored_height(n->left);
+        size_type rh = stored_height(n->right);
+        if (n->height != std::max(lh, rh) + 1) invariant_failed("height");
+        int b = lh > rh ? (int)(lh - rh) : -(int)(rh - lh);
+        if (b < -1 || b > 1 || n->balance != b) invariant_failed("balance");
+    }
+    
+    static void check_balance(const node* n, avl_weak_balance){
+        size_type lr = stored_height(n->left);
+        size_type rr = stored_height(n->right);
+        if (n->height <= lr || n->height - lr > 2 || n->height <= rr || n->height - rr > 2)
+            invariant_failed("rank difference");
+        if (lr == 0 && rr == 0 && n->height != 1) invariant_failed("leaf rank");
+    }
+    
+    static void check_barrier(const node* b){
+        if (b->value != 0 || b->height != 0 || b->left != 0 || b->right != 0)
+            invariant_failed("barrier");
+    }
+    
+    static void invariant_failed(const char* what){
+        throw std::logic_error(std::string("avl_tree: broken ") + what);
+    }
+    
+    void free_mem(node* node_){
+        if (node_ != 0 && node_->left != 0) free_mem(node_->left);
+        if (node_ != 0 && node_->right != 0) free_mem(node_->right);
+        if (node_ != 0) delete_node(node_);
+    }
+    
+    void remove_barrier(){
+    	if (size() > 0){
+    		node_sync::publish(min_node_->left, (node*)0);
+    		left_barrier->parent = 0;
+    		node_sync::publish(max_node_->right, (node*)0);
+    		right_barrier->parent = 0;
+    	}
+    }
+    
+    void add_barrier(){
+    	if (size() > 0){
+    		node_sync::publish(min_node_->left, left_barrier);
+    		left_barrier->parent = min_node_;
+    		node_sync::publish(max_node_->right, right_barrier);
+    		right_barrier->parent = max_node_;
+    	}
+    }
+    
+    // Returns (node holding k, true), or (parent for a new node with key k,
+    // false) where the parent is 0 in an empty tree. Expects the barriers
+    // to be removed.
+    template <typename K>
+    std::pair<node*, bool>
+    get_insert_pos(const K& k)
     {
-        return iterator(right_barrier);
+        node* x = root_;
+        node* y = 0;
+        prefix_type p = key_prefix::make_prefix(k);
+        AVL_MAP_COUNT(descents);
+        while (x != 0)
+        {
+            AVL_MAP_COUNT(descent_steps);
+        	y = x;
+            int order = x->prefix_order(p);
+            if (order < 0) x = x->left;
+            else if (order > 0) x = x->right;
+            else if (key_prefix::exact_prefix) break;
+            else if (key_less(k, x->value->first)) x = x->left;
+            else if (key_less(x->value->first, k)) x = x->right;
+            else break;
+        }
+        return std::pair<node*, bool>(x != 0 ? x : y, x != 0);
     }
     
-    const_iterator end() const NOEXCEPT
+    // get_insert_pos by a finger search from finger
+    template <typename K>
+    std::pair<node*, bool> get_insert_pos_near(node* finger, const K& k)
     {
-        return const_iterator(right_barrier);
+        prefix_type p = key_prefix::make_prefix(k);
+        node* j = lower_bound_near(finger, k, p);
+        if (j != right_barrier && !less_node(k, p, j)) return std::pair<node*, bool>(j, true);
+        // k goes between j's predecessor and j, below whichever of the two
+        // has that side free
+        if (j == right_barrier) return std::pair<node*, bool>(max_node_, false);
+        if (j->left == 0) return std::pair<node*, bool>(j, false);
+        node* x = j->left;
+        while (x->right != 0) x = x->right;
+        return std::pair<node*, bool>(x, false);
     }
     
-    const_iterator cend() const NOEXCEPT
+    // x's key < k, decided by the cached prefixes where they differ
+    template <typename K>
+    bool node_less(const node* x, const K& k, prefix_type p) const
     {
-        return const_iterator(right_barrier);
+        int order = x->prefix_order(p);
+        return order > 0 || (order == 0 && !key_prefix::exact_prefix
+                             && key_less(x->value->first, k));
     }
     
-    reverse_iterator rend() NOEXCEPT
+    // k < x's key
+    template <typename K>
+    bool less_node(const K& k, prefix_type p, const node* x) const
     {
-        return reverse_iterator(left_barrier);
+        int order = x->prefix_order(p);
+        return order < 0 || (order == 0 && !key_prefix::exact_prefix
+                             && key_less(k, x->value->first));
     }
     
-    const_reverse_iterator rend() const NOEXCEPT
+    template <typename K>
+    node* lower_bound_node(const K& k) const
     {
-        return const_reverse_iterator(left_barrier);
+        return lower_bound_node(k, key_prefix::make_prefix(k));
     }
     
-    const_reverse_iterator crend() const NOEXCEPT
+    template <typename K>
+    node* lower_bound_node(const K& k, prefix_type p) const
     {
-        return const_reverse_iterator(left_barrier);
+    	if (size() == 0) return right_barrier;
+        return lower_bound_from(root_, right_barrier, k, p);
     }
     
-    //
+    // lower bound of k in the subtree of x, or y if all its keys are less
+    template <typename K>
+    node* lower_bound_from(node* x, node* y, const K& k, prefix_type p) const
+    {
+        AVL_MAP_COUNT(descents);
+        while (x != 0 && x != left_barrier && x != right_barrier){
+            AVL_MAP_COUNT(descent_steps);
+        	if (node_less(x, k, p)) x = x->right;
+            else y = x, x = x->left;
+        }
+        return y;
+    }
     
-    bool empty() const NOEXCEPT
+    // Finger search. Climbs from the finger to the lowest ancestor whose
+    // subtree, together with the parent it hangs off, must hold the lower
+    // bound of k, then descends from there. Both legs are O(log d) for a
+    // result d positions away from the finger.
+    template <typename K>
+    node* lower_bound_near(node* finger, const K& k, prefix_type p) const
     {
-        return (node_count_ == 0);
+        if (size() == 0 || finger == right_barrier || finger == left_barrier)
+            return lower_bound_node(k, p);
+        node* x = finger;
+        if (node_less(x, k, p)){
+            // everything up to x's nearest left-hanging ancestor edge is
+            // less than k; stop below the first parent that is not
+            for (;;){
+                AVL_MAP_COUNT(descent_steps);
+                node* parent = x->parent;
+                if (parent == 0) return lower_bound_from(x, right_barrier, k, p);
+                if (parent->left == x && !node_less(parent, k, p))
+                    return lower_bound_from(x, parent, k, p);
+                x = parent;
+            }
+        }
+        // the finger qualifies, so the answer is in the subtree of the
+        // first ancestor hanging off a parent less than k
+        for (;;){
+            AVL_MAP_COUNT(descent_steps);
+            node* parent = x->parent;
+            if (parent == 0 || (parent->right == x && node_less(parent, k, p)))
+                return lower_bound_from(x, finger, k, p);
+            x = parent;
+        }
     }
     
-    void clear(){
-    	node_count_ = 0;
-    	free_mem(root_);
-    	initialize();
+    static void assert_digest()
+    {
+#if __cplusplus >= 201103L
+        static_assert(node_digest::has_digest, "diff() needs a digest in the traits");
+#endif
     }
     
-    size_type size() const NOEXCEPT
+    // Recomputes the subtree digests from x up to the root, after an
+    // element at or below x was linked, unlinked or changed.
+    void refresh_digests(node* x)
     {
-        return node_count_;
+        if (!node_digest::has_digest) return;
+        for (; x != 0; x = x->parent) x->sum_digests(x->left, x->right);
     }
     
-    iterator find(const key_type& k)
+    // Sum of the digests of the elements with keys less than k, or not
+    // greater with inclusive; of all of them for a null k.
+    uint64_t digest_below(const key_type* k, bool inclusive) const
+    {
+        if (k == 0) return root_ != 0 ? root_->digest : 0;
+        prefix_type p = key_prefix::make_prefix(*k);
+        uint64_t sum = 0;
+        AVL_MAP_COUNT(descents);
+        for (node* x = root_; x != 0 && x->value != 0;){
+            AVL_MAP_COUNT(descent_steps);
+            if (inclusive ? !less_node(*k, p, x) : node_less(x, *k, p)){
+                sum += x->own_digest + (x->left != 0 ? x->left->digest : 0);
+                x = x->right;
+            } else x = x->left;
+        }
+        return sum;
+    }
+    
+    // digest of the elements with keys in (lo, hi), null bounds unbounded
+    uint64_t range_digest(const key_type* lo, const key_type* hi) const
     {
-        iterator j = lower_bound(k);
-        return (j == end() || key_compare_(k,j->first)) ? end() : j;
+        return digest_below(hi, false) - (lo != 0 ? digest_below(lo, true) : 0);
     }
     
-    const_iterator find(const key_type& k) const
+    // x's subtree holds this tree's elements with keys in (lo, hi)
+    template <class OutputIterator>
+    OutputIterator diff_subtree(const avl_tree& other, const node* x, const key_type* lo,
+                                const key_type* hi, OutputIterator out) const
     {
-        const_iterator j = lower_bound(k);
-		const_iterator e = end();
-        return (j == e || key_compare_(k,j->first)) ? e : j;
+        if (x == 0 || x->value == 0) return other.diff_inserted(lo, hi, out);
+        if (x->digest == other.range_digest(lo, hi)) return out;
+        const key_type& k = x->value->first;
+        out = diff_subtree(other, x->left, lo, &k, out);
+        const node* y = other.find_node(k);
+        diff_entry e;
+        e.element = 0;
+        if (y == other.right_barrier) e.kind = avl_diff_removed, e.element = x->value;
+        else if (y->own_digest != x->own_digest) e.kind = avl_diff_changed, e.element = y->value;
+        if (e.element != 0) *out++ = e;
+        return diff_subtree(other, x->right, &k, hi, out);
     }
     
-    iterator lower_bound(const key_type& k)
+    // lists the elements with keys in (lo, hi) as inserted
+    template <class OutputIterator>
+    OutputIterator diff_inserted(const key_type* lo, const key_type* hi, OutputIterator out) const
     {
-    	if (size() == 0) return end();
-        node* x = root_;
-        node* y = end().node_;
-        while (x != 0 && x != left_barrier && x != right_barrier){
-        	if (key_compare_(x->value->first, k)){
-        		x = x->right;
-        	}
-            else{
-            	y = x, x = x->left;
-            }
+        if (empty()) return out;
+        const_iterator i(lo != 0 ? upper_bound_node(*lo) : min_node_);
+        for (; i != end() && (hi == 0 || key_less(i->first, *hi)); ++i){
+            diff_entry e;
+            e.kind = avl_diff_inserted;
+            e.element = &*i;
+            *out++ = e;
         }
-        return iterator(y);
+        return out;
     }
     
-    const_iterator lower_bound(const key_type& k) const
+    // descents lower_bound_batch() interleaves
+    enum { batch_group = 16 };
+    
+    // Lower bounds of up to batch_group keys from first, which it advances;
+    // returns how many.
+    template <class ForwardIterator>
+    size_type lower_bound_group(ForwardIterator& first, ForwardIterator last, node** found) const
     {
-        if (size() == 0) return end();
-        node* x = root_;
-        node* y = right_barrier;
-        while (x != 0 && x != left_barrier && x != right_barrier){
-            if (key_compare_(x->value->first, k)){
-                x = x->right;
-            }
-            else{
-                y = x, x = x->left;
+        typedef typename std::iterator_traits<ForwardIterator>::value_type probe_type;
+        const probe_type* keys[batch_group];
+        prefix_type prefixes[batch_group];
+        node* x[batch_group];
+        size_type n = 0;
+        for (; n < batch_group && first != last; ++n, ++first){
+            keys[n] = &*first;
+            prefixes[n] = key_prefix::make_prefix(*first);
+            x[n] = root_;
+            found[n] = right_barrier;
+            AVL_MAP_COUNT(descents);
+        }
+        for (bool active = true; active;){
+            active = false;
+            for (size_type i = 0; i < n; ++i){
+                node* y = x[i];
+                if (y == 0 || y->value == 0) continue;
+                AVL_MAP_COUNT(descent_steps);
+                if (node_less(y, *keys[i], prefixes[i])) y = y->right;
+                else found[i] = y, y = y->left;
+                x[i] = y;
+                if (y != 0){
+                    AVL_MAP_PREFETCH(y);
+                    active = true;
+                }
             }
+            // every node of the next level is on its way; now their values
+            for (size_type i = 0; i < n; ++i)
+                if (x[i] != 0) AVL_MAP_PREFETCH(x[i]->value);
         }
-        return const_iterator(y);
+        return n;
     }
     
-    iterator upper_bound(const key_type& k)
+    // Pushes the path to the first node of the range, keeping the nodes
+    // the descent leaves to the left, which come next in order.
+    scan_cursor make_scan_cursor(const key_type& k, const key_type& hi, bool after) const
     {
-    	if (size() == 0) return end();
-        node* x = root_;
-        node* y = end().node_;
-        while (x != 0 && x != right_barrier && x != left_barrier)
-            if (key_compare()(k, x->value->first))
-                y = x, x = x->left;
-            else
-                x = x->right;
-        return iterator(y);
+        scan_cursor c(this, hi);
+        if (size() == 0) return c;
+        c.stack_.reserve(root_->height);
+        prefix_type p = key_prefix::make_prefix(k);
+        AVL_MAP_COUNT(descents);
+        for (node* x = root_; x != 0 && x->value != 0;){
+            AVL_MAP_COUNT(descent_steps);
+            if (after ? less_node(k, p, x) : !node_less(x, k, p)){
+                c.stack_.push_back(x);
+                x = x->left;
+            } else x = x->right;
+        }
+        if (!c.stack_.empty()) c.check_top();
+        return c;
     }
     
-    const_iterator upper_bound(const key_type& k) const
-	{
-		if (size() == 0) return end();
-		node* x = root_;
-		node* y = end().node_;
-		while (x != 0 && x != right_barrier && x != left_barrier)
-			if (key_compare()(k, x->value->first))
-				y = x, x = x->left;
-			else
-				x = x->right;
-		return const_iterator(y);
-	}
-    
-    void swap(avl_tree<key_type, mapped_type>& m){
-        node* mroot = m.root_;
-        node* mmin_node_ = m.min_node_;
-        node* mmax_node_ = m.max_node_;
-        node* mleft_barrier = m.left_barrier;
-        node* mright_barrier = m.right_barrier;
-        size_type mnode_count_ = m.node_count_;
-        
-        m.root_ = root_;
-        m.min_node_ = min_node_;
-        m.max_node_ = max_node_;
-        m.left_barrier = left_barrier;
-        m.right_barrier = right_barrier;
-        m.node_count_ = node_count_;
-        
-        root_ = mroot;
-        min_node_ = mmin_node_;
-        max_node_ = mmax_node_;
-        left_barrier = mleft_barrier;
-        right_barrier = mright_barrier;
-        node_count_ = mnode_count_;
+    // right_barrier if k is absent
+    template <typename K>
+    node* find_near(node* finger, const K& k) const
+    {
+        prefix_type p = key_prefix::make_prefix(k);
+        node* j = lower_bound_near(finger, k, p);
+        return (j == right_barrier || less_node(k, p, j)) ? right_barrier : j;
     }
     
-    std::pair<iterator,iterator>
-    equal_range(const key_type& k)
+    template <typename K>
+    node* upper_bound_node(const K& k) const
     {
-        iterator x = begin();
-        iterator y = end();
-        while (x != 0)
-        {
-            if (key_compare_(x->first, k))
-                x = x.node_->right;
-            else if (key_compare_(k, x->first))
-                y = x, x = x.node_->left;
-            else
-            {
-                iterator xu(x), yu(y);
-                y = x, x = x.node_->left;
-                xu = xu.node_->right;
-                return std::pair<iterator,iterator>
-                (lower_bound(x, y, k), upper_bound(xu, yu, k));
-            }
+    	if (size() == 0) return right_barrier;
+        node* x = root_;
+        node* y = right_barrier;
+        prefix_type p = key_prefix::make_prefix(k);
+        AVL_MAP_COUNT(descents);
+        while (x != 0 && x != right_barrier && x != left_barrier){
+            AVL_MAP_COUNT(descent_steps);
+            if (less_node(k, p, x)) y = x, x = x->left;
+            else x = x->right;
         }
-        return std::pair<iterator, iterator>(iterator(y),
-                                             iterator(y));
+        return y;
     }
     
-    std::pair<const_iterator,const_iterator>
-    equal_range(const key_type& k) const
+    // right_barrier if k is absent
+    template <typename K>
+    node* find_node(const K& k) const
     {
-        iterator x = begin();
-        iterator y = end();
-        while (x != 0)
-        {
-            if (key_compare_(x->first, k))
-                x = x.node_->right;
-            else if (key_compare_(k, x->first))
-                y = x, x = x.node_->left;
-            else
-            {
-                iterator xu(x), yu(y);
-                y = x, x = x.node_->left;
-                xu = xu.node_->right;
-                return std::pair<iterator,iterator>
-                (lower_bound(x, y, k), upper_bound(xu, yu, k));
-            }
-        }
-        return std::pair<iterator, iterator>(iterator(y), iterator(y));
+        prefix_type p = key_prefix::make_prefix(k);
+        node* j = lower_bound_node(k, p);
+        // j's key is not less than k, so it matches unless k is less
+        return (j == right_barrier || less_node(k, p, j)) ? right_barrier : j;
     }
     
-	allocator_type get_allocator() const NOEXCEPT
-	{
-		return allocator_type();
-	}
+    // point lookups of a key_type go through the hash index if there is one
+    node* find_node(const key_type& k) const
+    {
+        if (!hash_index::enabled) return find_node<key_type>(k);
+        node* n = index_.find(k, key_compare_);
+        return n != 0 ? n : right_barrier;
+    }
     
-	size_type max_size() const NOEXCEPT
-	{
-		return get_allocator().size();
-	}
+#if __cplusplus >= 201103L
+    // Readers' search in the single-writer mode: the node holding k, or
+    // with !exact the lower bound of k, 0 for none.
+    node* shared_search(const key_type& k, bool exact) const
+    {
+        prefix_type p = key_prefix::make_prefix(k);
+        node* found;
+        while (!shared_descend(k, p, exact, found)) {}
+        return found;
+    }
     
-	key_compare key_comp() NOEXCEPT
+    // One try of a reader's descent, with the hand-over-hand validation of
+    // Bronson et al.'s optimistic AVL tree. Having read a child link and
+    // then the child's version, a reader that finds the link and the
+    // parent's version unchanged knows that the child's subtree held every
+    // key of the search's range at that point, and that keys moving out of
+    // it later change its version. False, to start over from the root, if
+    // a version was odd or changed.
+    bool shared_descend(const key_type& k, prefix_type p, bool exact, node*& found) const
     {
-        return key_compare();
+        found = 0;
+        node* x = node_sync::acquire(root_);
+        if (x == 0) return true;
+        unsigned v = x->read_version();
+        if ((v & 1) || node_sync::acquire(root_) != x) return false;
+        for (;;){
+            int order = x->prefix_order(p);
+            if (order == 0 && !key_prefix::exact_prefix){
+                // no stats counting: readers must not write to the tree
+                const key_type& xk = node_sync::acquire(x->value)->first;
+                order = key_compare_(k, xk) ? -1 : (key_compare_(xk, k) ? 1 : 0);
+            }
+            if (order == 0){
+                found = x;
+                return true;
+            }
+            if (order < 0) found = x;
+            node* const& link = (order < 0) ? x->left : x->right;
+            node* c = node_sync::acquire(link);
+            if (x->read_version() != v) return false;
+            // a null link or a barrier
+            if (c == 0 || node_sync::acquire(c->value) == 0){
+                if (exact) found = 0;
+                return true;
+            }
+            unsigned cv = c->read_version();
+            if ((cv & 1) || node_sync::acquire(link) != c || x->read_version() != v) return false;
+            x = c;
+            v = cv;
+        }
     }
     
-	value_compare value_comp() const
-	{
-		return value_compare(key_compare_());
-	}
+    const value_type* shared_value(node* x) const
+    {
+        return x != 0 ? node_sync::acquire(x->value) : 0;
+    }
+#endif
     
-    size_type count(const key_type& k) const
+    // 0 unless the hash index holds k; other probe types are not hashed
+    node* indexed_node(const key_type& k) const
     {
-		const_iterator f = find(k);
-		const_iterator e = end();
-        return f == e ? 0 : 1;
+        return index_.find(k, key_compare_);
     }
-private: // helper functions
-    void initialize(){
-    	root_ = new node();
-    	min_node_ = 0;
-    	max_node_ = 0;
-    	left_barrier = new node();
-    	left_barrier->height = 0;
-    	left_barrier->parent = root_;
-    	right_barrier = new node();
-    	right_barrier->height = 0;
-    	right_barrier->parent = root_;
-    	root_->left = left_barrier;
-    	root_->right = right_barrier;
-    	root_->height = 0;
+    
+    template <typename K>
+    node* indexed_node(const K&) const
+    {
+        return 0;
     }
     
-    void free_mem(node* node_){
-        if (node_ != 0 && node_->left != 0) free_mem(node_->left);
-        if (node_ != 0 && node_->right != 0) free_mem(node_->right);
-        if (node_ != 0) delete node_;
+#if __cplusplus >= 201103L
+    template <typename K>
+    node_type extract_key(const K& k)
+    {
+        node* n = find_node(k);
+        if (n == right_barrier) return node_type();
+        return node_type(unlink(n) AVL_MAP_STATS_ARG);
     }
+#endif
     
-    void remove_barrier(){
-    	if (size() > 0){
-    		min_node_->left = 0;
-    		left_barrier->parent = 0;
-    		max_node_->right = 0;
-    		right_barrier->parent = 0;
-    	}
+    template <typename K>
+    size_type erase_key(const K& k)
+    {
+        node* n = find_node(k);
+        if (n == right_barrier) return 0;
+        erase(iterator(n));
+        return 1;
     }
     
-    void add_barrier(){
-    	if (size() > 0){
-    		min_node_->left = left_barrier;
-    		left_barrier->parent = min_node_;
-    		max_node_->right = right_barrier;
-    		right_barrier->parent = max_node_;
-    	}
+    // one descent for both the lookup and the insertion point, none for
+    // a key the hash index holds
+    template <typename K>
+    mapped_type& subscript(const K& k)
+    {
+        if (node* hit = indexed_node(k)) return hit->value->second;
+    	remove_barrier();
+        std::pair<node*, bool> pos = get_insert_pos(k);
+        node* n = pos.second ? pos.first : insert_impl(pos.first, new_value_for(k)).node_;
+        add_barrier();
+        return n->value->second;
     }
     
-    std::pair<iterator, iterator>
-    get_insert_pos(const key_type& k)
+    iterator
+    insert_impl(node* p, value_type* value)
     {
-    	typedef std::pair<iterator, iterator> __Res;
-        if (size()==0) return __Res(iterator(root_), iterator(root_));
-        iterator f = find(k);
-        if (f != end()) return __Res(0, f);
-        iterator x = root_->parent;
-        iterator y = root_;
-        bool comp = true;
-        while (y != 0)
-        {
-        	x = y;
-            comp = key_compare_(k, y.node_->value->first);
-            y = comp ? y.node_->left : y.node_->right;
-        }
-        iterator j = iterator(x);
-        return __Res(j, j);
+        node* z = new_node();
+        z->value = value;
+        return link_node(p, z);
     }
     
+    // Links z, a detached node holding a value, as a child of p as returned
+    // by get_insert_pos.
     iterator
-    insert_impl(node* p, const value_type& v)
+    link_node(node* p, node* z)
     {
-    	value_type *value = new value_type(v.first, v.second);
-        if (size()==0){
-        	root_->value = value;
-        	root_->update_balance();
-			++node_count_;
-			min_node_ = root_;
-			max_node_ = root_;
-			return iterator(root_);
-        } else {
-            node* z = new node;
-            z->value = value;
-            z->height = 1;
-            if (p->parent == 0){
-        		z->parent = p;
-        		if (key_compare_(value->first, p->value->first)) p->left = z;
-        		else p->right = z;
-        		p->update_balance();
-        	} else {
-        		bool insert_left = (p == root_
-                                    || key_compare_(value->first, p->value->first));
-        		z->parent = p;
-        		insert_and_rebalance(insert_left, z, p);
-        	}
-            
-			++node_count_;
-			if (min_node_ == 0 || min_node_->value->first > z->value->first){
-        		min_node_ = z;
-			}
-            
-			if (max_node_ == 0 || max_node_->value->first < z->value->first){
-        		max_node_ = z;
-			}
-		    return iterator(z);
+        z->set_prefix(z->value->first);
+        z->set_own_digest(*z->value);
+        z->parent = p;
+        z->left = 0;
+        z->right = 0;
+        z->height = 1;
+        z->balance = 0;
+        z->queued = 0;
+        index_.insert(z);
+        ++node_count_;
+        if (p == 0){
+        	node_sync::publish(root_, z);
+        	min_node_ = z;
+        	max_node_ = z;
+        	refresh_digests(z);
+        	return iterator(z AVL_MAP_STATS_ARG);
         }
+        bool insert_left = key_less(z->value->first, p->value->first);
+        if (insert_left) node_sync::publish(p->left, z);
+        else node_sync::publish(p->right, z);
+        refresh_digests(z);
+        fix_after_insert(p);
+        // only a child of the old extreme can be a new extreme
+        if (insert_left && p == min_node_) min_node_ = z;
+        if (!insert_left && p == max_node_) max_node_ = z;
+        return iterator(z AVL_MAP_STATS_ARG);
     }
     
+    // The rotations relink bottom up, the nodes that go down first and the
+    // link from above last, so that a reader in the single-writer mode
+    // never follows a cycle; the nodes going down lose keys and are marked.
     node* right_rotation(node *a){
     	node *parent = a->parent;
     	node *b = a->right;
-    	if (b->left_height() < b->right_height()){
+    	if (b->left_height() <= b->right_height()){
             // need single rotation
-    		if (root_==a) root_=b;
+            AVL_MAP_COUNT(single_rotations);
     		node *t1 = b->left;
             //restructure
-    		if (parent != 0){
-    			bool is_left_child = ( a == parent->left);
-    			if (is_left_child) parent->left = b; else parent->right = b;
-    		}
+    		a->begin_shrink();
+    		node_sync::publish(a->right, t1); if(t1) t1->parent = a;
+    		node_sync::publish(b->left, a); a->parent = b;
+    		replace_child(parent, a, b);
     		b->parent = parent;
-    		b->left = a; a->parent = b;
-    		a->right = t1; if(t1) t1->parent = a;
+    		a->end_shrink();
     		a->update_balance();
     		b->update_balance();
     		return b;
     	} else {
             // need double rotation
+            AVL_MAP_COUNT(double_rotations);
     		node *c = b->left;
-    		if (root_==a) root_=c;
     		node *t1 = c->left;
     		node *t2 = c->right;
             // restructure
-    		if (parent != 0){
-    			bool is_left_child = ( a == parent->left);
-    			if (is_left_child) parent->left = c; else parent->right = c;
-    		}
+    		a->begin_shrink();
+    		b->begin_shrink();
+			node_sync::publish(a->right, t1); if(t1) t1->parent = a;
+			node_sync::publish(b->left, t2); if(t2) t2->parent = b;
+			node_sync::publish(c->left, a); a->parent = c;
+			node_sync::publish(c->right, b); b->parent = c;
+			replace_child(parent, a, c);
 			c->parent = parent;
-			c->left = a; a->parent = c;
-			c->right = b; b->parent = c;
-			a->right = t1; if(t1) t1->parent = a;
-			b->left = t2; if(t2) t2->parent = b;
+			a->end_shrink();
+			b->end_shrink();
 			b->update_balance();
 			a->update_balance();
 			c->update_balance();
@@ -1003,36 +3241,36 @@ private: // helper functions
     node* left_rotation(node* a){
     	node *parent = a->parent;
 		node *b = a->left;
-		if (b->right_height() < b->left_height()){
+		if (b->right_height() <= b->left_height()){
             // need single rotation
-			if (root_==a) root_=b;
+            AVL_MAP_COUNT(single_rotations);
 			node* t1 = b->right;
             // restructure
-			if (parent != 0){
-				bool is_left_child = ( a == parent->left);
-				if (is_left_child) parent->left = b; else parent->right = b;
-			}
+			a->begin_shrink();
+			node_sync::publish(a->left, t1); if(t1) t1->parent = a;
+			node_sync::publish(b->right, a); a->parent = b;
+			replace_child(parent, a, b);
 			b->parent = parent;
-			b->right = a; a->parent = b;
-			a->left = t1; if(t1) t1->parent = a;
+			a->end_shrink();
 			a->update_balance();
 			b->update_balance();
 			return b;
 		} else {
             // need double rotation
+            AVL_MAP_COUNT(double_rotations);
 			node* c = b->right;
-			if (root_==a) root_=c;
 			node* t2 = c->left;
 			node* t1 = c->right;
-			if (parent != 0){
-				bool is_left_child = ( a == parent->left);
-				if (is_left_child) parent->left = c; else parent->right = c;
-			}
+			a->begin_shrink();
+			b->begin_shrink();
+			node_sync::publish(b->right, t2); if(t2) t2->parent = b;
+			node_sync::publish(a->left, t1); if(t1) t1->parent = a;
+			node_sync::publish(c->left, b); b->parent = c;
+			node_sync::publish(c->right, a); a->parent = c;
+			replace_child(parent, a, c);
 			c->parent = parent;
-			c->left = b; b->parent = c;
-			c->right = a; a->parent = c;
-			b->right = t2; if(t2) t2->parent = b;
-			a->left = t1; if(t1) t1->parent = a;
+			a->end_shrink();
+			b->end_shrink();
 			a->update_balance();
 			b->update_balance();
 			c->update_balance();
@@ -1043,52 +3281,172 @@ private: // helper functions
     void rebalance(node *p){
     	node *temp = p;
     	while (temp != 0){
+            AVL_MAP_COUNT(rebalance_steps);
+            size_type old_height = temp->height;
     		temp->update_balance();
     		if (temp->balance < -1){ // need right rotation
     			temp = right_rotation(temp);
     		} else if (temp->balance > 1){ // need left rotation
     			temp = left_rotation(temp);
     		}
+    		// the ancestors only depend on the height of this subtree
+    		if (temp->height == old_height) return;
     		temp = temp -> parent;
     	}
     }
     
-    void insert_left_and_rebalance(node *new_node, node *p){
-    	p->left = new_node;
+    // Called with the barriers removed once p has gained a leaf.
+    void fix_after_insert(node* p){
+    	if (relaxed_) defer_fix(p);
+    	else rebalance_after_insert(p, balance_policy());
+    }
+    
+    // Called with the barriers removed once p's subtree has lost a node.
+    void fix_after_erase(node* p){
+    	if (relaxed_) defer_fix(p);
+    	else rebalance_after_erase(p, balance_policy());
+    }
+    
+    void rebalance_after_insert(node* p, avl_height_balance){
     	rebalance(p);
     }
     
-    void insert_right_and_rebalance(node *new_node, node *p){
-    	p->right = new_node;
+    void rebalance_after_erase(node* p, avl_height_balance){
     	rebalance(p);
     }
     
-    void insert_and_rebalance(bool insert_left, node *new_node, node *p){
-    	if (insert_left){
-    		insert_left_and_rebalance(new_node, p);
+    // Promotes p while it has a child of its own rank and a sibling of that
+    // child one rank below, then restores the rank rule with one single or
+    // double rotation, which here gives the same ranks as the AVL rotation
+    // helpers compute.
+    void rebalance_after_insert(node* p, avl_weak_balance){
+    	for (; p != 0; p = p->parent){
+    		AVL_MAP_COUNT(rebalance_steps);
+    		size_type lr = p->left_height();
+    		size_type rr = p->right_height();
+    		if (lr != p->height && rr != p->height) return;
+    		if (std::min(lr, rr) + 1 == p->height){
+    			++p->height;
+    			continue;
+    		}
+    		if (lr == p->height) left_rotation(p);
+    		else right_rotation(p);
+    		return;
+    	}
+    }
+    
+    // Walks up from p while it is a leaf of rank 2 or has a child three
+    // ranks below it, demoting, and ends with at most one single or double
+    // rotation.
+    void rebalance_after_erase(node* p, avl_weak_balance){
+    	while (p != 0){
+    		AVL_MAP_COUNT(rebalance_steps);
+    		size_type r = p->height;
+    		if (p->left == 0 && p->right == 0){
+    			if (r == 1) return;
+    			p->height = 1;
+    			p = p->parent;
+    			continue;
+    		}
+    		bool left_short = r - p->left_height() == 3;
+    		if (!left_short && r - p->right_height() != 3) return;
+    		node* y = left_short ? p->right : p->left;
+    		if (r - y->height == 2){
+    			--p->height;
+    			p = p->parent;
+    			continue;
+    		}
+    		if (y->height - y->left_height() == 2 && y->height - y->right_height() == 2){
+    			--p->height;
+    			--y->height;
+    			p = p->parent;
+    			continue;
+    		}
+    		node* outer = left_short ? y->right : y->left;
+    		if (outer != 0 && y->height - outer->height == 1){
+    			AVL_MAP_COUNT(single_rotations);
+    			rotate_up(y);
+    			++y->height;
+    			p->height = (p->left == 0 && p->right == 0) ? 1 : r - 1;
+    		} else {
+    			AVL_MAP_COUNT(double_rotations);
+    			node* v = left_short ? y->left : y->right;
+    			rotate_up(v);
+    			rotate_up(v);
+    			v->height += 2;
+    			--y->height;
+    			p->height -= 2;
+    		}
+    		return;
+    	}
+    }
+    
+    // Rotates x above its parent. Only relinks and sums the digests; the
+    // caller sets the ranks.
+    void rotate_up(node* x){
+    	node* p = x->parent;
+    	node* g = p->parent;
+    	p->begin_shrink();
+    	if (p->left == x){
+    		node_sync::publish(p->left, x->right);
+    		if (x->right != 0) x->right->parent = p;
+    		node_sync::publish(x->right, p);
     	} else {
-    		insert_right_and_rebalance(new_node, p);
+    		node_sync::publish(p->right, x->left);
+    		if (x->left != 0) x->left->parent = p;
+    		node_sync::publish(x->left, p);
     	}
+    	p->parent = x;
+    	x->parent = g;
+    	replace_child(g, p, x);
+    	p->end_shrink();
+    	p->sum_digests(p->left, p->right);
+    	x->sum_digests(x->left, x->right);
     }
     
-    iterator lower_bound(iterator first, iterator last, const key_type& k)
-    {
-        while (first != 0)
-            if (key_compare()(first->first, k))
-                first = first.node_->right;
-            else
-                last = first, first = first.node_->left;
-        return iterator(last);
+    void defer_fix(node* p){
+    	if (p != 0) queue_node(p);
+    	for (size_type i = 0; i < piggyback_budget_ && !pending_.empty(); ++i) settle_step();
+    	while (pending_.size() > max_pending_) settle_step();
     }
     
-    iterator upper_bound(iterator first, iterator last, const key_type& k)
-    {
-        while (first != 0)
-            if (key_compare()(k, first->first))
-                last = first, first = first.node_->left;
-            else
-                first = first.node_->right;
-        return iterator(last);
+    // Queued once per violation, not once per node: merging them would
+    // leave a node deep in the stack collecting the growth of every later
+    // change under it, while a fresh entry brings it back to the top and the
+    // older one becomes a no-op.
+    // A count that saturates stays put: the node then looks queued until
+    // unlink() clears its entries, which only costs a search of the list.
+    void queue_node(node* t){
+    	if (t->queued != max_queued) ++t->queued;
+    	pending_.push_back(t);
+    }
+    
+    // One step of the relaxed pass. Every node off the list has its exact
+    // height and is in balance as far as its children's stored heights go,
+    // so a node whose stored height changes queues its parent, and a
+    // rotation, which may be decided on stale heights further down, queues
+    // whichever of the nodes it rebuilt are still out of balance.
+    void settle_step(){
+    	AVL_MAP_COUNT(relaxed_steps);
+    	node* t = pending_.back();
+    	pending_.pop_back();
+    	if (t->queued != max_queued) --t->queued;
+    	size_type old_height = t->height;
+    	t->update_balance();
+    	if (t->balance >= -1 && t->balance <= 1){
+    		if (t->height != old_height && t->parent != 0) queue_node(t->parent);
+    		return;
+    	}
+    	t = (t->balance < -1) ? right_rotation(t) : left_rotation(t);
+    	// the list is a stack: queue the parent first so that it comes last
+    	if (t->height != old_height && t->parent != 0) queue_node(t->parent);
+    	if (out_of_balance(t)) queue_node(t);
+    	if (out_of_balance(t->left)) queue_node(t->left);
+    	if (out_of_balance(t->right)) queue_node(t->right);
+    }
+    
+    static bool out_of_balance(const node* t){
+    	return t != 0 && (t->balance < -1 || t->balance > 1);
     }
 };
 
@@ -0,0 +1,197 @@
+#ifndef AVL_MAP_BUFFERED_H
+#define AVL_MAP_BUFFERED_H
+
+#if __cplusplus < 201103L
+# error "avlmap_buffered.h requires C++11"
+#endif
+
+#include "avlmap.h"
+
+#include <algorithm>
+#include <vector>
+
+// avl_tree for ingest-heavy use, in the manner of an LSM memtable. Writes
+// are blind: assign and erase go into a small sorted delta buffer, which
+// stays in cache, and the buffer is merged into the tree once it fills.
+// The merge finds every buffered key's place in one pass and then applies
+// the entries in key order, inserting at the bounds found. A buffer dense
+// in the tree, a key every few elements, is searched with
+// lower_bound_sorted(), each key from the previous key's bound, in
+// O(m log(n/m)) for m keys. A sparse one goes to lower_bound_batch(): its
+// root descents overlap their cache misses, where a finger search between
+// far apart keys misses at every step, up and down, one after another. An
+// erase is buffered as a tombstone, so T must be default constructible.
+//
+// find and count look in the buffer first, then in the tree. Everything
+// that needs the merged content in order (size, tree) flushes first.
+// Not copyable.
+template <typename key,
+typename T,
+typename compare = std::less<key> >
+class buffered_avl_map{
+
+public:
+    typedef key                                          key_type;
+    typedef T                                            mapped_type;
+    typedef compare                                      key_compare;
+    typedef avl_tree<key, T, compare>                    map_type;
+    typedef size_t                                       size_type;
+
+    enum { default_buffer_size = 256 };
+
+private:
+    // tree elements per buffered key up to which flush() uses finger
+    // searches; measured with bench/buffered_bench
+    enum { dense_ratio = 4 };
+
+    struct delta
+    {
+        mapped_type value;
+        bool erased;
+
+        delta(const mapped_type& v, bool e) : value(v), erased(e) {}
+    };
+
+    typedef typename map_type::iterator map_iterator;
+
+    map_type map_;
+    // the buffer: sorted keys, one per key, and their deltas at the same
+    // positions, apart so that searches only touch keys
+    std::vector<key_type> keys_;
+    std::vector<delta> deltas_;
+    std::vector<map_iterator> bounds_;
+    size_type buffer_size_;
+    key_compare comp_;
+
+    buffered_avl_map(const buffered_avl_map&);
+    buffered_avl_map& operator= (const buffered_avl_map&);
+
+public:
+    explicit buffered_avl_map(size_type buffer_size = default_buffer_size,
+                              const key_compare& comp = key_compare())
+    :map_(comp), buffer_size_(std::max<size_type>(1, buffer_size)), comp_(comp)
+    {
+        reserve();
+    }
+
+    // Stores v under k, replacing any value.
+    void assign(const key_type& k, const mapped_type& v)
+    {
+        put(k, v, false);
+    }
+
+    // Removes k if present.
+    void erase(const key_type& k)
+    {
+        put(k, mapped_type(), true);
+    }
+
+    // The value of k, or null if it is absent; valid until the next
+    // assign, erase or flush.
+    const mapped_type* find(const key_type& k) const
+    {
+        size_type i = buffer_find(k);
+        if (i < keys_.size()) return deltas_[i].erased ? 0 : &deltas_[i].value;
+        typename map_type::const_iterator j = map_.find(k);
+        return j != map_.end() ? &j->second : 0;
+    }
+
+    size_type count(const key_type& k) const
+    {
+        return find(k) != 0 ? 1 : 0;
+    }
+
+    // Merges the buffer into the tree.
+    void flush()
+    {
+        if (keys_.empty()) return;
+        bounds_.clear();
+        if (map_.size() <= dense_ratio * keys_.size())
+            map_.lower_bound_sorted(keys_.begin(), keys_.end(), std::back_inserter(bounds_));
+        else map_.lower_bound_batch(keys_.begin(), keys_.end(), std::back_inserter(bounds_));
+        // Applied in key order, every bound found stays the lower bound of
+        // its key: inserts add smaller keys, and erasing an element only
+        // frees its predecessor's node, which holds a smaller key too.
+        for (size_type i = 0; i < keys_.size(); ++i){
+            const delta& d = deltas_[i];
+            map_iterator j = bounds_[i];
+            bool present = j != map_.end() && !comp_(keys_[i], j->first);
+            if (d.erased){
+                if (present) map_.erase(j);
+            } else if (present) j->second = d.value;
+            else map_.insert(j, typename map_type::value_type(keys_[i], d.value));
+        }
+        keys_.clear();
+        deltas_.clear();
+    }
+
+    // Entries buffered past which the buffer is merged; a smaller buffer
+    // is merged at once.
+    void set_buffer_size(size_type n)
+    {
+        buffer_size_ = std::max<size_type>(1, n);
+        if (keys_.size() >= buffer_size_) flush();
+        reserve();
+    }
+
+    size_type buffer_size() const
+    {
+        return buffer_size_;
+    }
+
+    // Number of writes buffered.
+    size_type buffered() const
+    {
+        return keys_.size();
+    }
+
+    // Flushes, then counts.
+    size_type size()
+    {
+        flush();
+        return map_.size();
+    }
+
+    // The merged tree, for iteration and range queries.
+    const map_type& tree()
+    {
+        flush();
+        return map_;
+    }
+
+    void clear()
+    {
+        keys_.clear();
+        deltas_.clear();
+        map_.clear();
+    }
+
+private:
+    void reserve()
+    {
+        keys_.reserve(buffer_size_);
+        deltas_.reserve(buffer_size_);
+        bounds_.reserve(buffer_size_);
+    }
+
+    // position of k in the buffer, or its size if absent
+    size_type buffer_find(const key_type& k) const
+    {
+        size_type i = std::lower_bound(keys_.begin(), keys_.end(), k, comp_) - keys_.begin();
+        return (i < keys_.size() && !comp_(k, keys_[i])) ? i : keys_.size();
+    }
+
+    void put(const key_type& k, const mapped_type& v, bool erased)
+    {
+        size_type i = std::lower_bound(keys_.begin(), keys_.end(), k, comp_) - keys_.begin();
+        if (i < keys_.size() && !comp_(k, keys_[i])){
+            deltas_[i] = delta(v, erased);
+            return;
+        }
+        keys_.insert(keys_.begin() + i, k);
+        deltas_.insert(deltas_.begin() + i, delta(v, erased));
+        if (keys_.size() >= buffer_size_) flush();
+    }
+};
+
+#endif // AVL_MAP_BUFFERED_H
@@ -0,0 +1,357 @@
+#ifndef AVL_MAP_DURABLE_H
+#define AVL_MAP_DURABLE_H
+
+#if __cplusplus < 201103L
+# error "avlmap_durable.h requires C++11"
+#endif
+
+#include "avlmap.h"
+
+#include <cerrno>
+#include <condition_variable>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Durable avl_tree: every mutation is appended to a write-ahead log in
+// <dir>/wal and the whole map is periodically written to <dir>/checkpoint in
+// avl_map_file_header format. Opening the map loads the checkpoint and
+// replays the log tail. Key and mapped types must be trivially copyable.
+//
+// Mutations are only buffered; sync() makes everything issued before it
+// durable. Concurrent sync() callers share a single write + fdatasync
+// (group commit), so throughput scales with the number of waiting writers
+// instead of being capped by the latency of one fdatasync per write.
+//
+// Log records are idempotent "set" and "erase" operations, so replaying a
+// log that is already contained in the checkpoint (a crash between the
+// checkpoint rename and the log truncation) yields the same map.
+template <typename key,
+typename T,
+typename compare = std::less<key> >
+class durable_avl_map{
+
+public:
+    typedef avl_tree<key, T, compare>                    map_type;
+    typedef key                                          key_type;
+    typedef T                                            mapped_type;
+    typedef typename map_type::value_type                value_type;
+    typedef typename map_type::const_iterator            const_iterator;
+    typedef typename map_type::size_type                 size_type;
+
+    struct options
+    {
+        // a mutation that grows the pending log buffer past this size
+        // writes it out (without fdatasync) to bound memory use
+        size_t write_buffer_bytes;
+        // checkpoint automatically once the log grows past this size,
+        // 0 disables automatic checkpoints
+        size_t checkpoint_log_bytes;
+        options() : write_buffer_bytes(1 << 20), checkpoint_log_bytes(64 << 20) {}
+    };
+
+private:
+    enum { op_set = 1, op_erase = 2 };
+    enum { record_header_size = sizeof(uint32_t) + 1,
+        set_record_size = record_header_size + sizeof(key) + sizeof(T),
+        erase_record_size = record_header_size + sizeof(key) };
+
+    std::string dir_;
+    options options_;
+    map_type map_;
+    int log_fd_;
+
+    // guards map_ and the fields below
+    mutable std::mutex mutex_;
+    std::condition_variable synced_;
+    std::vector<char> pending_;   // log bytes not yet handed to write()
+    uint64_t next_lsn_;           // lsn of the next logged mutation
+    uint64_t durable_lsn_;        // mutations below this are synced
+    uint64_t log_bytes_;          // bytes written to the log file
+    bool syncing_;                // a group commit leader is in fdatasync
+    bool failed_;                 // a failed write could not be cut off the log
+
+    durable_avl_map(const durable_avl_map&);
+    durable_avl_map& operator= (const durable_avl_map&);
+
+public:
+    explicit durable_avl_map(const std::string& dir, const options& opt = options())
+    :dir_(dir), options_(opt), log_fd_(-1), next_lsn_(0), durable_lsn_(0),
+    log_bytes_(0), syncing_(false), failed_(false)
+    {
+        recover();
+    }
+
+    ~durable_avl_map(){
+        try {
+            sync();
+        } catch (...) {
+        }
+        if (log_fd_ >= 0) ::close(log_fd_);
+    }
+
+    // Inserts val if its key is absent. Returns whether it was inserted.
+    bool insert(const value_type& val){
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (!map_.insert(val).second) return false;
+        append(op_set, val.first, &val.second);
+        maybe_flush(lock);
+        return true;
+    }
+
+    // Sets the mapped value of k, inserting it if needed; the durable
+    // counterpart of `map[k] = v`.
+    void assign(const key_type& k, const mapped_type& v){
+        std::unique_lock<std::mutex> lock(mutex_);
+        map_[k] = v;
+        append(op_set, k, &v);
+        maybe_flush(lock);
+    }
+
+    size_type erase(const key_type& k){
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (map_.erase(k) == 0) return 0;
+        append(op_erase, k, 0);
+        maybe_flush(lock);
+        return 1;
+    }
+
+    // Blocks until every mutation issued before the call is on disk. If
+    // that fails, the mutations stay buffered for the next sync; if the log
+    // cannot even be cut back to its last whole record, every sync throws
+    // until a checkpoint succeeds.
+    void sync(){
+        std::unique_lock<std::mutex> lock(mutex_);
+        sync_until(lock, next_lsn_);
+    }
+
+    // Writes the whole map to a new checkpoint and truncates the log.
+    // Mutations are blocked for the duration.
+    void checkpoint(){
+        std::unique_lock<std::mutex> lock(mutex_);
+        checkpoint_locked(lock);
+    }
+
+    // Read access. The reference is not synchronized with concurrent
+    // mutations; callers sharing the map between threads must serialize
+    // reads with their writes themselves.
+    const map_type& map() const
+    {
+        return map_;
+    }
+
+    size_type size() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return map_.size();
+    }
+
+    uint64_t log_size() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return log_bytes_ + pending_.size();
+    }
+
+private:
+    std::string checkpoint_path() const { return dir_ + "/checkpoint"; }
+    std::string log_path() const { return dir_ + "/wal"; }
+
+    static void throw_errno(const std::string& what){
+        throw std::runtime_error("durable avl map: " + what + ": " + std::strerror(errno));
+    }
+
+    // FNV-1a, enough to detect a torn record at the log tail
+    static uint32_t checksum(const char* p, size_t n){
+        uint32_t h = 2166136261u;
+        for (size_t i = 0; i < n; ++i){
+            h ^= (unsigned char)p[i];
+            h *= 16777619u;
+        }
+        return h;
+    }
+
+    static void write_all(int fd, const char* p, size_t n){
+        while (n > 0){
+            ssize_t w = ::write(fd, p, n);
+            if (w < 0){
+                if (errno == EINTR) continue;
+                throw_errno("write");
+            }
+            p += w;
+            n -= (size_t)w;
+        }
+    }
+
+    static void sync_dir(const std::string& dir){
+        int fd = ::open(dir.c_str(), O_RDONLY);
+        if (fd < 0) throw_errno("open " + dir);
+        ::fsync(fd);
+        ::close(fd);
+    }
+
+    void append(char op, const key_type& k, const mapped_type* v){
+        size_t at = pending_.size();
+        size_t n = (op == op_set) ? set_record_size : erase_record_size;
+        pending_.resize(at + n);
+        char* rec = &pending_[at];
+        rec[sizeof(uint32_t)] = op;
+        std::memcpy(rec + record_header_size, &k, sizeof(key_type));
+        if (v != 0) std::memcpy(rec + record_header_size + sizeof(key_type), v, sizeof(mapped_type));
+        uint32_t sum = checksum(rec + sizeof(uint32_t), n - sizeof(uint32_t));
+        std::memcpy(rec, &sum, sizeof(sum));
+        ++next_lsn_;
+    }
+
+    void maybe_flush(std::unique_lock<std::mutex>& lock){
+        if (options_.checkpoint_log_bytes != 0
+            && log_bytes_ + pending_.size() >= options_.checkpoint_log_bytes){
+            checkpoint_locked(lock);
+        } else if (pending_.size() >= options_.write_buffer_bytes && !syncing_ && !failed_){
+            try {
+                write_all(log_fd_, pending_.data(), pending_.size());
+            } catch (...) {
+                if (!rewind_log(log_bytes_)) failed_ = true;
+                throw;
+            }
+            log_bytes_ += pending_.size();
+            pending_.clear();
+        }
+    }
+
+    // Cuts the log back to `at` bytes after a failed write, which may have
+    // left part of a record behind. Recovery stops at the first bad record,
+    // so a torn one mid-log would hide every record written after it.
+    bool rewind_log(uint64_t at){
+        return ::ftruncate(log_fd_, (off_t)at) == 0 && ::lseek(log_fd_, (off_t)at, SEEK_SET) >= 0;
+    }
+
+    // Group commit: the first waiter becomes the leader, writes everything
+    // pending and runs fdatasync with the lock released; mutations arriving
+    // meanwhile are picked up by the next leader. On failure the batch goes
+    // back in front of them, and the log is cut back to where it started:
+    // after a failed fdatasync the written pages may be lost as well.
+    void sync_until(std::unique_lock<std::mutex>& lock, uint64_t lsn){
+        while (durable_lsn_ < lsn){
+            if (syncing_){
+                synced_.wait(lock);
+                continue;
+            }
+            if (failed_) throw std::runtime_error("durable avl map: log damaged by a failed write");
+            syncing_ = true;
+            std::vector<char> batch;
+            batch.swap(pending_);
+            uint64_t batch_lsn = next_lsn_;
+            uint64_t at = log_bytes_;
+            lock.unlock();
+            try {
+                write_all(log_fd_, batch.data(), batch.size());
+                if (::fdatasync(log_fd_) != 0) throw_errno("fdatasync");
+            } catch (...) {
+                bool rewound = rewind_log(at);
+                lock.lock();
+                batch.insert(batch.end(), pending_.begin(), pending_.end());
+                pending_.swap(batch);
+                if (!rewound) failed_ = true;
+                syncing_ = false;
+                synced_.notify_all();
+                throw;
+            }
+            lock.lock();
+            log_bytes_ += batch.size();
+            durable_lsn_ = batch_lsn;
+            syncing_ = false;
+            synced_.notify_all();
+        }
+    }
+
+    void checkpoint_locked(std::unique_lock<std::mutex>& lock){
+        while (syncing_) synced_.wait(lock);
+        std::string tmp = checkpoint_path() + ".tmp";
+        {
+            std::ofstream os(tmp.c_str(), std::ios::binary | std::ios::trunc);
+            map_.save(os);
+            os.flush();
+            if (!os) throw std::runtime_error("durable avl map: checkpoint write failed");
+        }
+        int fd = ::open(tmp.c_str(), O_RDONLY);
+        if (fd < 0) throw_errno("open " + tmp);
+        if (::fsync(fd) != 0){
+            int e = errno;
+            ::close(fd);
+            errno = e;
+            throw_errno("fsync " + tmp);
+        }
+        ::close(fd);
+        if (::rename(tmp.c_str(), checkpoint_path().c_str()) != 0) throw_errno("rename");
+        sync_dir(dir_);
+        // everything logged so far is covered by the checkpoint
+        pending_.clear();
+        if (::ftruncate(log_fd_, 0) != 0 || ::lseek(log_fd_, 0, SEEK_SET) != 0)
+            throw_errno("truncate " + log_path());
+        if (::fdatasync(log_fd_) != 0) throw_errno("fdatasync");
+        log_bytes_ = 0;
+        durable_lsn_ = next_lsn_;
+        failed_ = false;
+    }
+
+    void recover(){
+        ::mkdir(dir_.c_str(), 0755);
+        {
+            std::ifstream is(checkpoint_path().c_str(), std::ios::binary);
+            if (is) map_.load(is);
+        }
+        log_fd_ = ::open(log_path().c_str(), O_RDWR | O_CREAT, 0644);
+        if (log_fd_ < 0) throw_errno("open " + log_path());
+
+        std::vector<char> log;
+        char buf[1 << 16];
+        for (;;){
+            ssize_t r = ::read(log_fd_, buf, sizeof(buf));
+            if (r < 0){
+                if (errno == EINTR) continue;
+                throw_errno("read " + log_path());
+            }
+            if (r == 0) break;
+            log.insert(log.end(), buf, buf + r);
+        }
+        size_t pos = replay(log);
+        // drop a torn tail so that new records follow the last valid one
+        if (pos != log.size() && ::ftruncate(log_fd_, (off_t)pos) != 0)
+            throw_errno("truncate " + log_path());
+        if (::lseek(log_fd_, (off_t)pos, SEEK_SET) < 0) throw_errno("lseek");
+        log_bytes_ = pos;
+    }
+
+    // Applies every complete, intact record and returns the length of
+    // that valid prefix.
+    size_t replay(const std::vector<char>& log){
+        size_t pos = 0;
+        while (pos + record_header_size <= log.size()){
+            const char* rec = &log[pos];
+            char op = rec[sizeof(uint32_t)];
+            size_t n = (op == op_set) ? set_record_size
+            : (op == op_erase) ? erase_record_size : 0;
+            if (n == 0 || pos + n > log.size()) break;
+            uint32_t sum;
+            std::memcpy(&sum, rec, sizeof(sum));
+            if (sum != checksum(rec + sizeof(uint32_t), n - sizeof(uint32_t))) break;
+            key_type k;
+            std::memcpy(&k, rec + record_header_size, sizeof(key_type));
+            if (op == op_set){
+                mapped_type v;
+                std::memcpy(&v, rec + record_header_size + sizeof(key_type), sizeof(mapped_type));
+                map_[k] = v;
+            } else {
+                map_.erase(k);
+            }
+            pos += n;
+        }
+        return pos;
+    }
+};
+
+#endif // AVL_MAP_DURABLE_H
@@ -0,0 +1,227 @@
+#ifndef AVL_MAP_EXPIRING_H
+#define AVL_MAP_EXPIRING_H
+
+#if __cplusplus < 201103L
+# error "avlmap_expiring.h requires C++11"
+#endif
+
+#include "avlmap.h"
+
+#include <chrono>
+
+// avl_tree whose entries expire: a cache with a time to live per entry.
+// Besides the key order, entries are ordered by expiry time in a pairing
+// heap whose links live in the entries themselves, so the second index
+// costs four pointers per entry and no allocation. Values never move once
+// inserted (the tree relinks nodes and swaps value pointers, never the
+// values), which keeps the links valid.
+//
+// Expired entries are absent to find() but stay in the map, and count in
+// size(), until expire_until() removes them, in O(log n) each, oldest first.
+// Every call that needs the time also takes it as a last argument, which
+// otherwise defaults to Clock::now(). Not copyable.
+template <typename key,
+typename T,
+typename Clock = std::chrono::steady_clock,
+typename compare = std::less<key> >
+class expiring_avl_map{
+
+public:
+    typedef key                                          key_type;
+    typedef T                                            mapped_type;
+    typedef compare                                      key_compare;
+    typedef typename Clock::time_point                   time_point;
+    typedef typename Clock::duration                     duration;
+    typedef size_t                                       size_type;
+
+private:
+    struct entry
+    {
+        T value;
+        time_point expires;
+        // pairing heap links: first child, next sibling, and the previous
+        // sibling or, for a first child, the parent
+        entry* child;
+        entry* next;
+        entry* prev;
+        const key_type* k;
+
+        entry(const T& v, time_point e)
+        :value(v), expires(e), child(0), next(0), prev(0), k(0) {}
+    };
+
+    typedef avl_tree<key, entry, compare>                map_type;
+    typedef typename map_type::iterator                  map_iterator;
+
+    map_type map_;
+    entry* heap_;   // the entry that expires first
+
+    expiring_avl_map(const expiring_avl_map&);
+    expiring_avl_map& operator= (const expiring_avl_map&);
+
+public:
+    explicit expiring_avl_map(const key_compare& comp = key_compare())
+    :map_(comp), heap_(0)
+    {
+    }
+
+    // Inserts k unless it is present and unexpired; an expired entry is
+    // replaced. Returns whether v was stored.
+    bool insert(const key_type& k, const mapped_type& v, duration ttl,
+                time_point now = Clock::now())
+    {
+        std::pair<map_iterator, bool> r = map_.insert(std::make_pair(k, entry(v, now + ttl)));
+        entry& e = r.first->second;
+        if (r.second){
+            e.k = &r.first->first;
+            heap_ = meld(heap_, &e);
+            return true;
+        }
+        if (now < e.expires) return false;
+        reschedule(e, now + ttl);
+        e.value = v;
+        return true;
+    }
+
+    // Stores v under k with a fresh time to live, expired or not.
+    void assign(const key_type& k, const mapped_type& v, duration ttl,
+                time_point now = Clock::now())
+    {
+        if (!insert(k, v, ttl, now)){
+            entry& e = map_.find(k)->second;
+            reschedule(e, now + ttl);
+            e.value = v;
+        }
+    }
+
+    // The value of k, or null if it is absent or expired.
+    mapped_type* find(const key_type& k, time_point now = Clock::now())
+    {
+        map_iterator i = map_.find(k);
+        if (i == map_.end() || !(now < i->second.expires)) return 0;
+        return &i->second.value;
+    }
+
+    const mapped_type* find(const key_type& k, time_point now = Clock::now()) const
+    {
+        typename map_type::const_iterator i = map_.find(k);
+        if (i == map_.end() || !(now < i->second.expires)) return 0;
+        return &i->second.value;
+    }
+
+    // Gives k a new time to live if it is unexpired. Returns whether it was.
+    bool touch(const key_type& k, duration ttl, time_point now = Clock::now())
+    {
+        map_iterator i = map_.find(k);
+        if (i == map_.end() || !(now < i->second.expires)) return false;
+        reschedule(i->second, now + ttl);
+        return true;
+    }
+
+    // Removes k, expired or not.
+    size_type erase(const key_type& k)
+    {
+        map_iterator i = map_.find(k);
+        if (i == map_.end()) return 0;
+        heap_remove(&i->second);
+        map_.erase(i);
+        return 1;
+    }
+
+    // Removes every entry that expires at or before now and returns how many
+    // there were.
+    size_type expire_until(time_point now = Clock::now())
+    {
+        size_type n = 0;
+        while (heap_ != 0 && !(now < heap_->expires)){
+            entry* e = heap_;
+            heap_ = merge_pairs(e->child);
+            map_.erase(*e->k);
+            ++n;
+        }
+        return n;
+    }
+
+    // When the first entry expires; the map must not be empty.
+    time_point next_expiry() const
+    {
+        return heap_->expires;
+    }
+
+    void clear()
+    {
+        map_.clear();
+        heap_ = 0;
+    }
+
+    bool empty() const
+    {
+        return map_.empty();
+    }
+
+    size_type size() const
+    {
+        return map_.size();
+    }
+
+private:
+    void reschedule(entry& e, time_point expires)
+    {
+        heap_remove(&e);
+        e.expires = expires;
+        heap_ = meld(heap_, &e);
+    }
+
+    // Links two heap roots, either of which may be null.
+    static entry* meld(entry* a, entry* b)
+    {
+        if (a == 0) return b;
+        if (b == 0) return a;
+        if (b->expires < a->expires) std::swap(a, b);
+        b->prev = a;
+        b->next = a->child;
+        if (a->child != 0) a->child->prev = b;
+        a->child = b;
+        return a;
+    }
+
+    // The two-pass pairing of a list of siblings into one heap: meld them
+    // in pairs from the left, then meld the pairs from the right.
+    static entry* merge_pairs(entry* first)
+    {
+        entry* pairs = 0;
+        while (first != 0){
+            entry* a = first;
+            entry* b = a->next;
+            first = (b != 0) ? b->next : 0;
+            a->next = a->prev = 0;
+            if (b != 0) b->next = b->prev = 0;
+            a = meld(a, b);
+            a->next = pairs;
+            pairs = a;
+        }
+        entry* root = 0;
+        while (pairs != 0){
+            entry* rest = pairs->next;
+            pairs->next = 0;
+            root = meld(root, pairs);
+            pairs = rest;
+        }
+        return root;
+    }
+
+    void heap_remove(entry* e)
+    {
+        if (e == heap_){
+            heap_ = merge_pairs(e->child);
+        } else {
+            if (e->prev->child == e) e->prev->child = e->next;
+            else e->prev->next = e->next;
+            if (e->next != 0) e->next->prev = e->prev;
+            heap_ = meld(heap_, merge_pairs(e->child));
+        }
+        e->child = e->next = e->prev = 0;
+    }
+};
+
+#endif // AVL_MAP_EXPIRING_H
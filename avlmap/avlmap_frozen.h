@@ -0,0 +1,385 @@
+#ifndef AVL_MAP_FROZEN_H
+#define AVL_MAP_FROZEN_H
+
+#if __cplusplus < 201703L
+# error "avlmap_frozen.h requires C++17"
+#endif
+
+#include "avlmap.h"
+
+#include <array>
+#include <iterator>
+#include <stdexcept>
+#include <utility>
+
+// Immutable map built at compile time, for static lookup tables. The
+// constructor sorts the pairs, rejects duplicate keys and lays them out
+// as a complete binary tree in Eytzinger (breadth-first) order: the
+// children of slot i, counting from 1, are slots 2i and 2i + 1. There
+// are no links to store or chase, the top levels share cache lines, and
+// a descent is a branch-free loop. Declared constexpr, the map is built
+// by the compiler into read-only storage, so it costs no allocation and
+// no initialization at run time:
+//
+//   constexpr auto opcodes = make_frozen_avl_map<int, std::string_view>({
+//       {0x01, "add"}, {0x02, "sub"}, {0x10, "jmp"}});
+//
+// A duplicate key then fails to compile; at run time it throws
+// std::invalid_argument. Keys, values and the comparator must be literal
+// types and the comparator constexpr. Iteration is in key order.
+template <typename key,
+typename T,
+size_t N,
+typename compare = std::less<key> >
+class frozen_avl_map{
+
+public:
+    typedef key                                          key_type;
+    typedef T                                            mapped_type;
+    typedef std::pair<const key, T>                      value_type;
+    typedef compare                                      key_compare;
+    typedef const value_type&                            const_reference;
+    typedef size_t                                       size_type;
+    typedef ptrdiff_t                                    difference_type;
+
+    class const_iterator
+    {
+    public:
+        typedef std::bidirectional_iterator_tag          iterator_category;
+        typedef typename frozen_avl_map::value_type      value_type;
+        typedef ptrdiff_t                                difference_type;
+        typedef const value_type*                        pointer;
+        typedef const value_type&                        reference;
+
+    private:
+        friend class frozen_avl_map;
+
+        const value_type* tree_;
+        size_type slot_;    // 0 past the end
+
+        constexpr const_iterator(const value_type* tree, size_type slot) : tree_(tree), slot_(slot) {}
+
+    public:
+        constexpr const_iterator() : tree_(0), slot_(0) {}
+
+        constexpr reference operator*() const
+        {
+            return tree_[slot_ - 1];
+        }
+
+        constexpr pointer operator->() const
+        {
+            return &tree_[slot_ - 1];
+        }
+
+        constexpr const_iterator& operator++()
+        {
+            slot_ = next_slot(slot_);
+            return *this;
+        }
+
+        constexpr const_iterator operator++(int)
+        {
+            const_iterator tmp = *this;
+            slot_ = next_slot(slot_);
+            return tmp;
+        }
+
+        constexpr const_iterator& operator--()
+        {
+            slot_ = prev_slot(slot_);
+            return *this;
+        }
+
+        constexpr const_iterator operator--(int)
+        {
+            const_iterator tmp = *this;
+            slot_ = prev_slot(slot_);
+            return tmp;
+        }
+
+        constexpr bool operator==(const const_iterator& x) const
+        {
+            return slot_ == x.slot_;
+        }
+
+        constexpr bool operator!=(const const_iterator& x) const
+        {
+            return slot_ != x.slot_;
+        }
+    };
+
+    typedef const_iterator                               iterator;
+    typedef std::reverse_iterator<const_iterator>        const_reverse_iterator;
+    typedef const_reverse_iterator                       reverse_iterator;
+
+private:
+    std::array<value_type, N> tree_;    // Eytzinger order, slot i at tree_[i - 1]
+    key_compare key_compare_;
+
+    template <size_t... I>
+    constexpr frozen_avl_map(const std::pair<key, T> (&items)[N], const key_compare& comp,
+                             const std::array<size_type, N>& from, std::index_sequence<I...>)
+    :tree_{{value_type(items[from[I]])...}}, key_compare_(comp)
+    {
+    }
+
+public:
+    constexpr explicit frozen_avl_map(const std::pair<key, T> (&items)[N],
+                                      const key_compare& comp = key_compare())
+    :frozen_avl_map(items, comp, layout(items, comp), std::make_index_sequence<N>())
+    {
+    }
+
+    constexpr const_iterator begin() const NOEXCEPT
+    {
+        return const_iterator(tree_.data(), first_slot());
+    }
+
+    constexpr const_iterator cbegin() const NOEXCEPT
+    {
+        return begin();
+    }
+
+    constexpr const_iterator end() const NOEXCEPT
+    {
+        return const_iterator(tree_.data(), 0);
+    }
+
+    constexpr const_iterator cend() const NOEXCEPT
+    {
+        return end();
+    }
+
+    constexpr const_reverse_iterator rbegin() const NOEXCEPT
+    {
+        return const_reverse_iterator(end());
+    }
+
+    constexpr const_reverse_iterator crbegin() const NOEXCEPT
+    {
+        return rbegin();
+    }
+
+    constexpr const_reverse_iterator rend() const NOEXCEPT
+    {
+        return const_reverse_iterator(begin());
+    }
+
+    constexpr const_reverse_iterator crend() const NOEXCEPT
+    {
+        return rend();
+    }
+
+    constexpr bool empty() const NOEXCEPT
+    {
+        return N == 0;
+    }
+
+    constexpr size_type size() const NOEXCEPT
+    {
+        return N;
+    }
+
+    constexpr size_type max_size() const NOEXCEPT
+    {
+        return N;
+    }
+
+    constexpr const_iterator find(const key_type& k) const
+    {
+        return find_impl(k);
+    }
+
+    constexpr const_iterator lower_bound(const key_type& k) const
+    {
+        return const_iterator(tree_.data(), lower_bound_slot(k));
+    }
+
+    constexpr const_iterator upper_bound(const key_type& k) const
+    {
+        return const_iterator(tree_.data(), upper_bound_slot(k));
+    }
+
+    constexpr std::pair<const_iterator, const_iterator>
+    equal_range(const key_type& k) const
+    {
+        return std::pair<const_iterator, const_iterator>(lower_bound(k), upper_bound(k));
+    }
+
+    constexpr size_type count(const key_type& k) const
+    {
+        return find(k) == end() ? 0 : 1;
+    }
+
+    constexpr const mapped_type& at(const key_type& k) const
+    {
+        const_iterator res = find(k);
+        if (res == end()) throw std::out_of_range("key doesn't exist");
+        return res->second;
+    }
+
+    template <typename K, typename C = key_compare,
+    typename = typename std::enable_if<avl_is_transparent<C>::value>::type>
+    constexpr const_iterator find(const K& k) const
+    {
+        return find_impl(k);
+    }
+
+    template <typename K, typename C = key_compare,
+    typename = typename std::enable_if<avl_is_transparent<C>::value>::type>
+    constexpr const_iterator lower_bound(const K& k) const
+    {
+        return const_iterator(tree_.data(), lower_bound_slot(k));
+    }
+
+    template <typename K, typename C = key_compare,
+    typename = typename std::enable_if<avl_is_transparent<C>::value>::type>
+    constexpr const_iterator upper_bound(const K& k) const
+    {
+        return const_iterator(tree_.data(), upper_bound_slot(k));
+    }
+
+    template <typename K, typename C = key_compare,
+    typename = typename std::enable_if<avl_is_transparent<C>::value>::type>
+    constexpr std::pair<const_iterator, const_iterator>
+    equal_range(const K& k) const
+    {
+        return std::pair<const_iterator, const_iterator>(lower_bound(k), upper_bound(k));
+    }
+
+    template <typename K, typename C = key_compare,
+    typename = typename std::enable_if<avl_is_transparent<C>::value>::type>
+    constexpr size_type count(const K& k) const
+    {
+        return find(k) == end() ? 0 : 1;
+    }
+
+    constexpr key_compare key_comp() const
+    {
+        return key_compare_;
+    }
+
+private:
+    template <typename K>
+    constexpr const_iterator find_impl(const K& k) const
+    {
+        size_type i = lower_bound_slot(k);
+        return const_iterator(tree_.data(), (i == 0 || key_compare_(k, tree_[i - 1].first)) ? 0 : i);
+    }
+
+    // Descends to a leaf, appending one bit per level to the slot number:
+    // 1 where the element is below k. The bound is the last node left
+    // turned at, so strip the trailing right turns and then that turn.
+    template <typename K>
+    constexpr size_type lower_bound_slot(const K& k) const
+    {
+        size_type i = 1;
+        while (i <= N) i = 2 * i + (key_compare_(tree_[i - 1].first, k) ? 1 : 0);
+        while (i & 1) i >>= 1;
+        return i >> 1;
+    }
+
+    template <typename K>
+    constexpr size_type upper_bound_slot(const K& k) const
+    {
+        size_type i = 1;
+        while (i <= N) i = 2 * i + (key_compare_(k, tree_[i - 1].first) ? 0 : 1);
+        while (i & 1) i >>= 1;
+        return i >> 1;
+    }
+
+    static constexpr size_type first_slot()
+    {
+        if (N == 0) return 0;
+        size_type i = 1;
+        while (2 * i <= N) i = 2 * i;
+        return i;
+    }
+
+    static constexpr size_type last_slot()
+    {
+        if (N == 0) return 0;
+        size_type i = 1;
+        while (2 * i + 1 <= N) i = 2 * i + 1;
+        return i;
+    }
+
+    // In-order successor: the leftmost slot of the right subtree, else the
+    // parent of the nearest ancestor that is a left child; 0 past the last.
+    static constexpr size_type next_slot(size_type i)
+    {
+        if (2 * i + 1 <= N){
+            i = 2 * i + 1;
+            while (2 * i <= N) i = 2 * i;
+            return i;
+        }
+        while (i & 1) i >>= 1;
+        return i >> 1;
+    }
+
+    static constexpr size_type prev_slot(size_type i)
+    {
+        if (i == 0) return last_slot();
+        if (2 * i <= N){
+            i = 2 * i;
+            while (2 * i + 1 <= N) i = 2 * i + 1;
+            return i;
+        }
+        while (!(i & 1)) i >>= 1;
+        return i >> 1;
+    }
+
+    // For every slot, the index of the item that goes there.
+    static constexpr std::array<size_type, N> layout(const std::pair<key, T> (&items)[N],
+                                                     const key_compare& comp)
+    {
+        std::array<size_type, N> order{};
+        for (size_type i = 0; i < N; ++i) order[i] = i;
+        // heapsort by key: std::sort is not constexpr before C++20
+        for (size_type n = N / 2; n-- > 0;) sift_down(order, n, N, items, comp);
+        for (size_type end = N; end-- > 1;){
+            size_type t = order[0];
+            order[0] = order[end];
+            order[end] = t;
+            sift_down(order, 0, end, items, comp);
+        }
+        for (size_type i = 1; i < N; ++i){
+            if (!comp(items[order[i - 1]].first, items[order[i]].first))
+                throw std::invalid_argument("frozen_avl_map: duplicate key");
+        }
+        std::array<size_type, N> from{};
+        size_type slot = first_slot();
+        for (size_type i = 0; i < N; ++i){
+            from[slot - 1] = order[i];
+            slot = next_slot(slot);
+        }
+        return from;
+    }
+
+    static constexpr void sift_down(std::array<size_type, N>& heap, size_type i, size_type n,
+                                    const std::pair<key, T> (&items)[N], const key_compare& comp)
+    {
+        for (;;){
+            size_type c = 2 * i + 1;
+            if (c >= n) return;
+            if (c + 1 < n && comp(items[heap[c]].first, items[heap[c + 1]].first)) ++c;
+            if (!comp(items[heap[i]].first, items[heap[c]].first)) return;
+            size_type t = heap[i];
+            heap[i] = heap[c];
+            heap[c] = t;
+            i = c;
+        }
+    }
+};
+
+// Deduces the size from a braced list of pairs; the key and mapped types
+// are given explicitly.
+template <typename key, typename T, typename compare = std::less<key>, size_t N>
+constexpr frozen_avl_map<key, T, N, compare>
+make_frozen_avl_map(const std::pair<key, T> (&items)[N], const compare& comp = compare())
+{
+    return frozen_avl_map<key, T, N, compare>(items, comp);
+}
+
+#endif // AVL_MAP_FROZEN_H
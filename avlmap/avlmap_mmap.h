@@ -0,0 +1,200 @@
+#ifndef AVL_MAP_MMAP_H
+#define AVL_MAP_MMAP_H
+
+#include "avlmap.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <string>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Read-only view of a file written by avl_tree::save(). The file is mapped
+// into memory and queried in place: records are already sorted, so lookups
+// are binary searches over the mapping and opening costs only the page
+// faults of the records actually touched. POSIX only.
+template <typename key,
+typename T,
+typename compare = std::less<key> >
+class mapped_avl_map{
+
+public:
+    typedef key                                          key_type;
+    typedef T                                            mapped_type;
+    typedef avl_map_record<key, T>                       value_type;
+    typedef compare                                      key_compare;
+    typedef const value_type&                            const_reference;
+    typedef const value_type*                            const_iterator;
+    typedef const value_type*                            iterator;
+    typedef size_t                                       size_type;
+
+private:
+    struct record_less
+    {
+        compare comp;
+        record_less(const compare& c) : comp(c) {}
+        bool operator() (const value_type& x, const key_type& k) const
+        {
+            return comp(x.first, k);
+        }
+        bool operator() (const key_type& k, const value_type& x) const
+        {
+            return comp(k, x.first);
+        }
+    };
+
+    void* map_;
+    size_t map_size_;
+    const value_type* first_;
+    size_type count_;
+    key_compare key_compare_;
+
+    mapped_avl_map(const mapped_avl_map&);
+    mapped_avl_map& operator= (const mapped_avl_map&);
+
+public:
+    explicit mapped_avl_map(const key_compare& comp = key_compare())
+    :map_(0), map_size_(0), first_(0), count_(0), key_compare_(comp)
+    {
+    }
+
+    explicit mapped_avl_map(const std::string& path,
+                            const key_compare& comp = key_compare())
+    :map_(0), map_size_(0), first_(0), count_(0), key_compare_(comp)
+    {
+        open(path);
+    }
+
+    ~mapped_avl_map(){
+        close();
+    }
+
+    void open(const std::string& path){
+        close();
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) throw_errno("open");
+        struct stat st;
+        if (::fstat(fd, &st) != 0){
+            ::close(fd);
+            throw_errno("fstat");
+        }
+        size_t file_size = (size_t)st.st_size;
+        if (file_size < sizeof(avl_map_file_header)){
+            ::close(fd);
+            throw std::runtime_error("avl map file: truncated header");
+        }
+        void* m = ::mmap(0, file_size, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (m == MAP_FAILED) throw_errno("mmap");
+
+        const avl_map_file_header* h = static_cast<const avl_map_file_header*>(m);
+        try {
+            h->validate(sizeof(value_type), sizeof(key_type), sizeof(mapped_type),
+                        offsetof(value_type, second));
+            if (h->header_size > file_size || h->record_size == 0
+                || (file_size - h->header_size) / h->record_size < h->count)
+                throw std::runtime_error("avl map file: truncated records");
+            // the mapping is page aligned, so this aligns every record
+            if (h->header_size % record_alignment() != 0)
+                throw std::runtime_error("avl map file: misaligned records");
+        } catch (...) {
+            ::munmap(m, file_size);
+            throw;
+        }
+        map_ = m;
+        map_size_ = file_size;
+        count_ = (size_type)h->count;
+        first_ = reinterpret_cast<const value_type*>(static_cast<const char*>(m)
+                                                     + h->header_size);
+    }
+
+    void close(){
+        if (map_ != 0) ::munmap(map_, map_size_);
+        map_ = 0;
+        map_size_ = 0;
+        first_ = 0;
+        count_ = 0;
+    }
+
+    bool is_open() const NOEXCEPT
+    {
+        return map_ != 0;
+    }
+
+    const_iterator begin() const NOEXCEPT
+    {
+        return first_;
+    }
+
+    const_iterator end() const NOEXCEPT
+    {
+        return first_ + count_;
+    }
+
+    bool empty() const NOEXCEPT
+    {
+        return (count_ == 0);
+    }
+
+    size_type size() const NOEXCEPT
+    {
+        return count_;
+    }
+
+    const_iterator find(const key_type& k) const
+    {
+        const_iterator j = lower_bound(k);
+        return (j == end() || key_compare_(k, j->first)) ? end() : j;
+    }
+
+    const_iterator lower_bound(const key_type& k) const
+    {
+        return std::lower_bound(begin(), end(), k, record_less(key_compare_));
+    }
+
+    const_iterator upper_bound(const key_type& k) const
+    {
+        return std::upper_bound(begin(), end(), k, record_less(key_compare_));
+    }
+
+    std::pair<const_iterator, const_iterator>
+    equal_range(const key_type& k) const
+    {
+        return std::pair<const_iterator, const_iterator>(lower_bound(k), upper_bound(k));
+    }
+
+    size_type count(const key_type& k) const
+    {
+        return find(k) == end() ? 0 : 1;
+    }
+
+    const mapped_type& at(const key_type& k) const
+    {
+        const_iterator res = find(k);
+        if (res == end()) throw std::out_of_range("key doesn't exist");
+        return res->second;
+    }
+
+    key_compare key_comp() const
+    {
+        return key_compare_;
+    }
+
+private:
+    static size_t record_alignment(){
+#if __cplusplus >= 201103L
+        return alignof(value_type);
+#else
+        return __alignof__(value_type);
+#endif
+    }
+
+    static void throw_errno(const char* what){
+        throw std::runtime_error(std::string("avl map file: ") + what + ": "
+                                 + std::strerror(errno));
+    }
+};
+
+#endif // AVL_MAP_MMAP_H
@@ -0,0 +1,241 @@
+#ifndef AVL_MAP_TRACE_H
+#define AVL_MAP_TRACE_H
+
+#if __cplusplus < 201103L
+# error "avlmap_trace.h requires C++11"
+#endif
+
+#include "avlmap.h"
+
+#include <string>
+#include <type_traits>
+
+// Workload traces: the sequence of lookups and mutations a program makes
+// against a map, recorded by traced_avl_map and replayed against other
+// configurations by bench/trace_replay.
+//
+// A trace is an avl_trace_header followed by one record per operation: the
+// op byte, then the key. Integral keys are stored as the zigzag varint of
+// the difference to the previous key, so clustered access costs one or two
+// bytes per key; string keys are a varint length followed by the bytes.
+// Mapped values are not recorded.
+
+enum avl_trace_op
+{
+    avl_trace_find = 1,
+    avl_trace_insert,
+    avl_trace_erase,
+    avl_trace_lower_bound,
+    avl_trace_upper_bound,
+    avl_trace_subscript      // operator[]
+};
+
+enum avl_trace_key_kind
+{
+    avl_trace_signed_key = 1,
+    avl_trace_unsigned_key,
+    avl_trace_string_key
+};
+
+struct avl_trace_header
+{
+    enum { current_version = 1 };
+
+    char magic[8];          // "AVLTRACE"
+    uint32_t version;
+    uint32_t key_kind;      // avl_trace_key_kind
+    uint32_t key_size;      // sizeof the key for integral keys
+    uint32_t reserved;
+
+    static const char* expected_magic() { return "AVLTRACE"; }
+};
+
+template <typename Key, typename Enable = void>
+struct avl_trace_codec;
+
+template <typename Key>
+struct avl_trace_codec<Key, typename std::enable_if<std::is_integral<Key>::value>::type>
+{
+    static const uint32_t kind = std::is_signed<Key>::value
+    ? avl_trace_signed_key : avl_trace_unsigned_key;
+
+    Key previous;
+    avl_trace_codec() : previous(0) {}
+
+    void encode(std::ostream& os, const Key& k){
+        uint64_t delta = (uint64_t)k - (uint64_t)previous;
+        previous = k;
+        write_varint(os, (delta << 1) ^ (uint64_t)((int64_t)delta >> 63));
+    }
+
+    bool decode(std::istream& is, Key& k){
+        uint64_t z;
+        if (!read_varint(is, z)) return false;
+        uint64_t delta = (z >> 1) ^ (~(z & 1) + 1);
+        k = previous = (Key)((uint64_t)previous + delta);
+        return true;
+    }
+
+    static void write_varint(std::ostream& os, uint64_t v){
+        char buf[10];
+        int n = 0;
+        while (v >= 0x80){
+            buf[n++] = (char)(v | 0x80);
+            v >>= 7;
+        }
+        buf[n++] = (char)v;
+        os.write(buf, n);
+    }
+
+    static bool read_varint(std::istream& is, uint64_t& v){
+        v = 0;
+        for (int shift = 0; shift < 64; shift += 7){
+            int c = is.get();
+            if (c == std::char_traits<char>::eof()) return false;
+            v |= (uint64_t)(c & 0x7f) << shift;
+            if ((c & 0x80) == 0) return true;
+        }
+        return false;
+    }
+};
+
+template <>
+struct avl_trace_codec<std::string>
+{
+    static const uint32_t kind = avl_trace_string_key;
+    typedef avl_trace_codec<uint64_t> varint;
+
+    void encode(std::ostream& os, const std::string& k){
+        varint::write_varint(os, k.size());
+        os.write(k.data(), (std::streamsize)k.size());
+    }
+
+    bool decode(std::istream& is, std::string& k){
+        uint64_t n;
+        if (!varint::read_varint(is, n)) return false;
+        k.resize((size_t)n);
+        return n == 0 || (bool)is.read(&k[0], (std::streamsize)n);
+    }
+};
+
+template <typename Key>
+class avl_trace_writer{
+public:
+    explicit avl_trace_writer(std::ostream& os) : os_(os)
+    {
+        avl_trace_header h;
+        std::memset(&h, 0, sizeof(h));
+        std::memcpy(h.magic, avl_trace_header::expected_magic(), sizeof(h.magic));
+        h.version = avl_trace_header::current_version;
+        h.key_kind = avl_trace_codec<Key>::kind;
+        h.key_size = sizeof(Key);
+        os_.write(reinterpret_cast<const char*>(&h), sizeof(h));
+    }
+
+    void record(avl_trace_op op, const Key& k){
+        os_.put((char)op);
+        codec_.encode(os_, k);
+    }
+
+private:
+    std::ostream& os_;
+    avl_trace_codec<Key> codec_;
+};
+
+// Reads the header on construction; throws std::runtime_error if the trace
+// was not recorded with keys of type Key.
+template <typename Key>
+class avl_trace_reader{
+public:
+    explicit avl_trace_reader(std::istream& is) : is_(is)
+    {
+        // integral keys may be read back into a wider type of the same
+        // signedness
+        avl_trace_header h = read_header(is_);
+        if (h.key_kind != avl_trace_codec<Key>::kind
+            || (h.key_kind != avl_trace_string_key && h.key_size > sizeof(Key)))
+            throw std::runtime_error("avl trace: key type mismatch");
+    }
+
+    bool next(avl_trace_op& op, Key& k){
+        int c = is_.get();
+        if (c == std::char_traits<char>::eof()) return false;
+        if (c < avl_trace_find || c > avl_trace_subscript)
+            throw std::runtime_error("avl trace: bad op");
+        op = (avl_trace_op)c;
+        if (!codec_.decode(is_, k)) throw std::runtime_error("avl trace: truncated record");
+        return true;
+    }
+
+    static avl_trace_header read_header(std::istream& is){
+        avl_trace_header h;
+        if (!is.read(reinterpret_cast<char*>(&h), sizeof(h))
+            || std::memcmp(h.magic, avl_trace_header::expected_magic(), sizeof(h.magic)) != 0)
+            throw std::runtime_error("avl trace: bad header");
+        if (h.version != avl_trace_header::current_version)
+            throw std::runtime_error("avl trace: unsupported version");
+        return h;
+    }
+
+private:
+    std::istream& is_;
+    avl_trace_codec<Key> codec_;
+};
+
+// Forwards to a map it does not own and records every call. Swap a map
+// reference for one of these for the capture window; not thread safe.
+template <typename Map>
+class traced_avl_map{
+public:
+    typedef typename Map::key_type                       key_type;
+    typedef typename Map::mapped_type                    mapped_type;
+    typedef typename Map::value_type                     value_type;
+    typedef typename Map::iterator                       iterator;
+    typedef typename Map::size_type                      size_type;
+
+    traced_avl_map(Map& m, std::ostream& os) : map_(m), writer_(os) {}
+
+    iterator find(const key_type& k){
+        writer_.record(avl_trace_find, k);
+        return map_.find(k);
+    }
+
+    iterator lower_bound(const key_type& k){
+        writer_.record(avl_trace_lower_bound, k);
+        return map_.lower_bound(k);
+    }
+
+    iterator upper_bound(const key_type& k){
+        writer_.record(avl_trace_upper_bound, k);
+        return map_.upper_bound(k);
+    }
+
+    std::pair<iterator, bool> insert(const value_type& val){
+        writer_.record(avl_trace_insert, val.first);
+        return map_.insert(val);
+    }
+
+    size_type erase(const key_type& k){
+        writer_.record(avl_trace_erase, k);
+        return map_.erase(k);
+    }
+
+    mapped_type& operator[](const key_type& k){
+        writer_.record(avl_trace_subscript, k);
+        return map_[k];
+    }
+
+    iterator end(){
+        return map_.end();
+    }
+
+    Map& map(){
+        return map_;
+    }
+
+private:
+    Map& map_;
+    avl_trace_writer<key_type> writer_;
+};
+
+#endif // AVL_MAP_TRACE_H
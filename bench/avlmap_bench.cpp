@@ -0,0 +1,684 @@
+//
+//  avlmap_bench.cpp
+//  avlmap
+//
+//  Benchmarks avl_tree against std::map, also with transparent comparators,
+//  cached key prefixes, a hash index and weak AVL balancing.
+//  Every combination of container, operation, key type, key distribution
+//  and size runs in a forked child so that its peak RSS is measured in
+//  isolation. The default sizes stop at 1e6 so that a full run fits in a
+//  few GB; pass --sizes 1e7,1e8 for the large ones, which need tens of GB
+//  with string keys.
+//
+//  usage: avlmap_bench [--sizes 1000,10000,...] [--ops insert,find_hit,...]
+//                      [--containers name,...] [--keys int,string,url]
+//                      [--dists sorted,random,zipf] [--format csv|json]
+//                      [--out file] [--no-fork]
+//
+
+#include "../avlmap/avlmap.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <new>
+#include <random>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// heap allocations made by the process, to report allocations per operation
+static uint64_t allocation_count = 0;
+
+// kept out of line so the compiler does not pair our malloc/free with
+// new/delete expressions in the code under test
+__attribute__((noinline)) void* operator new(size_t n)
+{
+    ++allocation_count;
+    if (void* p = std::malloc(n ? n : 1)) return p;
+    throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void operator delete(void* p) noexcept
+{
+    std::free(p);
+}
+
+__attribute__((noinline)) void operator delete(void* p, size_t) noexcept
+{
+    std::free(p);
+}
+
+namespace {
+
+enum operation {
+    op_insert, op_find_hit, op_find_miss, op_find_view, op_erase, op_upsert,
+    op_range_scan, op_bulk_scan, op_copy, op_clear, op_bulk, op_merge, op_sorted_probe, op_churn, op_count
+};
+
+// find_view looks keys up through std::string_view; maps without a
+// transparent comparator have to build a std::string per query.
+// sorted_probe is a merge join: lower_bound of a sorted batch of keys.
+// churn erases one element and inserts a new one per operation, at a
+// constant size. bulk_scan copies each range_scan query into key and value
+// arrays, with scan_cursor where the map has one.
+const char* const operation_names[op_count] = {
+    "insert", "find_hit", "find_miss", "find_view", "erase", "upsert",
+    "range_scan", "bulk_scan", "copy", "clear", "bulk", "merge", "sorted_probe", "churn"
+};
+
+enum distribution { dist_sorted, dist_random, dist_zipf, dist_count };
+
+const char* const distribution_names[dist_count] = { "sorted", "random", "zipf" };
+
+enum key_kind { key_int, key_string, key_url, key_count };
+
+// url keys share their scheme and then diverge in the host name
+const char* const key_names[key_count] = { "int", "string", "url" };
+
+// elements visited by one range_scan query
+const size_t scan_length = 100;
+// small sizes are repeated until about this many operations were timed
+const size_t min_timed_ops = 1000000;
+
+struct scenario
+{
+    operation op;
+    distribution dist;
+    size_t size;
+};
+
+struct result
+{
+    double seconds;
+    uint64_t ops;
+    uint64_t allocations;
+    long peak_rss_kb;
+    uint64_t sink;
+    bool ok;
+};
+
+typedef std::chrono::steady_clock bench_clock;
+
+// time and heap allocations of the measured region
+struct timer
+{
+    bench_clock::time_point t0, t1;
+    uint64_t a0, a1;
+    timer() : a0(0), a1(0) {}
+    void start() { a0 = allocation_count; t0 = bench_clock::now(); }
+    void stop() { t1 = bench_clock::now(); a1 = allocation_count; }
+    double seconds() const { return std::chrono::duration<double>(t1 - t0).count(); }
+};
+
+// keys are even numbers so that odd ones are guaranteed misses; both
+// string formats preserve the numeric order
+template <typename Key> Key make_key(uint64_t v, key_kind kind);
+
+template <> uint64_t make_key<uint64_t>(uint64_t v, key_kind)
+{
+    return v;
+}
+
+// long enough to defeat the small string optimization, like real keys
+template <> std::string make_key<std::string>(uint64_t v, key_kind kind)
+{
+    char buf[64];
+    if (kind == key_url)
+        std::snprintf(buf, sizeof(buf), "https://%08llx.example.com/page/%llx",
+                      (unsigned long long)(v >> 4), (unsigned long long)(v & 15));
+    else
+        std::snprintf(buf, sizeof(buf), "user/%016llu", (unsigned long long)v);
+    return buf;
+}
+
+// Zipfian ranks in [0, n) with skew theta (Gray et al., SIGMOD '94).
+class zipf_generator
+{
+public:
+    zipf_generator(size_t n, double theta, uint64_t seed)
+    :n_(n), theta_(theta), rng_(seed), uniform_(0.0, 1.0)
+    {
+        double zeta2 = 1.0 + std::pow(0.5, theta);
+        zetan_ = 0;
+        for (size_t i = 1; i <= n; ++i) zetan_ += 1.0 / std::pow((double)i, theta);
+        alpha_ = 1.0 / (1.0 - theta);
+        eta_ = (1.0 - std::pow(2.0 / (double)n, 1.0 - theta)) / (1.0 - zeta2 / zetan_);
+    }
+
+    size_t operator()()
+    {
+        double u = uniform_(rng_);
+        double uz = u * zetan_;
+        if (uz < 1.0) return 0;
+        if (uz < 1.0 + std::pow(0.5, theta_)) return std::min<size_t>(1, n_ - 1);
+        size_t r = (size_t)((double)n_ * std::pow(eta_ * u - eta_ + 1.0, alpha_));
+        return std::min(r, n_ - 1);
+    }
+
+private:
+    size_t n_;
+    double theta_, zetan_, alpha_, eta_;
+    std::mt19937_64 rng_;
+    std::uniform_real_distribution<double> uniform_;
+};
+
+// Positions into the sorted key array, in the order operations use them.
+std::vector<size_t> make_order(distribution dist, size_t n, uint64_t seed)
+{
+    std::vector<size_t> order(n);
+    for (size_t i = 0; i < n; ++i) order[i] = i;
+    std::mt19937_64 rng(seed);
+    if (dist == dist_random){
+        std::shuffle(order.begin(), order.end(), rng);
+    } else if (dist == dist_zipf){
+        // hot ranks are scattered over the key space, not clustered
+        std::vector<size_t> scatter(order);
+        std::shuffle(scatter.begin(), scatter.end(), rng);
+        zipf_generator zipf(n, 0.99, seed + 1);
+        for (size_t i = 0; i < n; ++i) order[i] = scatter[zipf()];
+    }
+    return order;
+}
+
+template <typename Key>
+struct view_of { typedef Key type; };
+
+template <>
+struct view_of<std::string> { typedef std::string_view type; };
+
+template <typename Map, typename View>
+typename Map::iterator find_view(Map& m, const View& v)
+{
+    if constexpr (std::is_same<typename Map::key_type, View>::value
+                  || avl_is_transparent<typename Map::key_compare>::value)
+        return m.find(v);
+    else
+        return m.find(typename Map::key_type(v));
+}
+
+template <typename Map, typename = void>
+struct has_lower_bound_sorted : std::false_type {};
+
+template <typename Map>
+struct has_lower_bound_sorted<Map, std::void_t<decltype(std::declval<Map&>().lower_bound_sorted(
+    std::declval<typename Map::key_type*>(), std::declval<typename Map::key_type*>(),
+    std::declval<typename Map::iterator*>()))> > : std::true_type {};
+
+// finger search where the map has it, one lower_bound per key otherwise
+template <typename Map, typename Key>
+void sorted_lower_bounds(Map& m, const std::vector<Key>& probes,
+                       std::vector<typename Map::iterator>& out)
+{
+    if constexpr (has_lower_bound_sorted<Map>::value)
+        m.lower_bound_sorted(probes.begin(), probes.end(), out.begin());
+    else
+        for (size_t i = 0; i < probes.size(); ++i) out[i] = m.lower_bound(probes[i]);
+}
+
+template <typename Map, typename = void>
+struct has_scan_cursor : std::false_type {};
+
+template <typename Map>
+struct has_scan_cursor<Map, std::void_t<typename Map::scan_cursor> > : std::true_type {};
+
+// copies the elements from lower_bound(lo) on into the columns, at most
+// the capacity of keys, and returns how many
+template <typename Map, typename Key>
+size_t scan_columns(const Map& m, const Key& lo, std::vector<Key>& keys,
+                    std::vector<uint64_t>& values)
+{
+    if constexpr (has_scan_cursor<Map>::value){
+        // the last key is the upper end; the count bounds the scan
+        typename Map::scan_cursor c = m.scan_from(lo, m.peek_max().first);
+        return c.next(keys.data(), values.data(), keys.size());
+    } else {
+        size_t n = 0;
+        for (typename Map::const_iterator it = m.lower_bound(lo); n < keys.size() && it != m.end();
+             ++it, ++n){
+            keys[n] = it->first;
+            values[n] = it->second;
+        }
+        return n;
+    }
+}
+
+long peak_rss_kb()
+{
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_maxrss;
+}
+
+template <typename Map, typename Key>
+void fill(Map& m, const std::vector<Key>& keys)
+{
+    for (size_t i = 0; i < keys.size(); ++i)
+        m.insert(typename Map::value_type(keys[i], i));
+}
+
+// Runs one repetition of sc.op and returns what was timed.
+template <typename Map, typename Key>
+timer run_once(const scenario& sc, const std::vector<Key>& keys,
+                const std::vector<Key>& misses, const std::vector<size_t>& order,
+                uint64_t& ops, uint64_t& sink)
+{
+    typedef typename Map::value_type value_type;
+    size_t n = keys.size();
+    timer tm;
+    switch (sc.op){
+        case op_insert: {
+            Map m;
+            tm.start();
+            for (size_t i = 0; i < n; ++i) m.insert(value_type(keys[order[i]], i));
+            tm.stop();
+            ops += n;
+            sink += m.size();
+            break;
+        }
+        case op_find_hit: {
+            Map m;
+            fill(m, keys);
+            tm.start();
+            for (size_t i = 0; i < n; ++i) sink += m.find(keys[order[i]])->second;
+            tm.stop();
+            ops += n;
+            break;
+        }
+        case op_find_miss: {
+            Map m;
+            fill(m, keys);
+            tm.start();
+            for (size_t i = 0; i < n; ++i) sink += (m.find(misses[i]) == m.end());
+            tm.stop();
+            ops += n;
+            break;
+        }
+        case op_find_view: {
+            Map m;
+            fill(m, keys);
+            std::vector<typename view_of<Key>::type> views(keys.begin(), keys.end());
+            tm.start();
+            for (size_t i = 0; i < n; ++i) sink += find_view(m, views[order[i]])->second;
+            tm.stop();
+            ops += n;
+            break;
+        }
+        case op_erase: {
+            Map m;
+            fill(m, keys);
+            tm.start();
+            for (size_t i = 0; i < n; ++i) sink += m.erase(keys[order[i]]);
+            tm.stop();
+            ops += n;
+            break;
+        }
+        case op_upsert: {
+            Map m;
+            tm.start();
+            for (size_t i = 0; i < n; ++i) m[keys[order[i]]] += 1;
+            tm.stop();
+            ops += n;
+            sink += m.size();
+            break;
+        }
+        case op_range_scan: {
+            Map m;
+            fill(m, keys);
+            size_t queries = std::max<size_t>(1, n / scan_length);
+            uint64_t visited = 0;
+            tm.start();
+            for (size_t q = 0; q < queries; ++q){
+                typename Map::iterator it = m.lower_bound(keys[order[q]]);
+                for (size_t j = 0; j < scan_length && it != m.end(); ++j, ++it){
+                    sink += it->second;
+                    ++visited;
+                }
+            }
+            tm.stop();
+            ops += visited;
+            break;
+        }
+        case op_bulk_scan: {
+            Map m;
+            fill(m, keys);
+            size_t queries = std::max<size_t>(1, n / scan_length);
+            std::vector<Key> key_column(scan_length);
+            std::vector<uint64_t> value_column(scan_length);
+            uint64_t visited = 0;
+            tm.start();
+            for (size_t q = 0; q < queries; ++q){
+                size_t got = scan_columns(m, keys[order[q]], key_column, value_column);
+                for (size_t j = 0; j < got; ++j) sink += value_column[j];
+                visited += got;
+            }
+            tm.stop();
+            ops += visited;
+            break;
+        }
+        case op_copy: {
+            Map m;
+            fill(m, keys);
+            tm.start();
+            {
+                Map c(m);
+                sink += c.size();
+            }
+            tm.stop();
+            ops += n;
+            break;
+        }
+        case op_clear: {
+            Map m;
+            fill(m, keys);
+            tm.start();
+            m.clear();
+            tm.stop();
+            ops += n;
+            sink += m.size();
+            break;
+        }
+        case op_bulk: {
+            std::vector<std::pair<Key, uint64_t> > sorted(n);
+            for (size_t i = 0; i < n; ++i) sorted[i] = std::make_pair(keys[i], (uint64_t)i);
+            tm.start();
+            {
+                Map m(sorted.begin(), sorted.end());
+                sink += m.size();
+            }
+            tm.stop();
+            ops += n;
+            break;
+        }
+        case op_merge: {
+            // every other key moves from src into m by relinking nodes
+            Map m, src;
+            for (size_t i = 0; i < n; ++i){
+                if (i % 2) src.insert(value_type(keys[order[i]], i));
+                else m.insert(value_type(keys[order[i]], i));
+            }
+            tm.start();
+            m.merge(src);
+            tm.stop();
+            ops += n / 2;
+            sink += m.size();
+            break;
+        }
+        case op_sorted_probe: {
+            Map m;
+            fill(m, keys);
+            std::vector<Key> probes(misses);
+            std::sort(probes.begin(), probes.end());
+            std::vector<typename Map::iterator> out(n);
+            tm.start();
+            sorted_lower_bounds(m, probes, out);
+            tm.stop();
+            ops += n;
+            sink += (out[n / 2] == m.end());
+            break;
+        }
+        case op_churn: {
+            Map m;
+            fill(m, keys);
+            tm.start();
+            for (size_t i = 0; i < n; ++i){
+                sink += m.erase(keys[order[i]]);
+                m.insert(value_type(misses[i], i));
+            }
+            tm.stop();
+            ops += n;
+            sink += m.size();
+            break;
+        }
+        default:
+            break;
+    }
+    return tm;
+}
+
+template <typename Map, typename Key, key_kind Kind>
+result run(const scenario& sc)
+{
+    size_t n = sc.size;
+    std::vector<Key> keys(n), misses(n);
+    std::vector<size_t> order = make_order(sc.dist, n, 42);
+    for (size_t i = 0; i < n; ++i){
+        keys[i] = make_key<Key>(2 * i, Kind);
+        misses[i] = make_key<Key>(2 * order[i] + 1, Kind);
+    }
+    result r;
+    r.seconds = 0;
+    r.ops = 0;
+    r.allocations = 0;
+    r.sink = 0;
+    size_t reps = std::max<size_t>(1, min_timed_ops / std::max<size_t>(1, n));
+    for (size_t rep = 0; rep < reps; ++rep){
+        timer tm = run_once<Map, Key>(sc, keys, misses, order, r.ops, r.sink);
+        r.seconds += tm.seconds();
+        r.allocations += tm.a1 - tm.a0;
+    }
+    r.peak_rss_kb = peak_rss_kb();
+    r.ok = true;
+    return r;
+}
+
+struct container_entry
+{
+    const char* name;
+    result (*run[key_count])(const scenario&);
+};
+
+template <typename Key, typename Normalizer>
+using prefix_tree = avl_tree<Key, uint64_t, std::less<Key>,
+std::allocator<std::pair<const Key, uint64_t> >, avl_prefix_traits<Normalizer> >;
+
+template <typename Key>
+using hash_tree = avl_tree<Key, uint64_t, std::less<Key>,
+std::allocator<std::pair<const Key, uint64_t> >, avl_hash_traits<std::hash<Key> > >;
+
+template <typename Key>
+using wavl_tree = avl_tree<Key, uint64_t, std::less<Key>,
+std::allocator<std::pair<const Key, uint64_t> >, avl_balance_traits<avl_weak_balance> >;
+
+template <typename Key>
+using digest_tree = avl_tree<Key, uint64_t, std::less<Key>,
+std::allocator<std::pair<const Key, uint64_t> >, avl_digest_traits<avl_std_digest> >;
+
+// one run per key kind, in key_kind order
+const container_entry containers[] = {
+    { "avl_tree", { &run<avl_tree<uint64_t, uint64_t>, uint64_t, key_int>,
+        &run<avl_tree<std::string, uint64_t>, std::string, key_string>,
+        &run<avl_tree<std::string, uint64_t>, std::string, key_url> } },
+    { "std::map", { &run<std::map<uint64_t, uint64_t>, uint64_t, key_int>,
+        &run<std::map<std::string, uint64_t>, std::string, key_string>,
+        &run<std::map<std::string, uint64_t>, std::string, key_url> } },
+    { "avl_tree<less<>>", { &run<avl_tree<uint64_t, uint64_t, std::less<> >, uint64_t, key_int>,
+        &run<avl_tree<std::string, uint64_t, std::less<> >, std::string, key_string>,
+        &run<avl_tree<std::string, uint64_t, std::less<> >, std::string, key_url> } },
+    { "std::map<less<>>", { &run<std::map<uint64_t, uint64_t, std::less<> >, uint64_t, key_int>,
+        &run<std::map<std::string, uint64_t, std::less<> >, std::string, key_string>,
+        &run<std::map<std::string, uint64_t, std::less<> >, std::string, key_url> } },
+    // url keys would tie on "https://" at every level without the skip
+    { "avl_tree<prefix>", { &run<prefix_tree<uint64_t, avl_integer_prefix>, uint64_t, key_int>,
+        &run<prefix_tree<std::string, avl_string_prefix<> >, std::string, key_string>,
+        &run<prefix_tree<std::string, avl_string_prefix<8> >, std::string, key_url> } },
+    // peak_rss_kb against avl_tree shows the memory the index costs
+    { "avl_tree<hash>", { &run<hash_tree<uint64_t>, uint64_t, key_int>,
+        &run<hash_tree<std::string>, std::string, key_string>,
+        &run<hash_tree<std::string>, std::string, key_url> } },
+    // compare on erase and churn
+    { "avl_tree<wavl>", { &run<wavl_tree<uint64_t>, uint64_t, key_int>,
+        &run<wavl_tree<std::string>, std::string, key_string>,
+        &run<wavl_tree<std::string>, std::string, key_url> } },
+    // what keeping the subtree digests for diff() costs writes
+    { "avl_tree<digest>", { &run<digest_tree<uint64_t>, uint64_t, key_int>,
+        &run<digest_tree<std::string>, std::string, key_string>,
+        &run<digest_tree<std::string>, std::string, key_url> } },
+};
+
+const size_t container_count = sizeof(containers) / sizeof(containers[0]);
+
+result run_isolated(result (*fn)(const scenario&), const scenario& sc, bool isolate)
+{
+    if (!isolate) return fn(sc);
+    result r;
+    std::memset(&r, 0, sizeof(r));
+    int fds[2];
+    if (pipe(fds) != 0) return r;
+    pid_t pid = fork();
+    if (pid == 0){
+        close(fds[0]);
+        result child = fn(sc);
+        ssize_t w = write(fds[1], &child, sizeof(child));
+        _exit(w == (ssize_t)sizeof(child) ? 0 : 1);
+    }
+    close(fds[1]);
+    if (pid > 0){
+        if (read(fds[0], &r, sizeof(r)) != (ssize_t)sizeof(r)) r.ok = false;
+        int status;
+        waitpid(pid, &status, 0);
+    }
+    close(fds[0]);
+    return r;
+}
+
+std::vector<std::string> split(const std::string& s)
+{
+    std::vector<std::string> out;
+    size_t start = 0;
+    while (start <= s.size()){
+        size_t comma = s.find(',', start);
+        if (comma == std::string::npos) comma = s.size();
+        if (comma > start) out.push_back(s.substr(start, comma - start));
+        start = comma + 1;
+    }
+    return out;
+}
+
+template <size_t N>
+std::vector<size_t> select(const char* const (&names)[N], const std::string& arg)
+{
+    std::vector<size_t> out;
+    std::vector<std::string> wanted = split(arg);
+    for (size_t w = 0; w < wanted.size(); ++w){
+        size_t i = 0;
+        while (i < N && wanted[w] != names[i]) ++i;
+        if (i == N){
+            std::fprintf(stderr, "unknown name: %s\n", wanted[w].c_str());
+            std::exit(2);
+        }
+        out.push_back(i);
+    }
+    return out;
+}
+
+}
+
+int main(int argc, const char * argv[])
+{
+    std::string sizes_arg = "1000,10000,100000,1000000";
+    std::string ops_arg = "insert,find_hit,find_miss,find_view,erase,upsert,range_scan,bulk_scan,copy,clear,bulk,merge,"
+    "sorted_probe";
+    std::string containers_arg;
+    std::string keys_arg = "int,string,url";
+    std::string dists_arg = "sorted,random,zipf";
+    std::string format = "csv";
+    std::string out_path;
+    bool isolate = true;
+    for (int i = 1; i < argc; ++i){
+        std::string a = argv[i];
+        std::string v = (i + 1 < argc) ? argv[i + 1] : "";
+        if (a == "--sizes") sizes_arg = v, ++i;
+        else if (a == "--ops") ops_arg = v, ++i;
+        else if (a == "--containers") containers_arg = v, ++i;
+        else if (a == "--keys") keys_arg = v, ++i;
+        else if (a == "--dists") dists_arg = v, ++i;
+        else if (a == "--format") format = v, ++i;
+        else if (a == "--out") out_path = v, ++i;
+        else if (a == "--no-fork") isolate = false;
+        else {
+            std::fprintf(stderr, "usage: %s [--sizes n,...] [--ops op,...] "
+                         "[--containers name,...] [--keys int,string,url] "
+                         "[--dists sorted,random,zipf] [--format csv|json] "
+                         "[--out file] [--no-fork]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    std::vector<size_t> sizes;
+    std::vector<std::string> size_list = split(sizes_arg);
+    for (size_t i = 0; i < size_list.size(); ++i)
+        sizes.push_back((size_t)std::strtod(size_list[i].c_str(), 0));
+    std::vector<size_t> ops = select(operation_names, ops_arg);
+    std::vector<size_t> keys = select(key_names, keys_arg);
+    std::vector<size_t> dists = select(distribution_names, dists_arg);
+    const char* container_names[container_count];
+    for (size_t i = 0; i < container_count; ++i) container_names[i] = containers[i].name;
+    std::vector<size_t> chosen;
+    std::vector<std::string> wanted = containers_arg.empty()
+    ? std::vector<std::string>(container_names, container_names + container_count)
+    : split(containers_arg);
+    for (size_t w = 0; w < wanted.size(); ++w){
+        size_t i = 0;
+        while (i < container_count && wanted[w] != container_names[i]) ++i;
+        if (i == container_count){
+            std::fprintf(stderr, "unknown container: %s\n", wanted[w].c_str());
+            return 2;
+        }
+        chosen.push_back(i);
+    }
+
+    FILE* out = out_path.empty() ? stdout : std::fopen(out_path.c_str(), "w");
+    if (out == 0){
+        std::perror(out_path.c_str());
+        return 1;
+    }
+    bool json = (format == "json");
+    if (json) std::fprintf(out, "[\n");
+    else std::fprintf(out, "container,op,key,dist,size,ops,seconds,ns_per_op,allocs_per_op,peak_rss_kb\n");
+    bool first = true;
+    for (size_t o = 0; o < ops.size(); ++o)
+    for (size_t k = 0; k < keys.size(); ++k)
+    for (size_t d = 0; d < dists.size(); ++d)
+    for (size_t s = 0; s < sizes.size(); ++s)
+    for (size_t c = 0; c < chosen.size(); ++c){
+        scenario sc;
+        sc.op = (operation)ops[o];
+        sc.dist = (distribution)dists[d];
+        sc.size = sizes[s];
+        const container_entry& ce = containers[chosen[c]];
+        result r = run_isolated(ce.run[keys[k]], sc, isolate);
+        double ns = r.ops ? r.seconds * 1e9 / (double)r.ops : 0;
+        double allocs = r.ops ? (double)r.allocations / (double)r.ops : 0;
+        if (json){
+            std::fprintf(out, "%s  {\"container\": \"%s\", \"op\": \"%s\", \"key\": \"%s\", "
+                         "\"dist\": \"%s\", \"size\": %zu, \"ok\": %s, \"ops\": %llu, "
+                         "\"seconds\": %.6f, \"ns_per_op\": %.2f, \"allocs_per_op\": %.3f, "
+                         "\"peak_rss_kb\": %ld}",
+                         first ? "" : ",\n", ce.name, operation_names[sc.op], key_names[keys[k]],
+                         distribution_names[sc.dist], sc.size, r.ok ? "true" : "false",
+                         (unsigned long long)r.ops, r.seconds, ns, allocs, r.peak_rss_kb);
+        } else if (r.ok){
+            std::fprintf(out, "%s,%s,%s,%s,%zu,%llu,%.6f,%.2f,%.3f,%ld\n", ce.name,
+                         operation_names[sc.op], key_names[keys[k]],
+                         distribution_names[sc.dist], sc.size,
+                         (unsigned long long)r.ops, r.seconds, ns, allocs, r.peak_rss_kb);
+        } else {
+            std::fprintf(out, "%s,%s,%s,%s,%zu,failed,,,,\n", ce.name,
+                         operation_names[sc.op], key_names[keys[k]],
+                         distribution_names[sc.dist], sc.size);
+        }
+        std::fflush(out);
+        first = false;
+    }
+    if (json) std::fprintf(out, "\n]\n");
+    if (out != stdout) std::fclose(out);
+    return 0;
+}
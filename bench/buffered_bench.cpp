@@ -0,0 +1,126 @@
+//
+//  buffered_bench.cpp
+//  avlmap
+//
+//  Write-heavy and mixed workloads against buffered_avl_map at several
+//  buffer sizes, avl_tree and std::map. Each run preloads the map, then
+//  times a stream of operations on random keys: upserts and erases in a
+//  3:1 ratio, interleaved with lookups at the given read share.
+//
+//  usage: buffered_bench [--sizes 1000,100000,...] [--ops n]
+//                        [--reads 0,10,50,...] [--buffers 64,256,...]
+//
+
+#include "../avlmap/avlmap_buffered.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace {
+
+typedef std::chrono::steady_clock bench_clock;
+
+// keeps the lookups from being optimized away
+volatile uint64_t sink;
+
+template <typename Map>
+struct plain_map
+{
+    Map m;
+    explicit plain_map(size_t) {}
+    void assign(uint64_t k, uint64_t v) { m[k] = v; }
+    void erase(uint64_t k) { m.erase(k); }
+    bool find(uint64_t k) const { return m.find(k) != m.end(); }
+    void flush() {}
+};
+
+struct buffered_map
+{
+    buffered_avl_map<uint64_t, uint64_t> m;
+    explicit buffered_map(size_t buffer) : m(buffer) {}
+    void assign(uint64_t k, uint64_t v) { m.assign(k, v); }
+    void erase(uint64_t k) { m.erase(k); }
+    bool find(uint64_t k) const { return m.find(k) != 0; }
+    void flush() { m.flush(); }
+};
+
+// the final flush is timed, so buffered writes are paid for in full
+template <typename Map>
+void run(const std::string& config, size_t n, size_t ops, unsigned reads, size_t buffer)
+{
+    std::mt19937_64 rng(42);
+    uint64_t range = 2 * n;
+    Map m(buffer);
+    for (size_t i = 0; i < n; ++i) m.assign(rng() % range, i);
+    m.flush();
+    std::vector<uint64_t> keys(ops);
+    std::vector<unsigned char> kinds(ops);
+    for (size_t i = 0; i < ops; ++i){
+        keys[i] = rng() % range;
+        unsigned r = (unsigned)(rng() % 100);
+        kinds[i] = r < reads ? 0 : (r % 4 == 0 ? 2 : 1);
+    }
+    bench_clock::time_point t0 = bench_clock::now();
+    for (size_t i = 0; i < ops; ++i){
+        switch (kinds[i]){
+            case 0: sink += m.find(keys[i]); break;
+            case 1: m.assign(keys[i], i); break;
+            default: m.erase(keys[i]);
+        }
+    }
+    m.flush();
+    double s = std::chrono::duration<double>(bench_clock::now() - t0).count();
+    std::printf("%s,%zu,%u,%.2f\n", config.c_str(), n, reads, (double)ops / s / 1e6);
+}
+
+std::vector<size_t> parse_sizes(const std::string& s)
+{
+    std::vector<size_t> v;
+    size_t pos = 0;
+    while (pos < s.size()){
+        size_t comma = s.find(',', pos);
+        if (comma == std::string::npos) comma = s.size();
+        v.push_back((size_t)std::strtod(s.substr(pos, comma - pos).c_str(), 0));
+        pos = comma + 1;
+    }
+    return v;
+}
+
+}
+
+int main(int argc, const char * argv[])
+{
+    std::vector<size_t> sizes = parse_sizes("1e4,1e6");
+    std::vector<size_t> reads = parse_sizes("0,10,50");
+    std::vector<size_t> buffers = parse_sizes("64,256,1024,4096");
+    size_t ops = 2000000;
+    for (int i = 1; i < argc; ++i){
+        std::string a = argv[i];
+        if (i + 1 < argc && a == "--sizes") sizes = parse_sizes(argv[++i]);
+        else if (i + 1 < argc && a == "--ops") ops = (size_t)std::strtod(argv[++i], 0);
+        else if (i + 1 < argc && a == "--reads") reads = parse_sizes(argv[++i]);
+        else if (i + 1 < argc && a == "--buffers") buffers = parse_sizes(argv[++i]);
+        else {
+            std::fprintf(stderr, "usage: %s [--sizes n,...] [--ops n] [--reads percent,...]"
+                         " [--buffers n,...]\n", argv[0]);
+            return 2;
+        }
+    }
+    std::printf("config,size,read_percent,mops_per_sec\n");
+    for (size_t i = 0; i < sizes.size(); ++i){
+        for (size_t j = 0; j < reads.size(); ++j){
+            unsigned r = (unsigned)std::min<size_t>(100, reads[j]);
+            run<plain_map<avl_tree<uint64_t, uint64_t> > >("avl_tree", sizes[i], ops, r, 0);
+            for (size_t b = 0; b < buffers.size(); ++b)
+                run<buffered_map>("buffered(" + std::to_string(buffers[b]) + ")", sizes[i], ops, r,
+                                  buffers[b]);
+            run<plain_map<std::map<uint64_t, uint64_t> > >("std::map", sizes[i], ops, r, 0);
+        }
+    }
+    return 0;
+}
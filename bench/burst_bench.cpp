@@ -0,0 +1,141 @@
+//
+//  burst_bench.cpp
+//  avlmap
+//
+//  Insert latency during write bursts: eager against relaxed balancing.
+//  Each configuration is preloaded, then takes bursts of inserts separated
+//  by idle gaps, with every insert timed. The idle configuration settles
+//  nothing during a burst and calls rebalance_some() in the gaps, as a
+//  background thread would; the others settle as they go. Lookup cost is
+//  measured right after the last burst, before any idle rebalancing.
+//
+//  usage: burst_bench [--preload n] [--bursts n] [--burst n] [--sorted]
+//
+
+#include "../avlmap/avlmap.h"
+#include "latency_histogram.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace {
+
+typedef std::chrono::steady_clock bench_clock;
+
+// keeps the timed lookups from being optimized away
+volatile uint64_t sink;
+
+struct burst_options
+{
+    size_t preload;
+    size_t bursts;
+    size_t burst;
+    bool sorted;   // ascending keys within a burst, as in an ingest by time
+};
+
+struct eager_tree : avl_tree<uint64_t, uint64_t>
+{
+    void idle() {}
+    size_t height() const { return shape_report().height; }
+};
+
+// settles a couple of nodes per insert
+struct relaxed_tree : avl_tree<uint64_t, uint64_t>
+{
+    relaxed_tree() { relax_balancing(); }
+    void idle() {}
+    size_t height() const { return shape_report().height; }
+};
+
+// defers everything up to the cap and settles in the gaps between bursts
+struct idle_tree : avl_tree<uint64_t, uint64_t>
+{
+    idle_tree() { relax_balancing(0, 1024); }
+    void idle() { rebalance_some(rebalance_pending()); }
+    size_t height() const { return shape_report().height; }
+};
+
+struct std_map : std::map<uint64_t, uint64_t>
+{
+    void idle() {}
+    size_t height() const { return 0; }
+};
+
+std::vector<uint64_t> make_keys(const burst_options& o)
+{
+    std::mt19937_64 rng(42);
+    std::vector<uint64_t> keys(o.preload + o.bursts * o.burst);
+    for (size_t i = 0; i < o.preload; ++i) keys[i] = rng();
+    uint64_t next = 0;
+    for (size_t i = o.preload; i < keys.size(); ++i)
+        keys[i] = o.sorted ? (next += 1 + rng() % 1024) : rng();
+    return keys;
+}
+
+template <typename Map>
+void run(const char* config, const burst_options& o, const std::vector<uint64_t>& keys)
+{
+    Map m;
+    for (size_t i = 0; i < o.preload; ++i) m.insert(std::make_pair(keys[i], (uint64_t)i));
+    latency_histogram h;
+    size_t at = o.preload;
+    double busy = 0;
+    for (size_t b = 0; b < o.bursts; ++b){
+        if (b > 0) m.idle();
+        bench_clock::time_point start = bench_clock::now();
+        for (size_t i = 0; i < o.burst; ++i, ++at){
+            bench_clock::time_point t0 = bench_clock::now();
+            m.insert(std::make_pair(keys[at], (uint64_t)at));
+            bench_clock::time_point t1 = bench_clock::now();
+            h.add((uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0).count());
+        }
+        busy += std::chrono::duration<double>(bench_clock::now() - start).count();
+    }
+    size_t height = m.height();
+    std::mt19937_64 rng(7);
+    size_t probes = 1000000;
+    bench_clock::time_point t0 = bench_clock::now();
+    for (size_t i = 0; i < probes; ++i) sink += m.find(keys[rng() % keys.size()])->second;
+    double find_ns = std::chrono::duration<double, std::nano>(bench_clock::now() - t0).count()
+    / (double)probes;
+    std::printf("%s,%zu,%.0f,%llu,%llu,%llu,%llu,%zu,%.1f\n", config, keys.size(),
+                (double)(o.bursts * o.burst) / busy,
+                (unsigned long long)h.percentile(50), (unsigned long long)h.percentile(99),
+                (unsigned long long)h.percentile(99.9), (unsigned long long)h.percentile(99.99),
+                height, find_ns);
+}
+
+}
+
+int main(int argc, const char * argv[])
+{
+    burst_options o;
+    o.preload = 1000000;
+    o.bursts = 20;
+    o.burst = 50000;
+    o.sorted = false;
+    for (int i = 1; i < argc; ++i){
+        std::string a = argv[i];
+        if (a == "--sorted") o.sorted = true;
+        else if (i + 1 < argc && a == "--preload") o.preload = (size_t)std::strtod(argv[++i], 0);
+        else if (i + 1 < argc && a == "--bursts") o.bursts = (size_t)std::strtod(argv[++i], 0);
+        else if (i + 1 < argc && a == "--burst") o.burst = (size_t)std::strtod(argv[++i], 0);
+        else {
+            std::fprintf(stderr, "usage: %s [--preload n] [--bursts n] [--burst n] [--sorted]\n",
+                         argv[0]);
+            return 2;
+        }
+    }
+    std::vector<uint64_t> keys = make_keys(o);
+    std::printf("config,keys,inserts_per_sec,p50_ns,p99_ns,p999_ns,p9999_ns,height,find_ns\n");
+    run<eager_tree>("avl_tree", o, keys);
+    run<relaxed_tree>("avl_tree(relaxed)", o, keys);
+    run<idle_tree>("avl_tree(relaxed,idle)", o, keys);
+    run<std_map>("std::map", o, keys);
+    return 0;
+}
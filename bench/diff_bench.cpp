@@ -0,0 +1,121 @@
+//
+//  diff_bench.cpp
+//  avlmap
+//
+//  Finding what changed between a map and a replica: avl_tree::diff(),
+//  which skips subtrees whose digests agree, against a merge walk of both
+//  maps in key order. The replica is built in a different insertion order,
+//  so the two trees have different shapes, and then takes a number of
+//  random inserts, erases and value changes.
+//
+//  usage: diff_bench [--sizes 1000,100000,...] [--changes 0,1,100,...]
+//
+
+#include "../avlmap/avlmap.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iterator>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace {
+
+typedef std::chrono::steady_clock bench_clock;
+typedef avl_tree<uint64_t, uint64_t, std::less<uint64_t>,
+std::allocator<std::pair<const uint64_t, uint64_t> >, avl_digest_traits<avl_std_digest> > digest_tree;
+
+// what finding the differences takes without digests
+size_t merge_walk(const digest_tree& a, const digest_tree& b)
+{
+    size_t n = 0;
+    digest_tree::const_iterator i = a.begin(), j = b.begin();
+    while (i != a.end() || j != b.end()){
+        if (j == b.end() || (i != a.end() && i->first < j->first)) ++n, ++i;
+        else if (i == a.end() || j->first < i->first) ++n, ++j;
+        else {
+            if (i->second != j->second) ++n;
+            ++i, ++j;
+        }
+    }
+    return n;
+}
+
+double elapsed_us(bench_clock::time_point t0)
+{
+    return std::chrono::duration<double, std::micro>(bench_clock::now() - t0).count();
+}
+
+void run(size_t n, size_t changes)
+{
+    std::mt19937_64 rng(42);
+    std::vector<uint64_t> keys(n);
+    for (size_t i = 0; i < n; ++i) keys[i] = rng() >> 1;
+    digest_tree a, b;
+    for (size_t i = 0; i < n; ++i) a.insert(std::make_pair(keys[i], (uint64_t)i));
+    std::shuffle(keys.begin(), keys.end(), rng);
+    for (size_t i = 0; i < n; ++i) b.insert(std::make_pair(keys[i], a.find(keys[i])->second));
+    for (size_t c = 0; c < changes; ++c){
+        uint64_t k = keys[rng() % n];
+        switch (c % 3){
+            case 0: b.insert(std::make_pair(rng() >> 1, (uint64_t)c)); break;
+            case 1: b.erase(k); break;
+            default: {
+                digest_tree::iterator i = b.find(k);
+                if (i != b.end()){
+                    i->second += 1;
+                    b.rehash(i);
+                }
+            }
+        }
+    }
+    std::vector<digest_tree::diff_entry> d;
+    bench_clock::time_point t0 = bench_clock::now();
+    a.diff(b, std::back_inserter(d));
+    double diff_us = elapsed_us(t0);
+    t0 = bench_clock::now();
+    size_t walked = merge_walk(a, b);
+    double walk_us = elapsed_us(t0);
+    if (walked != d.size()){
+        std::fprintf(stderr, "diff found %zu differences, the walk %zu\n", d.size(), walked);
+        std::exit(1);
+    }
+    std::printf("%zu,%zu,%zu,%.1f,%.1f\n", n, changes, d.size(), diff_us, walk_us);
+}
+
+std::vector<size_t> parse_sizes(const std::string& s)
+{
+    std::vector<size_t> v;
+    size_t pos = 0;
+    while (pos < s.size()){
+        size_t comma = s.find(',', pos);
+        if (comma == std::string::npos) comma = s.size();
+        v.push_back((size_t)std::strtod(s.substr(pos, comma - pos).c_str(), 0));
+        pos = comma + 1;
+    }
+    return v;
+}
+
+}
+
+int main(int argc, const char * argv[])
+{
+    std::vector<size_t> sizes = parse_sizes("1e4,1e6");
+    std::vector<size_t> changes = parse_sizes("0,1,10,100,1000");
+    for (int i = 1; i < argc; ++i){
+        std::string a = argv[i];
+        if (i + 1 < argc && a == "--sizes") sizes = parse_sizes(argv[++i]);
+        else if (i + 1 < argc && a == "--changes") changes = parse_sizes(argv[++i]);
+        else {
+            std::fprintf(stderr, "usage: %s [--sizes n,...] [--changes n,...]\n", argv[0]);
+            return 2;
+        }
+    }
+    std::printf("size,changes,differences,diff_us,merge_walk_us\n");
+    for (size_t i = 0; i < sizes.size(); ++i)
+        for (size_t j = 0; j < changes.size(); ++j) run(sizes[i], changes[j]);
+    return 0;
+}
@@ -0,0 +1,125 @@
+//
+//  durable_bench.cpp
+//  avlmap
+//
+//  Write throughput and recovery time of durable_avl_map on local disk.
+//
+//  usage: durable_bench [dir] [writes_per_thread] [recovery_elements]
+//
+
+#include "../avlmap/avlmap_durable.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+
+namespace {
+
+typedef durable_avl_map<uint64_t, uint64_t> durable_map;
+typedef std::chrono::steady_clock bench_clock;
+
+double seconds_since(bench_clock::time_point start)
+{
+    return std::chrono::duration<double>(bench_clock::now() - start).count();
+}
+
+void reset_dir(const std::string& dir)
+{
+    std::string cmd = "rm -rf '" + dir + "'";
+    if (std::system(cmd.c_str()) != 0) throw std::runtime_error("cannot clean " + dir);
+}
+
+// what durable_avl_map replaces: one mutex, one write and one fdatasync per
+// mutation
+double fsync_per_write(const std::string& dir, int threads, int writes)
+{
+    reset_dir(dir);
+    ::mkdir(dir.c_str(), 0755);
+    int fd = ::open((dir + "/log").c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd < 0) throw std::runtime_error("cannot open log");
+    avl_tree<uint64_t, uint64_t> map;
+    std::mutex mutex;
+    bench_clock::time_point start = bench_clock::now();
+    std::vector<std::thread> pool;
+    for (int t = 0; t < threads; ++t){
+        pool.push_back(std::thread([&, t]{
+            for (int i = 0; i < writes; ++i){
+                uint64_t rec[2] = { (uint64_t)t << 32 | (uint64_t)i, (uint64_t)i };
+                std::lock_guard<std::mutex> lock(mutex);
+                map[rec[0]] = rec[1];
+                if (::write(fd, rec, sizeof(rec)) != (ssize_t)sizeof(rec)
+                    || ::fdatasync(fd) != 0) std::abort();
+            }
+        }));
+    }
+    for (size_t t = 0; t < pool.size(); ++t) pool[t].join();
+    double secs = seconds_since(start);
+    ::close(fd);
+    return (double)threads * writes / secs;
+}
+
+double group_commit(const std::string& dir, int threads, int writes)
+{
+    reset_dir(dir);
+    durable_map map(dir);
+    bench_clock::time_point start = bench_clock::now();
+    std::vector<std::thread> pool;
+    for (int t = 0; t < threads; ++t){
+        pool.push_back(std::thread([&, t]{
+            for (int i = 0; i < writes; ++i){
+                map.assign((uint64_t)t << 32 | (uint64_t)i, (uint64_t)i);
+                map.sync();
+            }
+        }));
+    }
+    for (size_t t = 0; t < pool.size(); ++t) pool[t].join();
+    return (double)threads * writes / seconds_since(start);
+}
+
+// Recovery of a map with `elements` entries, `tail` of which are only in
+// the log.
+double recovery(const std::string& dir, int elements, int tail)
+{
+    reset_dir(dir);
+    {
+        durable_map::options opt;
+        opt.checkpoint_log_bytes = 0;
+        durable_map map(dir, opt);
+        for (int i = 0; i < elements - tail; ++i) map.assign((uint64_t)i * 2654435761u, i);
+        map.checkpoint();
+        for (int i = elements - tail; i < elements; ++i) map.assign((uint64_t)i * 2654435761u, i);
+        map.sync();
+    }
+    bench_clock::time_point start = bench_clock::now();
+    durable_map map(dir);
+    double secs = seconds_since(start);
+    if (map.size() != (size_t)elements) throw std::runtime_error("recovery lost elements");
+    return secs;
+}
+
+}
+
+int main(int argc, const char * argv[])
+{
+    std::string dir = argc > 1 ? argv[1] : "/tmp/avlmap_durable_bench";
+    int writes = argc > 2 ? std::atoi(argv[2]) : 2000;
+    int elements = argc > 3 ? std::atoi(argv[3]) : 1000000;
+
+    std::printf("scenario,threads,writes_per_sec\n");
+    const int threads[] = { 1, 4, 16, 64 };
+    for (size_t i = 0; i < sizeof(threads) / sizeof(threads[0]); ++i){
+        std::printf("fsync_per_write,%d,%.0f\n", threads[i],
+                    fsync_per_write(dir, threads[i], writes));
+        std::printf("group_commit,%d,%.0f\n", threads[i],
+                    group_commit(dir, threads[i], writes));
+    }
+
+    std::printf("\nelements,log_tail,recovery_sec\n");
+    const int tails[] = { 0, elements / 10, elements };
+    for (size_t i = 0; i < sizeof(tails) / sizeof(tails[0]); ++i){
+        std::printf("%d,%d,%.3f\n", elements, tails[i], recovery(dir, elements, tails[i]));
+    }
+    reset_dir(dir);
+    return 0;
+}
@@ -0,0 +1,131 @@
+//
+//  expiry_bench.cpp
+//  avlmap
+//
+//  A cache of n entries with random times to live, kept at a constant size:
+//  every tick removes what has expired and inserts as many fresh entries.
+//  Compares expiring_avl_map::expire_until against a full sweep of an
+//  avl_tree holding the deadline next to each value, and reports the time
+//  spent expiring per tick and per expired entry. Time is simulated, in
+//  ticks.
+//
+//  usage: expiry_bench [--sizes 1000,100000,...] [--ticks n] [--ttl n]
+//
+
+#include "../avlmap/avlmap_expiring.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace {
+
+typedef std::chrono::steady_clock bench_clock;
+
+struct tick_clock
+{
+    typedef std::chrono::duration<int64_t> duration;
+    typedef duration::rep rep;
+    typedef duration::period period;
+    typedef std::chrono::time_point<tick_clock> time_point;
+    static const bool is_steady = true;
+    static time_point now() { return time_point(); }
+};
+
+// keeps the results from being optimized away
+volatile uint64_t sink;
+
+struct heap_cache
+{
+    expiring_avl_map<uint64_t, uint64_t, tick_clock> m;
+    void insert(uint64_t k, int64_t now, int64_t ttl)
+    {
+        m.insert(k, k, tick_clock::duration(ttl), tick_clock::time_point(tick_clock::duration(now)));
+    }
+    size_t expire(int64_t now)
+    {
+        return m.expire_until(tick_clock::time_point(tick_clock::duration(now)));
+    }
+};
+
+// what a cache on a plain map does: iterate everything once per tick
+struct sweep_cache
+{
+    avl_tree<uint64_t, std::pair<uint64_t, int64_t> > m;
+    void insert(uint64_t k, int64_t now, int64_t ttl)
+    {
+        m.insert(std::make_pair(k, std::make_pair(k, now + ttl)));
+    }
+    size_t expire(int64_t now)
+    {
+        size_t n = 0;
+        for (avl_tree<uint64_t, std::pair<uint64_t, int64_t> >::iterator i = m.begin(); i != m.end();){
+            if (i->second.second <= now){
+                m.erase(i++);
+                ++n;
+            } else ++i;
+        }
+        return n;
+    }
+};
+
+template <typename Cache>
+void run(const char* config, size_t entries, int ticks, int64_t ttl)
+{
+    Cache c;
+    std::mt19937_64 rng(42);
+    for (size_t i = 0; i < entries; ++i) c.insert(rng(), 0, 1 + (int64_t)(rng() % ttl));
+    double ns = 0;
+    size_t expired = 0;
+    for (int64_t now = 1; now <= ticks; ++now){
+        bench_clock::time_point t0 = bench_clock::now();
+        size_t n = c.expire(now);
+        ns += std::chrono::duration<double, std::nano>(bench_clock::now() - t0).count();
+        expired += n;
+        for (size_t i = 0; i < n; ++i) c.insert(rng(), now, 1 + (int64_t)(rng() % ttl));
+    }
+    sink += expired;
+    std::printf("%s,%zu,%.0f,%.1f\n", config, entries, ns / ticks,
+                expired ? ns / (double)expired : 0.0);
+}
+
+std::vector<size_t> parse_sizes(const std::string& s)
+{
+    std::vector<size_t> v;
+    size_t pos = 0;
+    while (pos < s.size()){
+        size_t comma = s.find(',', pos);
+        if (comma == std::string::npos) comma = s.size();
+        v.push_back((size_t)std::strtod(s.substr(pos, comma - pos).c_str(), 0));
+        pos = comma + 1;
+    }
+    return v;
+}
+
+}
+
+int main(int argc, const char * argv[])
+{
+    std::vector<size_t> sizes = parse_sizes("1e3,1e5,1e6");
+    int ticks = 100;
+    int64_t ttl = 3600;
+    for (int i = 1; i < argc; ++i){
+        std::string a = argv[i];
+        if (i + 1 < argc && a == "--sizes") sizes = parse_sizes(argv[++i]);
+        else if (i + 1 < argc && a == "--ticks") ticks = std::max(1, std::atoi(argv[++i]));
+        else if (i + 1 < argc && a == "--ttl") ttl = std::max(1, std::atoi(argv[++i]));
+        else {
+            std::fprintf(stderr, "usage: %s [--sizes n,...] [--ticks n] [--ttl n]\n", argv[0]);
+            return 2;
+        }
+    }
+    std::printf("config,entries,ns_per_tick,ns_per_expired\n");
+    for (size_t i = 0; i < sizes.size(); ++i){
+        run<heap_cache>("expiring_avl_map expire_until", sizes[i], ticks, ttl);
+        run<sweep_cache>("avl_tree sweep", sizes[i], ticks, ttl);
+    }
+    return 0;
+}
@@ -0,0 +1,155 @@
+//
+//  frozen_bench.cpp
+//  avlmap
+//
+//  A static lookup table of integer keys, built at compile time as a
+//  frozen_avl_map and at startup as an avl_tree, a std::map and a sorted
+//  std::vector searched with std::lower_bound. Reports what building the
+//  table costs at run time (nothing, for the frozen map) and the time per
+//  lookup of random keys, half of them absent.
+//
+//  usage: frozen_bench [--lookups n]
+//
+
+#include "../avlmap/avlmap_frozen.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace {
+
+typedef std::chrono::steady_clock bench_clock;
+
+// keeps the lookups from being optimized away
+volatile uint64_t sink;
+
+// distinct keys for i < 2^32, spread over the whole range
+constexpr uint32_t key_of(size_t i)
+{
+    return (uint32_t)(i * 2654435761u);
+}
+
+template <size_t... I>
+constexpr auto make_table(std::index_sequence<I...>)
+{
+    const std::pair<uint32_t, uint32_t> items[] = {{key_of(I), (uint32_t)I}...};
+    return make_frozen_avl_map<uint32_t, uint32_t>(items);
+}
+
+template <size_t N>
+struct table
+{
+    static constexpr auto frozen = make_table(std::make_index_sequence<N>());
+};
+
+struct frozen_lookup
+{
+    template <size_t N>
+    static uint64_t find(uint32_t k)
+    {
+        auto i = table<N>::frozen.find(k);
+        return i != table<N>::frozen.end() ? i->second : 0;
+    }
+};
+
+template <typename Map>
+struct map_lookup
+{
+    Map m;
+    template <size_t N>
+    void build()
+    {
+        for (size_t i = 0; i < N; ++i) m.insert(std::make_pair(key_of(i), (uint32_t)i));
+    }
+    uint64_t find(uint32_t k) const
+    {
+        typename Map::const_iterator i = m.find(k);
+        return i != m.end() ? i->second : 0;
+    }
+};
+
+struct vector_lookup
+{
+    std::vector<std::pair<uint32_t, uint32_t> > v;
+    template <size_t N>
+    void build()
+    {
+        for (size_t i = 0; i < N; ++i) v.push_back(std::make_pair(key_of(i), (uint32_t)i));
+        std::sort(v.begin(), v.end());
+    }
+    uint64_t find(uint32_t k) const
+    {
+        std::vector<std::pair<uint32_t, uint32_t> >::const_iterator i
+        = std::lower_bound(v.begin(), v.end(), std::make_pair(k, (uint32_t)0));
+        return (i != v.end() && i->first == k) ? i->second : 0;
+    }
+};
+
+std::vector<uint32_t> probes(size_t n, size_t lookups)
+{
+    std::mt19937_64 rng(42);
+    std::vector<uint32_t> keys(lookups);
+    for (size_t i = 0; i < lookups; ++i) keys[i] = key_of(rng() % (2 * n));
+    return keys;
+}
+
+void report(const char* config, size_t n, double build_ns, double ns, size_t lookups)
+{
+    std::printf("%s,%zu,%.0f,%.2f\n", config, n, build_ns, ns / (double)lookups);
+}
+
+template <typename Map, size_t N>
+void run_map(const char* config, const std::vector<uint32_t>& keys)
+{
+    bench_clock::time_point t0 = bench_clock::now();
+    Map m;
+    m.template build<N>();
+    bench_clock::time_point t1 = bench_clock::now();
+    uint64_t s = 0;
+    for (size_t i = 0; i < keys.size(); ++i) s += m.find(keys[i]);
+    bench_clock::time_point t2 = bench_clock::now();
+    sink += s;
+    report(config, N, std::chrono::duration<double, std::nano>(t1 - t0).count(),
+           std::chrono::duration<double, std::nano>(t2 - t1).count(), keys.size());
+}
+
+template <size_t N>
+void run(size_t lookups)
+{
+    std::vector<uint32_t> keys = probes(N, lookups);
+    bench_clock::time_point t0 = bench_clock::now();
+    uint64_t s = 0;
+    for (size_t i = 0; i < keys.size(); ++i) s += frozen_lookup::find<N>(keys[i]);
+    double ns = std::chrono::duration<double, std::nano>(bench_clock::now() - t0).count();
+    sink += s;
+    report("frozen_avl_map", N, 0, ns, keys.size());
+    run_map<map_lookup<avl_tree<uint32_t, uint32_t> >, N>("avl_tree", keys);
+    run_map<map_lookup<std::map<uint32_t, uint32_t> >, N>("std::map", keys);
+    run_map<vector_lookup, N>("sorted vector", keys);
+}
+
+}
+
+int main(int argc, const char * argv[])
+{
+    size_t lookups = 10000000;
+    for (int i = 1; i < argc; ++i){
+        std::string a = argv[i];
+        if (i + 1 < argc && a == "--lookups") lookups = (size_t)std::strtod(argv[++i], 0);
+        else {
+            std::fprintf(stderr, "usage: %s [--lookups n]\n", argv[0]);
+            return 2;
+        }
+    }
+    std::printf("config,entries,build_ns,ns_per_lookup\n");
+    run<16>(lookups);
+    run<256>(lookups);
+    run<4096>(lookups);
+    return 0;
+}
@@ -0,0 +1,56 @@
+//
+//  latency_histogram.h
+//  avlmap
+//
+//  Per-operation latency distribution shared by the benchmarks.
+//
+
+#ifndef AVL_MAP_LATENCY_HISTOGRAM_H
+#define AVL_MAP_LATENCY_HISTOGRAM_H
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+// Log-linear latency histogram: exact below 64ns, then 32 buckets per
+// power of two (about 3% resolution).
+class latency_histogram
+{
+public:
+    latency_histogram() : counts_(64 + 58 * 32, 0), total_(0) {}
+
+    void add(uint64_t ns){
+        ++counts_[bucket(ns)];
+        ++total_;
+    }
+
+    uint64_t percentile(double p) const
+    {
+        uint64_t rank = (uint64_t)(p / 100.0 * (double)total_);
+        uint64_t seen = 0;
+        for (size_t i = 0; i < counts_.size(); ++i){
+            seen += counts_[i];
+            if (seen > rank) return lower_edge(i);
+        }
+        return 0;
+    }
+
+private:
+    static size_t bucket(uint64_t ns){
+        if (ns < 64) return (size_t)ns;
+        int e = 63 - __builtin_clzll(ns);
+        size_t b = 64 + (size_t)(e - 6) * 32 + (size_t)((ns >> (e - 5)) & 31);
+        return std::min<size_t>(b, 64 + 58 * 32 - 1);
+    }
+
+    static uint64_t lower_edge(size_t b){
+        if (b < 64) return b;
+        int e = (int)((b - 64) / 32) + 6;
+        return ((uint64_t)1 << e) + ((uint64_t)((b - 64) % 32) << (e - 5));
+    }
+
+    std::vector<uint64_t> counts_;
+    uint64_t total_;
+};
+
+#endif // AVL_MAP_LATENCY_HISTOGRAM_H
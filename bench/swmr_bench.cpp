@@ -0,0 +1,186 @@
+//
+//  swmr_bench.cpp
+//  avlmap
+//
+//  Read scaling beside a busy writer. One thread inserts and erases random
+//  keys, keeping the map near its initial size, while R threads look up
+//  random keys, half of them absent, in batches of 16 per read_guard or
+//  per shared lock. Compares an avl_tree in single-writer mode, whose
+//  readers take no lock, against an avl_tree behind a std::shared_mutex.
+//  Reports reader throughput in total and per thread, and the writer's.
+//
+//  usage: swmr_bench [--sizes 1000,100000,...] [--readers 1,2,4,...]
+//                    [--seconds s]
+//
+
+#include "../avlmap/avlmap.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <random>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+typedef std::chrono::steady_clock bench_clock;
+
+// keeps the lookups from being optimized away
+std::atomic<uint64_t> sink;
+
+enum { batch = 16 };
+
+typedef avl_tree<uint64_t, uint64_t, std::less<uint64_t>,
+std::allocator<std::pair<const uint64_t, uint64_t> >,
+avl_concurrency_traits<avl_single_writer> > swmr_tree;
+
+struct swmr_map
+{
+    swmr_tree m;
+
+    struct reader
+    {
+        swmr_tree::reader r;
+        explicit reader(swmr_map& s) : r(s.m) {}
+        uint64_t find(const uint64_t* keys)
+        {
+            swmr_tree::read_guard g(r);
+            uint64_t found = 0;
+            for (int i = 0; i < batch; ++i) found += g.contains(keys[i]);
+            return found;
+        }
+    };
+
+    void insert(uint64_t k) { m.insert(std::make_pair(k, k)); }
+    void erase(uint64_t k) { m.erase(k); }
+};
+
+struct locked_map
+{
+    avl_tree<uint64_t, uint64_t> m;
+    std::shared_mutex lock;
+
+    struct reader
+    {
+        locked_map& s;
+        explicit reader(locked_map& x) : s(x) {}
+        uint64_t find(const uint64_t* keys)
+        {
+            std::shared_lock<std::shared_mutex> g(s.lock);
+            uint64_t found = 0;
+            for (int i = 0; i < batch; ++i) found += s.m.find(keys[i]) != s.m.end();
+            return found;
+        }
+    };
+
+    void insert(uint64_t k)
+    {
+        std::unique_lock<std::shared_mutex> g(lock);
+        m.insert(std::make_pair(k, k));
+    }
+
+    void erase(uint64_t k)
+    {
+        std::unique_lock<std::shared_mutex> g(lock);
+        m.erase(k);
+    }
+};
+
+template <typename Map>
+void run(const char* config, size_t n, size_t readers, double seconds)
+{
+    Map map;
+    std::mt19937_64 rng(42);
+    uint64_t range = 2 * n;
+    for (size_t i = 0; i < n; ++i) map.insert(rng() % range);
+
+    // readers stop at the deadline on their own: behind the shared_mutex
+    // the writer can starve, and would never tell them to
+    std::atomic<bool> start(false);
+    bench_clock::time_point t0, end;
+    std::vector<uint64_t> lookups(readers);
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < readers; ++t){
+        threads.emplace_back([&, t]{
+            typename Map::reader r(map);
+            std::mt19937_64 g(t + 1);
+            std::vector<uint64_t> keys(4096);
+            for (size_t i = 0; i < keys.size(); ++i) keys[i] = g() % range;
+            uint64_t count = 0, found = 0;
+            while (!start.load(std::memory_order_acquire)) std::this_thread::yield();
+            for (size_t i = 0;; i = (i + batch) % keys.size()){
+                if (count % (64 * batch) == 0 && bench_clock::now() >= end) break;
+                found += r.find(&keys[i]);
+                count += batch;
+            }
+            lookups[t] = count;
+            sink += found;
+        });
+    }
+
+    uint64_t writes = 0;
+    t0 = bench_clock::now();
+    end = t0 + std::chrono::duration_cast<bench_clock::duration>(std::chrono::duration<double>(seconds));
+    start.store(true, std::memory_order_release);
+    for (; bench_clock::now() < end; ++writes){
+        uint64_t k = rng() % range;
+        if (writes & 1) map.erase(k);
+        else map.insert(k);
+    }
+    for (size_t t = 0; t < readers; ++t) threads[t].join();
+    double s = std::chrono::duration<double>(bench_clock::now() - t0).count();
+
+    uint64_t total = 0;
+    for (size_t t = 0; t < readers; ++t) total += lookups[t];
+    double mops = (double)total / s / 1e6;
+    std::printf("%s,%zu,%zu,%.2f,%.2f,%.3f\n", config, n, readers, mops, mops / (double)readers,
+                (double)writes / s / 1e6);
+}
+
+std::vector<size_t> parse_sizes(const std::string& s)
+{
+    std::vector<size_t> v;
+    size_t pos = 0;
+    while (pos < s.size()){
+        size_t comma = s.find(',', pos);
+        if (comma == std::string::npos) comma = s.size();
+        v.push_back((size_t)std::strtod(s.substr(pos, comma - pos).c_str(), 0));
+        pos = comma + 1;
+    }
+    return v;
+}
+
+}
+
+int main(int argc, const char * argv[])
+{
+    std::vector<size_t> sizes = parse_sizes("1e4,1e6");
+    std::vector<size_t> readers = parse_sizes("1,2,4,8,16,32,64");
+    double seconds = 1;
+    for (int i = 1; i < argc; ++i){
+        std::string a = argv[i];
+        if (i + 1 < argc && a == "--sizes") sizes = parse_sizes(argv[++i]);
+        else if (i + 1 < argc && a == "--readers") readers = parse_sizes(argv[++i]);
+        else if (i + 1 < argc && a == "--seconds") seconds = std::strtod(argv[++i], 0);
+        else {
+            std::fprintf(stderr, "usage: %s [--sizes n,...] [--readers n,...] [--seconds s]\n",
+                         argv[0]);
+            return 2;
+        }
+    }
+    std::printf("config,size,readers,reader_mops_per_sec,per_reader_mops_per_sec,"
+                "writer_mops_per_sec\n");
+    for (size_t i = 0; i < sizes.size(); ++i){
+        for (size_t j = 0; j < readers.size(); ++j){
+            size_t r = std::min<size_t>(readers[j], (size_t)avl_epochs<avl_single_writer>::max_readers);
+            run<swmr_map>("single_writer", sizes[i], r, seconds);
+            run<locked_map>("shared_mutex", sizes[i], r, seconds);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,172 @@
+//
+//  timer_bench.cpp
+//  avlmap
+//
+//  Ordered maps as timer queues, against std::priority_queue. Each queue
+//  holds a fixed number of timers; every expired timer is rescheduled at a
+//  random delay (the hold model). "pop" fires one timer at a time, "drain"
+//  advances a clock in ticks and fires everything due. Keys are deadlines
+//  with a sequence number in the low bits, so they are unique.
+//
+//  usage: timer_bench [--sizes 1000,100000,...] [--events n]
+//
+
+#include "../avlmap/avlmap.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <map>
+#include <queue>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace {
+
+typedef std::chrono::steady_clock bench_clock;
+typedef std::pair<uint64_t, uint64_t> timer_entry;   // deadline key, task
+
+const int seq_bits = 20;
+const uint64_t max_delay = 1 << 20;   // in clock units
+
+// keeps the fired tasks from being optimized away
+volatile uint64_t sink;
+
+template <typename Map>
+struct pop_min_queue
+{
+    Map m;
+    void push(uint64_t k, uint64_t task) { m.insert(timer_entry(k, task)); }
+    timer_entry pop() { return m.pop_min(); }
+    template <typename Out> void drain(uint64_t k, Out out) { m.drain_until(k, out); }
+};
+
+// what a timer queue on an ordered map does without pop_min
+template <typename Map>
+struct erase_begin_queue
+{
+    Map m;
+    void push(uint64_t k, uint64_t task) { m.insert(timer_entry(k, task)); }
+    timer_entry pop()
+    {
+        typename Map::iterator i = m.begin();
+        timer_entry e = *i;
+        m.erase(i);
+        return e;
+    }
+    template <typename Out> void drain(uint64_t k, Out out)
+    {
+        while (!m.empty() && m.begin()->first <= k) *out++ = pop();
+    }
+};
+
+struct heap_queue
+{
+    std::priority_queue<timer_entry, std::vector<timer_entry>, std::greater<timer_entry> > q;
+    void push(uint64_t k, uint64_t task) { q.push(timer_entry(k, task)); }
+    timer_entry pop()
+    {
+        timer_entry e = q.top();
+        q.pop();
+        return e;
+    }
+    template <typename Out> void drain(uint64_t k, Out out)
+    {
+        while (!q.empty() && q.top().first <= k) *out++ = pop();
+    }
+};
+
+typedef avl_tree<uint64_t, uint64_t, std::less<uint64_t>,
+std::allocator<std::pair<const uint64_t, uint64_t> >, avl_balance_traits<avl_weak_balance> > wavl_tree;
+
+struct clock_state
+{
+    std::mt19937_64 rng;
+    uint64_t seq;
+    explicit clock_state(uint64_t seed) : rng(seed), seq(0) {}
+    uint64_t deadline(uint64_t now)
+    {
+        return ((now + 1 + rng() % max_delay) << seq_bits) | (seq++ & ((1 << seq_bits) - 1));
+    }
+};
+
+template <typename Queue>
+void run(const char* config, size_t timers, size_t events)
+{
+    double ns[2];
+    for (int mode = 0; mode < 2; ++mode){
+        Queue q;
+        clock_state c(42);
+        for (size_t i = 0; i < timers; ++i) q.push(c.deadline(0), i);
+        uint64_t now = 0;
+        size_t fired = 0;
+        // about as many timers due per tick as the queue holds per 1/64th
+        // of the delay range
+        uint64_t tick = std::max<uint64_t>(1, max_delay / 64 / std::max<size_t>(1, timers / 64));
+        std::vector<timer_entry> due;
+        bench_clock::time_point t0 = bench_clock::now();
+        while (fired < events){
+            if (mode == 0){
+                timer_entry e = q.pop();
+                now = e.first >> seq_bits;
+                sink += e.second;
+                q.push(c.deadline(now), e.second);
+                ++fired;
+            } else {
+                now += tick;
+                due.clear();
+                q.drain(((now + 1) << seq_bits) - 1, std::back_inserter(due));
+                for (size_t i = 0; i < due.size(); ++i){
+                    sink += due[i].second;
+                    q.push(c.deadline(now), due[i].second);
+                }
+                fired += due.size();
+            }
+        }
+        ns[mode] = std::chrono::duration<double, std::nano>(bench_clock::now() - t0).count()
+        / (double)fired;
+    }
+    std::printf("%s,%zu,%.1f,%.1f\n", config, timers, ns[0], ns[1]);
+}
+
+std::vector<size_t> parse_sizes(const std::string& s)
+{
+    std::vector<size_t> v;
+    size_t pos = 0;
+    while (pos < s.size()){
+        size_t comma = s.find(',', pos);
+        if (comma == std::string::npos) comma = s.size();
+        v.push_back((size_t)std::strtod(s.substr(pos, comma - pos).c_str(), 0));
+        pos = comma + 1;
+    }
+    return v;
+}
+
+}
+
+int main(int argc, const char * argv[])
+{
+    std::vector<size_t> sizes = parse_sizes("1e3,1e5,1e6");
+    size_t events = 2000000;
+    for (int i = 1; i < argc; ++i){
+        std::string a = argv[i];
+        if (i + 1 < argc && a == "--sizes") sizes = parse_sizes(argv[++i]);
+        else if (i + 1 < argc && a == "--events") events = (size_t)std::strtod(argv[++i], 0);
+        else {
+            std::fprintf(stderr, "usage: %s [--sizes n,...] [--events n]\n", argv[0]);
+            return 2;
+        }
+    }
+    std::printf("config,timers,pop_ns_per_timer,drain_ns_per_timer\n");
+    for (size_t i = 0; i < sizes.size(); ++i){
+        size_t n = sizes[i];
+        run<pop_min_queue<avl_tree<uint64_t, uint64_t> > >("avl_tree pop_min", n, events);
+        run<erase_begin_queue<avl_tree<uint64_t, uint64_t> > >("avl_tree erase(begin())", n, events);
+        run<pop_min_queue<wavl_tree> >("avl_tree<wavl> pop_min", n, events);
+        run<erase_begin_queue<std::map<uint64_t, uint64_t> > >("std::map", n, events);
+        run<heap_queue>("std::priority_queue", n, events);
+    }
+    return 0;
+}
@@ -0,0 +1,316 @@
+//
+//  trace_replay.cpp
+//  avlmap
+//
+//  Replays a trace recorded with traced_avl_map (avlmap_trace.h) against
+//  each map configuration and reports throughput and latency percentiles.
+//
+//  usage: trace_replay <trace> [--configs name,...] [--runs n]
+//         trace_replay --generate <trace> [operations]
+//
+
+#include "../avlmap/avlmap_trace.h"
+#include "latency_histogram.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <random>
+#include <type_traits>
+#include <vector>
+
+namespace {
+
+typedef std::chrono::steady_clock replay_clock;
+
+// keeps the replayed lookups from being optimized away
+volatile uint64_t sink;
+
+template <typename Key>
+struct trace
+{
+    std::vector<unsigned char> ops;
+    std::vector<Key> keys;
+};
+
+template <typename Map>
+inline uint64_t apply(Map& m, unsigned char op, const typename Map::key_type& k)
+{
+    typedef typename Map::value_type value_type;
+    switch (op){
+        case avl_trace_find: return m.find(k) != m.end();
+        case avl_trace_insert: return m.insert(value_type(k, typename Map::mapped_type())).second;
+        case avl_trace_erase: return m.erase(k);
+        case avl_trace_lower_bound: return m.lower_bound(k) != m.end();
+        case avl_trace_upper_bound: return m.upper_bound(k) != m.end();
+        case avl_trace_subscript: return ++m[k];
+    }
+    return 0;
+}
+
+// One untimed-per-operation pass for throughput, one timing every
+// operation for the latency distribution.
+template <typename Map, typename Key>
+void replay(const char* config, const trace<Key>& t, int runs)
+{
+    size_t n = t.ops.size();
+    double best = 1e300;
+    for (int r = 0; r < runs; ++r){
+        Map m;
+        replay_clock::time_point t0 = replay_clock::now();
+        for (size_t i = 0; i < n; ++i) sink += apply(m, t.ops[i], t.keys[i]);
+        best = std::min(best, std::chrono::duration<double>(replay_clock::now() - t0).count());
+    }
+    latency_histogram h;
+    {
+        Map m;
+        for (size_t i = 0; i < n; ++i){
+            replay_clock::time_point t0 = replay_clock::now();
+            sink += apply(m, t.ops[i], t.keys[i]);
+            replay_clock::time_point t1 = replay_clock::now();
+            h.add((uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0).count());
+        }
+    }
+    std::printf("%s,%zu,%.0f,%llu,%llu,%llu,%llu,%llu\n", config, n, (double)n / best,
+                (unsigned long long)h.percentile(50), (unsigned long long)h.percentile(90),
+                (unsigned long long)h.percentile(99), (unsigned long long)h.percentile(99.9),
+                (unsigned long long)h.percentile(99.99));
+}
+
+template <typename Key>
+struct relaxed_avl_tree : avl_tree<Key, uint64_t>
+{
+    relaxed_avl_tree() { this->relax_balancing(); }
+};
+
+template <typename Key, typename Traits>
+using traits_avl_tree = avl_tree<Key, uint64_t, std::less<Key>,
+std::allocator<std::pair<const Key, uint64_t> >, Traits>;
+
+template <typename Key>
+using wavl_avl_tree = traits_avl_tree<Key, avl_balance_traits<avl_weak_balance> >;
+
+// Normalizer of the prefix-caching configuration, void for key types
+// without one.
+template <typename Key, typename Enable = void>
+struct replay_normalizer
+{
+    typedef void type;
+};
+
+template <typename Key>
+struct replay_normalizer<Key, typename std::enable_if<std::is_integral<Key>::value>::type>
+{
+    typedef avl_integer_prefix type;
+};
+
+template <>
+struct replay_normalizer<std::string>
+{
+    typedef avl_string_prefix<> type;
+};
+
+// Stateless pool allocator: single objects come from a free list per type,
+// refilled 64 KiB at a time and never given back, so nodes and values are
+// packed together instead of spread over the general heap.
+template <typename T>
+struct pool_allocator
+{
+    typedef T value_type;
+    typedef T* pointer;
+    typedef const T* const_pointer;
+    typedef T& reference;
+    typedef const T& const_reference;
+    template <typename U> struct rebind { typedef pool_allocator<U> other; };
+
+    pool_allocator() {}
+    template <typename U> pool_allocator(const pool_allocator<U>&) {}
+
+    T* allocate(size_t n)
+    {
+        if (n != 1) return static_cast<T*>(::operator new(n * sizeof(T)));
+        if (free_list() == 0) refill();
+        block* b = free_list();
+        free_list() = b->next;
+        return reinterpret_cast<T*>(b);
+    }
+
+    void deallocate(T* p, size_t n)
+    {
+        if (n != 1){
+            ::operator delete(p);
+            return;
+        }
+        block* b = reinterpret_cast<block*>(p);
+        b->next = free_list();
+        free_list() = b;
+    }
+
+private:
+    union block
+    {
+        block* next;
+        alignas(T) unsigned char storage[sizeof(T)];
+    };
+
+    static block*& free_list()
+    {
+        static block* head = 0;
+        return head;
+    }
+
+    static void refill()
+    {
+        size_t count = std::max<size_t>(1, 65536 / sizeof(block));
+        block* chunk = static_cast<block*>(::operator new(count * sizeof(block)));
+        for (size_t i = count; i-- > 0;){
+            chunk[i].next = free_list();
+            free_list() = &chunk[i];
+        }
+    }
+};
+
+template <typename T, typename U>
+bool operator==(const pool_allocator<T>&, const pool_allocator<U>&) { return true; }
+
+template <typename T, typename U>
+bool operator!=(const pool_allocator<T>&, const pool_allocator<U>&) { return false; }
+
+template <typename Key>
+using pool_avl_tree = avl_tree<Key, uint64_t, std::less<Key>,
+pool_allocator<std::pair<const Key, uint64_t> > >;
+
+template <typename Key>
+struct config_entry
+{
+    const char* name;
+    void (*run)(const char*, const trace<Key>&, int);
+};
+
+template <typename Key>
+void add_prefix_config(std::vector<config_entry<Key> >&, std::false_type)
+{
+}
+
+template <typename Key>
+void add_prefix_config(std::vector<config_entry<Key> >& c, std::true_type)
+{
+    typedef traits_avl_tree<Key, avl_prefix_traits<typename replay_normalizer<Key>::type> > tree;
+    config_entry<Key> prefix = { "avl_tree<prefix>", &replay<tree, Key> };
+    c.push_back(prefix);
+}
+
+// Tree configurations to compare: balancing, node layout (prefix cache,
+// hash index, digests), allocator and concurrency mode. The replay thread
+// is the only one, so single_writer shows what publishing costs a writer.
+// std::map is the baseline.
+template <typename Key>
+std::vector<config_entry<Key> > configs()
+{
+    std::vector<config_entry<Key> > c;
+    config_entry<Key> avl = { "avl_tree", &replay<avl_tree<Key, uint64_t>, Key> };
+    config_entry<Key> relaxed = { "avl_tree(relaxed)", &replay<relaxed_avl_tree<Key>, Key> };
+    config_entry<Key> wavl = { "avl_tree<wavl>", &replay<wavl_avl_tree<Key>, Key> };
+    config_entry<Key> hash = { "avl_tree<hash>",
+        &replay<traits_avl_tree<Key, avl_hash_traits<std::hash<Key> > >, Key> };
+    config_entry<Key> digest = { "avl_tree<digest>",
+        &replay<traits_avl_tree<Key, avl_digest_traits<avl_std_digest> >, Key> };
+    config_entry<Key> pool = { "avl_tree<pool_allocator>", &replay<pool_avl_tree<Key>, Key> };
+    config_entry<Key> single_writer = { "avl_tree<single_writer>",
+        &replay<traits_avl_tree<Key, avl_concurrency_traits<avl_single_writer> >, Key> };
+    config_entry<Key> std_map = { "std::map", &replay<std::map<Key, uint64_t>, Key> };
+    c.push_back(avl);
+    c.push_back(relaxed);
+    c.push_back(wavl);
+    add_prefix_config(c, std::integral_constant<bool,
+                      !std::is_void<typename replay_normalizer<Key>::type>::value>());
+    c.push_back(hash);
+    c.push_back(digest);
+    c.push_back(pool);
+    c.push_back(single_writer);
+    c.push_back(std_map);
+    return c;
+}
+
+template <typename Key>
+int run(std::istream& is, const std::string& wanted, int runs)
+{
+    trace<Key> t;
+    avl_trace_reader<Key> reader(is);
+    avl_trace_op op;
+    Key k;
+    while (reader.next(op, k)){
+        t.ops.push_back((unsigned char)op);
+        t.keys.push_back(k);
+    }
+    std::printf("config,ops,ops_per_sec,p50_ns,p90_ns,p99_ns,p999_ns,p9999_ns\n");
+    std::vector<config_entry<Key> > all = configs<Key>();
+    for (size_t i = 0; i < all.size(); ++i){
+        if (!wanted.empty() && ("," + wanted + ",").find(std::string(",") + all[i].name + ",")
+            == std::string::npos) continue;
+        all[i].run(all[i].name, t, runs);
+    }
+    return 0;
+}
+
+// A Zipfian mix of lookups and updates, to try the tool without a capture.
+int generate(const char* path, size_t n)
+{
+    std::ofstream os(path, std::ios::binary);
+    avl_trace_writer<uint64_t> w(os);
+    std::mt19937_64 rng(7);
+    std::vector<double> cdf(std::max<size_t>(1, n / 10));
+    double sum = 0;
+    for (size_t i = 0; i < cdf.size(); ++i) cdf[i] = sum += 1.0 / (double)(i + 1);
+    std::uniform_real_distribution<double> u(0, sum);
+    for (size_t i = 0; i < n; ++i){
+        uint64_t key = (uint64_t)(std::lower_bound(cdf.begin(), cdf.end(), u(rng)) - cdf.begin())
+        * 0x9E3779B97F4A7C15ull >> 20;
+        unsigned r = (unsigned)(rng() % 100);
+        avl_trace_op op = r < 70 ? avl_trace_find : r < 85 ? avl_trace_subscript
+        : r < 95 ? avl_trace_lower_bound : avl_trace_erase;
+        w.record(op, key);
+    }
+    return os ? 0 : 1;
+}
+
+}
+
+int main(int argc, const char * argv[])
+{
+    if (argc >= 3 && std::string(argv[1]) == "--generate")
+        return generate(argv[2], argc > 3 ? (size_t)std::strtod(argv[3], 0) : 1000000);
+    if (argc < 2){
+        std::fprintf(stderr, "usage: %s <trace> [--configs name,...] [--runs n]\n"
+                     "       %s --generate <trace> [operations]\n", argv[0], argv[0]);
+        return 2;
+    }
+    std::string wanted;
+    int runs = 3;
+    for (int i = 2; i + 1 < argc; i += 2){
+        std::string a = argv[i];
+        if (a == "--configs") wanted = argv[i + 1];
+        else if (a == "--runs") runs = std::max(1, std::atoi(argv[i + 1]));
+    }
+    std::ifstream is(argv[1], std::ios::binary);
+    if (!is){
+        std::perror(argv[1]);
+        return 1;
+    }
+    try {
+        avl_trace_header h = avl_trace_reader<uint64_t>::read_header(is);
+        is.seekg(0);
+        switch (h.key_kind){
+            case avl_trace_signed_key: return run<int64_t>(is, wanted, runs);
+            case avl_trace_unsigned_key: return run<uint64_t>(is, wanted, runs);
+            case avl_trace_string_key: return run<std::string>(is, wanted, runs);
+        }
+        std::fprintf(stderr, "%s: unknown key kind\n", argv[1]);
+    } catch (const std::exception& e){
+        std::fprintf(stderr, "%s: %s\n", argv[1], e.what());
+    }
+    return 1;
+}
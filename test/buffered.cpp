@@ -0,0 +1,138 @@
+//
+//  buffered.cpp
+//  avlmap
+//
+//  Randomized test of buffered_avl_map against a std::map: assigns, erases
+//  and lookups that land before, on and after flushes, with buffers of one
+//  and two entries, odd sizes and the default, and key ranges both small
+//  and large next to the buffer, so that flushes search the tree both ways.
+//  Lookups must see buffered writes and tombstones over the tree's content,
+//  and the tree after a flush must hold exactly the reference.
+//
+//  usage: buffered [--seed n] [--ops n]
+//
+
+#include "../avlmap/avlmap_buffered.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <random>
+#include <string>
+
+#define CHECK(x) do { if (!(x)) fail(#x, __LINE__); } while (0)
+
+namespace {
+
+size_t current_buffer = 0;
+
+void fail(const char* what, int line)
+{
+    std::fprintf(stderr, "buffered: buffer %zu: line %d: %s\n", current_buffer, line, what);
+    std::exit(1);
+}
+
+typedef buffered_avl_map<long, long> map_type;
+typedef std::map<long, long> reference;
+
+void check_find(const map_type& m, const reference& r, long k)
+{
+    reference::const_iterator j = r.find(k);
+    const long* v = m.find(k);
+    CHECK((v != 0) == (j != r.end()));
+    if (v != 0) CHECK(*v == j->second);
+    CHECK(m.count(k) == r.count(k));
+}
+
+void check_tree(map_type& m, const reference& r)
+{
+    const map_type::map_type& t = m.tree();
+    CHECK(m.buffered() == 0);
+    t.check_invariants();
+    CHECK(t.size() == r.size());
+    reference::const_iterator j = r.begin();
+    for (map_type::map_type::const_iterator i = t.begin(); i != t.end(); ++i, ++j)
+        CHECK(j != r.end() && i->first == j->first && i->second == j->second);
+}
+
+void run(uint64_t seed, size_t buffer, long range, size_t ops)
+{
+    current_buffer = buffer;
+    std::mt19937_64 rng(seed);
+    map_type m(buffer);
+    reference r;
+    CHECK(m.buffer_size() == buffer);
+    for (size_t op = 0; op < ops; ++op){
+        long k = (long)(rng() % (unsigned long)range);
+        size_t before = m.buffered();
+        switch (rng() % 8){
+        case 0:
+        case 1:
+        case 2: {
+            long v = (long)(rng() % 1000);
+            m.assign(k, v);
+            r[k] = v;
+            break;
+        }
+        case 3:
+        case 4:
+            m.erase(k);
+            r.erase(k);
+            break;
+        case 5:
+            if (rng() % 16 == 0) m.flush();
+            break;
+        default:
+            break;
+        }
+        // full buffers are merged at once
+        CHECK(m.buffered() < buffer);
+        if (m.buffered() < before) CHECK(m.buffered() == 0);
+        // the key just written, and one nearby that may be in the buffer,
+        // the tree or neither
+        check_find(m, r, k);
+        check_find(m, r, k + (long)(rng() % 5) - 2);
+        if (op % 1024 == 0){
+            for (long x = 0; x < range && x < 4096; ++x) check_find(m, r, x);
+            check_tree(m, r);
+        }
+    }
+    CHECK(m.size() == r.size());
+    check_tree(m, r);
+
+    // a smaller buffer flushes what no longer fits
+    m.assign(-1, 1);
+    m.assign(-2, 2);
+    r[-1] = 1;
+    r[-2] = 2;
+    CHECK(m.buffered() == (buffer > 2 ? 2 : 0));
+    m.set_buffer_size(1);
+    CHECK(m.buffered() == 0 && m.buffer_size() == 1);
+    check_tree(m, r);
+    m.clear();
+    CHECK(m.size() == 0 && m.find(-1) == 0);
+}
+
+}
+
+int main(int argc, const char * argv[])
+{
+    uint64_t seed = 1;
+    size_t ops = 40000;
+    for (int i = 1; i < argc; ++i){
+        std::string a = argv[i];
+        if (i + 1 < argc && a == "--seed") seed = std::strtoull(argv[++i], 0, 10);
+        else if (i + 1 < argc && a == "--ops") ops = std::strtoul(argv[++i], 0, 10);
+        else {
+            std::fprintf(stderr, "usage: %s [--seed n] [--ops n]\n", argv[0]);
+            return 2;
+        }
+    }
+    size_t buffers[] = { 1, 2, 3, 7, 37, map_type::default_buffer_size };
+    long ranges[] = { 16, 1000, 100000 };
+    for (size_t i = 0; i < sizeof(buffers) / sizeof(buffers[0]); ++i)
+        for (size_t j = 0; j < sizeof(ranges) / sizeof(ranges[0]); ++j)
+            run(seed + i * 3 + j, buffers[i], ranges[j], ops);
+    std::printf("buffered: ok\n");
+    return 0;
+}
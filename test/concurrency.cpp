@@ -0,0 +1,154 @@
+//
+//  concurrency.cpp
+//  avlmap
+//
+//  Stress test of the single-writer mode: R threads read through
+//  read_guard while one writer inserts, erases, replaces and pops. Even
+//  keys stay in the map throughout (the writer only moves the smallest and
+//  largest out and back) and odd keys come and go; every mapped value is
+//  3 * key plus a multiple of 7. Readers check that every even key they
+//  look up is found, that lower_bound never skips one and that no value
+//  breaks the pattern; the writer checks the tree's invariants as it goes.
+//  Runs under both balance policies, eager and relaxed. Pass --seconds to
+//  run each configuration for a while instead of a fixed number of writes.
+//
+//  usage: concurrency [--readers n] [--size n] [--ops n] [--seconds s]
+//
+
+#include "../avlmap/avlmap.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+template <typename Policy>
+struct swmr_traits : avl_default_traits
+{
+    typedef avl_single_writer concurrency;
+    typedef Policy balance_policy;
+};
+
+struct options
+{
+    int readers;
+    long size;
+    long ops;
+    double seconds;
+};
+
+template <typename Policy>
+bool run(const char* name, const options& o, bool relaxed)
+{
+    typedef avl_tree<long, long, std::less<long>, std::allocator<std::pair<const long, long> >,
+    swmr_traits<Policy> > tree;
+    typedef typename tree::value_type value_type;
+
+    const long n = o.size;
+    tree t;
+    if (relaxed) t.relax_balancing(1, 64);
+    for (long k = 0; k < 2 * n; k += 2) t.insert(std::make_pair(k, 3 * k));
+
+    std::atomic<bool> done(false);
+    std::atomic<long> failures(0), reads(0);
+    std::vector<std::thread> threads;
+    for (int r = 0; r < o.readers; ++r){
+        threads.emplace_back([&, r]{
+            typename tree::reader rd(t);
+            std::mt19937_64 rng(r + 1);
+            long count = 0, bad = 0;
+            while (!done.load(std::memory_order_relaxed)){
+                typename tree::read_guard g(rd);
+                for (int i = 0; i < 64; ++i, ++count){
+                    long k = (long)(rng() % (2 * n));
+                    // the smallest and largest keys are popped and put back
+                    bool edge = k == 0 || k >= 2 * n - 2;
+                    const value_type* v = g.find(k);
+                    if (v != 0 && (v->first != k || (v->second - 3 * k) % 7 != 0)) ++bad;
+                    if (!edge && k % 2 == 0 && v == 0) ++bad;
+                    const value_type* lb = g.lower_bound(k);
+                    long even = k % 2 == 0 ? k : k + 1;
+                    if (!edge && even < 2 * n - 2
+                        && (lb == 0 || lb->first < k || lb->first > even)) ++bad;
+                }
+            }
+            reads += count;
+            failures += bad;
+        });
+    }
+
+    std::mt19937_64 rng(99);
+    std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now()
+    + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(o.seconds));
+    long i = 0;
+    for (; o.seconds > 0 ? std::chrono::steady_clock::now() < end : i < o.ops; ++i){
+        long k = 2 * (long)(rng() % (uint64_t)n) + 1;
+        switch (rng() % 4){
+        case 0:
+            t.erase(k);
+            break;
+        case 1: {
+            typename tree::iterator it = t.find(k);
+            if (it != t.end()) t.replace(it, 3 * k + 7 * (i % 1000));
+            else t.insert(std::make_pair(k, 3 * k));
+            break;
+        }
+        case 2:
+            if (t.size() > (size_t)n){
+                value_type v = (rng() & 1) ? t.pop_min() : t.pop_max();
+                if (v.first % 2 == 0) t.insert(v);
+            }
+            break;
+        default:
+            t.insert(std::make_pair(k, 3 * k));
+            break;
+        }
+        if (relaxed && i % 97 == 0) t.rebalance_some(16);
+        if (i % 4096 == 0) t.check_invariants();
+    }
+    done = true;
+    for (size_t r = 0; r < threads.size(); ++r) threads[r].join();
+
+    t.check_invariants();
+    for (long k = 0; k < 2 * n; k += 2)
+        if (t.find(k) == t.end()) failures += 1;
+    std::printf("%s%s: %ld writes, %ld reads, %ld failures\n", name, relaxed ? " relaxed" : "",
+                i, reads.load(), failures.load());
+    return failures.load() == 0;
+}
+
+}
+
+int main(int argc, const char * argv[])
+{
+    options o;
+    o.readers = 4;
+    o.size = 2000;
+    o.ops = 200000;
+    o.seconds = 0;
+    for (int i = 1; i < argc; ++i){
+        std::string a = argv[i];
+        if (i + 1 < argc && a == "--readers") o.readers = std::atoi(argv[++i]);
+        else if (i + 1 < argc && a == "--size") o.size = std::atol(argv[++i]);
+        else if (i + 1 < argc && a == "--ops") o.ops = std::atol(argv[++i]);
+        else if (i + 1 < argc && a == "--seconds") o.seconds = std::strtod(argv[++i], 0);
+        else {
+            std::fprintf(stderr, "usage: %s [--readers n] [--size n] [--ops n] [--seconds s]\n",
+                         argv[0]);
+            return 2;
+        }
+    }
+    bool ok = true;
+    ok &= run<avl_height_balance>("avl", o, false);
+    ok &= run<avl_height_balance>("avl", o, true);
+    ok &= run<avl_weak_balance>("wavl", o, false);
+    ok &= run<avl_weak_balance>("wavl", o, true);
+    std::printf("concurrency: %s\n", ok ? "ok" : "FAILED");
+    return ok ? 0 : 1;
+}
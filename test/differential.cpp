@@ -0,0 +1,581 @@
+//
+//  differential.cpp
+//  avlmap
+//
+//  Randomized differential test: runs the same random operations on an
+//  avl_tree and on a std::map and compares them after each one, with
+//  check_invariants() on the tree. Integer keys run under every
+//  combination of the traits options (prefix normalizer, hash index, weak
+//  AVL balance, digests, single writer); string keys run with and without
+//  their traits, and are also looked up and erased through
+//  std::string_view with a transparent comparator. With digests, the
+//  content digest and diff() from a copy taken a few operations back are
+//  checked too. Built a second time with AVL_MAP_STATS defined
+//  (differential_stats), it also checks the operation counters and
+//  shape_report(). Odd rounds start out with relaxed balancing, and any
+//  round may switch modes.
+//
+//  usage: differential [--seed n] [--rounds n]
+//
+
+#include "../avlmap/avlmap.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <random>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#define CHECK(x) do { if (!(x)) fail(#x, __LINE__); } while (0)
+
+namespace {
+
+const char* current = "";
+
+void fail(const char* what, int line)
+{
+    std::fprintf(stderr, "differential: %s: line %d: %s\n", current, line, what);
+    std::exit(1);
+}
+
+// One bit of Mask per option, so that every combination can run.
+template <int Mask>
+struct combo_traits : avl_default_traits
+{
+    typedef typename std::conditional<(Mask & 1) != 0, avl_integer_prefix, void>::type key_normalizer;
+    typedef typename std::conditional<(Mask & 2) != 0, std::hash<long>, void>::type hasher;
+    typedef typename std::conditional<(Mask & 4) != 0, avl_weak_balance, avl_height_balance>::type
+    balance_policy;
+    typedef typename std::conditional<(Mask & 8) != 0, avl_std_digest, void>::type digest;
+    typedef typename std::conditional<(Mask & 16) != 0, avl_single_writer, void>::type concurrency;
+
+    static std::string name()
+    {
+        std::string s = "long keys";
+        if (Mask & 1) s += ", prefix";
+        if (Mask & 2) s += ", hash";
+        if (Mask & 4) s += ", wavl";
+        if (Mask & 8) s += ", digest";
+        if (Mask & 16) s += ", single writer";
+        return s;
+    }
+};
+
+enum { combinations = 1 << 5 };
+
+struct string_traits : avl_default_traits
+{
+    typedef avl_string_prefix<> key_normalizer;
+    typedef std::hash<std::string> hasher;
+    typedef avl_std_digest digest;
+};
+
+template <typename K> K make_key(unsigned v);
+
+template <> long make_key<long>(unsigned v)
+{
+    return (long)v * 7919 - 100000;
+}
+
+// shared prefixes longer than the normalized bytes, so that prefixes tie
+template <> std::string make_key<std::string>(unsigned v)
+{
+    std::string s = "key/0000000/";
+    s.append(v % 3, '\xe0');
+    return s + std::to_string(v);
+}
+
+// the most levels a tree of n elements may have under the policy
+double max_height(size_t n, avl_height_balance)
+{
+    return 1.4405 * std::log2((double)n + 2) - 0.3277;
+}
+
+double max_height(size_t n, avl_weak_balance)
+{
+    return 2 * std::log2((double)n + 1) + 1;
+}
+
+template <typename Tree>
+struct harness
+{
+    typedef typename Tree::key_type key_type;
+    typedef std::map<key_type, long> reference;
+    typedef typename Tree::traits_type traits;
+    static const bool has_digest = !std::is_void<typename traits::digest>::value;
+
+    std::mt19937_64 rng;
+    unsigned range;
+    Tree t;
+    reference r;
+
+    harness(uint64_t seed, unsigned keys) : rng(seed), range(keys) {}
+
+    key_type random_key()
+    {
+        return make_key<key_type>((unsigned)(rng() % range));
+    }
+
+    template <typename It, typename Rt>
+    void same_position(It i, Rt j)
+    {
+        CHECK((i == t.end()) == (j == r.end()));
+        if (j != r.end()) CHECK(i->first == j->first && i->second == j->second);
+    }
+
+    void compare_all()
+    {
+        const Tree& ct = t;
+        CHECK(t.size() == r.size() && t.empty() == r.empty());
+        typename reference::const_iterator j = r.begin();
+        for (typename Tree::const_iterator i = ct.begin(); i != ct.end(); ++i, ++j){
+            CHECK(j != r.end());
+            CHECK(i->first == j->first && i->second == j->second);
+        }
+        CHECK(j == r.end());
+        // and backwards from end()
+        typename Tree::const_iterator i = ct.end();
+        while (j != r.begin()){
+            CHECK(i != ct.begin());
+            --i;
+            --j;
+            CHECK(i->first == j->first);
+        }
+        CHECK(i == ct.begin());
+    }
+
+    // Heights are exact once check_invariants() passes, so the shape must
+    // also be within the policy's bound.
+    void check_shape()
+    {
+        avl_tree_shape s = t.shape_report();
+        CHECK(s.size == t.size());
+        size_t counted = 0;
+        for (size_t d = 0; d < s.depth_histogram.size(); ++d) counted += s.depth_histogram[d];
+        CHECK(counted == t.size());
+        CHECK(s.height == (t.empty() ? 0 : s.max_depth + 1));
+        CHECK((double)s.height <= max_height(t.size(), typename traits::balance_policy()));
+    }
+
+    // heterogeneous lookup and erase, without building a key
+    void view_step(const std::string& k, std::true_type)
+    {
+        std::string_view v(k);
+        same_position(t.find(v), r.find(k));
+        CHECK(t.count(v) == r.count(k));
+        same_position(t.lower_bound(v), r.lower_bound(k));
+        same_position(t.upper_bound(v), r.upper_bound(k));
+        same_position(t.equal_range(v).first, r.lower_bound(k));
+        if (rng() % 4 == 0) CHECK(t.erase(v) == r.erase(k));
+    }
+
+    void view_step(const key_type&, std::false_type) {}
+
+    uint64_t expected_digest(const reference& m)
+    {
+        uint64_t d = 0;
+        for (typename reference::const_iterator i = m.begin(); i != m.end(); ++i)
+            d += avl_digest_mix(avl_std_digest()(i->first, i->second));
+        return d;
+    }
+
+    // The content digest against the reference, and diff() from an older
+    // copy against a merge of the two references.
+    void check_digests(const Tree& old, const reference& old_r, std::true_type)
+    {
+        CHECK(t.content_digest() == expected_digest(r));
+        std::vector<typename Tree::diff_entry> d;
+        old.diff(t, std::back_inserter(d));
+        std::vector<std::pair<avl_diff_kind, key_type> > want;
+        typename reference::const_iterator i = old_r.begin(), j = r.begin();
+        while (i != old_r.end() || j != r.end()){
+            if (j == r.end() || (i != old_r.end() && i->first < j->first))
+                want.push_back(std::make_pair(avl_diff_removed, (i++)->first));
+            else if (i == old_r.end() || j->first < i->first)
+                want.push_back(std::make_pair(avl_diff_inserted, (j++)->first));
+            else {
+                if (i->second != j->second) want.push_back(std::make_pair(avl_diff_changed, i->first));
+                ++i;
+                ++j;
+            }
+        }
+        CHECK(d.size() == want.size());
+        for (size_t n = 0; n < d.size(); ++n){
+            CHECK(d[n].kind == want[n].first && d[n].element->first == want[n].second);
+            // the element of the side that has the key
+            const reference& side = d[n].kind == avl_diff_removed ? old_r : r;
+            CHECK(d[n].element->second == side.find(want[n].second)->second);
+        }
+    }
+
+    void check_digests(const Tree&, const reference&, std::false_type) {}
+
+    typedef std::vector<typename reference::value_type> elements;
+
+    // the elements with keys in [lo, hi]
+    elements closed_range(const key_type& lo, const key_type& hi)
+    {
+        elements e;
+        for (typename reference::iterator j = r.lower_bound(lo); j != r.end() && !(hi < j->first); ++j)
+            e.push_back(*j);
+        return e;
+    }
+
+    // A scan in one go, then paged: each page stops at its limit, and the
+    // next one goes on from the same cursor or from scan_after() the last
+    // key, which must come out the same.
+    void scan_step(key_type lo, key_type hi)
+    {
+        if (rng() % 8 != 0 && hi < lo) std::swap(lo, hi);
+        const Tree& ct = t;
+        elements want = closed_range(lo, hi);
+        elements got;
+        size_t limit = (rng() % 2) ? want.size() + 1 : (size_t)(rng() % 8);
+        ct.scan(lo, hi, std::back_inserter(got), limit);
+        CHECK(got.size() == std::min(limit, want.size()));
+        CHECK(std::equal(got.begin(), got.end(), want.begin()));
+
+        got.clear();
+        typename Tree::scan_cursor c = ct.scan_from(lo, hi);
+        while (!c.done()){
+            size_t page = 1 + (size_t)(rng() % 5), before = got.size();
+            if (rng() % 2){
+                c.next(std::back_inserter(got), page);
+            } else {
+                std::vector<key_type> keys(page);
+                std::vector<long> values(page);
+                size_t n = c.next(&keys[0], &values[0], page);
+                for (size_t i = 0; i < n; ++i) got.push_back(std::make_pair(keys[i], values[i]));
+            }
+            CHECK(got.size() > before && got.size() - before <= page);
+            CHECK(got.size() - before == page || c.done());
+            CHECK(c.last_key() == got.back().first);
+            if (rng() % 2) c = ct.scan_after(c.last_key(), hi);
+        }
+        CHECK(got.size() == want.size());
+        CHECK(std::equal(got.begin(), got.end(), want.begin()));
+    }
+
+#ifdef AVL_MAP_STATS
+    // one descent per lower_bound in a non-empty tree, through at most one
+    // node per level
+    void check_descent_counts(const key_type& k)
+    {
+        avl_tree_stats before = t.stats();
+        size_t height = t.shape_report().height;
+        t.lower_bound(k);
+        const avl_tree_stats& after = t.stats();
+        CHECK(after.descents == before.descents + (t.empty() ? 0 : 1));
+        CHECK(after.descent_steps - before.descent_steps <= height);
+        CHECK(after.comparisons - before.comparisons <= 2 * height + 2);
+    }
+
+    // Inserting the largest, the smallest and then the middle of three
+    // keys into an empty tree takes one double rotation; a sorted run
+    // takes single ones only.
+    void check_rotation_counts()
+    {
+        std::vector<key_type> keys;
+        for (unsigned v = 0; v < 64; ++v) keys.push_back(make_key<key_type>(v));
+        std::sort(keys.begin(), keys.end());
+        Tree x;
+        x.insert(std::make_pair(keys[2], 0L));
+        x.insert(std::make_pair(keys[0], 0L));
+        x.insert(std::make_pair(keys[1], 0L));
+        CHECK(x.stats().double_rotations == 1 && x.stats().single_rotations == 0);
+        x.check_invariants();
+        Tree y;
+        for (size_t i = 0; i < keys.size(); ++i) y.insert(std::make_pair(keys[i], 0L));
+        CHECK(y.stats().double_rotations == 0 && y.stats().single_rotations > 0);
+        y.check_invariants();
+        // two barriers, and a node and a value per element
+        CHECK(y.stats().allocations - y.stats().deallocations == 2 + 2 * keys.size());
+        y.clear();
+        CHECK(y.stats().allocations - y.stats().deallocations == 2);
+        y.reset_stats();
+        CHECK(y.stats().allocations == 0 && y.stats().rebalance_steps == 0);
+    }
+#endif
+
+    void step(long)
+    {
+        key_type k = random_key();
+        long v = (long)(rng() % 1000);
+        switch (rng() % 20){
+        case 0:
+            // assigning through the reference would leave digests stale
+            if (has_digest){
+                t[k];
+                t.replace(t.find(k), v);
+            } else t[k] = v;
+            r[k] = v;
+            break;
+        case 1:
+            CHECK(t.insert(std::make_pair(k, v)).second == r.insert(std::make_pair(k, v)).second);
+            break;
+        case 2:
+            CHECK(t.emplace(std::make_pair(k, v)).second == r.emplace(k, v).second);
+            break;
+        case 3: {
+            typename Tree::iterator h = t.lower_bound(k);
+            typename Tree::iterator i = t.insert(h, std::make_pair(k, v));
+            // end() when the key is present
+            if (r.insert(std::make_pair(k, v)).second) CHECK(i != t.end() && i->first == k);
+            else CHECK(i == t.end());
+            break;
+        }
+        case 4:
+        case 5:
+            CHECK(t.erase(k) == r.erase(k));
+            break;
+        case 6: {
+            typename Tree::iterator i = t.find(k);
+            CHECK((i == t.end()) == (r.find(k) == r.end()));
+            if (i != t.end()){
+                t.erase(i);
+                r.erase(k);
+            }
+            break;
+        }
+        case 7: {
+            // a short range
+            typename Tree::iterator i = t.lower_bound(k), e = i;
+            typename reference::iterator j = r.lower_bound(k), f = j;
+            for (unsigned n = (unsigned)(rng() % 4); n > 0 && e != t.end(); --n, ++e, ++f) {}
+            t.erase(i, e);
+            r.erase(j, f);
+            break;
+        }
+        case 8:
+            same_position(t.find(k), r.find(k));
+            CHECK(t.count(k) == r.count(k));
+            break;
+        case 9:
+            same_position(t.lower_bound(k), r.lower_bound(k));
+#ifdef AVL_MAP_STATS
+            check_descent_counts(k);
+#endif
+            break;
+        case 10:
+            same_position(t.upper_bound(k), r.upper_bound(k));
+            break;
+        case 11:
+            view_step(k, std::integral_constant<bool, std::is_same<key_type, std::string>::value
+                      && avl_is_transparent<typename Tree::key_compare>::value>());
+            break;
+        case 12: {
+            // out and back in under another key, half the time through an
+            // iterator to the first element not below k
+            typename reference::iterator j;
+            typename Tree::node_type nh;
+            if (rng() % 2){
+                j = r.find(k);
+                nh = t.extract(k);
+            } else {
+                j = r.lower_bound(k);
+                typename Tree::iterator i = t.lower_bound(k);
+                if (i != t.end()) nh = t.extract(i);
+            }
+            CHECK(nh.empty() == (j == r.end()));
+            if (nh.empty()) break;
+            CHECK(nh.key() == j->first && nh.mapped() == j->second);
+            long m = j->second;
+            r.erase(j);
+            key_type x = random_key();
+            nh.key() = x;
+            // a handle whose key is present comes back in insert_return_type::node
+            typename Tree::insert_return_type ir = t.insert(std::move(nh));
+            CHECK(ir.inserted == r.insert(std::make_pair(x, m)).second);
+            CHECK(ir.position != t.end() && ir.position->first == x);
+            CHECK(ir.node.empty() == ir.inserted);
+            if (!ir.inserted) CHECK(ir.node.key() == x && ir.node.mapped() == m);
+            break;
+        }
+        case 13: {
+            Tree other;
+            reference other_r;
+            for (unsigned n = (unsigned)(rng() % 8); n > 0; --n){
+                key_type x = random_key();
+                other.insert(std::make_pair(x, (long)n));
+                other_r.insert(std::make_pair(x, (long)n));
+            }
+            t.merge(other);
+            // what was already present stays behind
+            for (typename reference::iterator j = other_r.begin(); j != other_r.end();){
+                if (r.insert(*j).second) other_r.erase(j++);
+                else ++j;
+            }
+            other.check_invariants();
+            CHECK(other.size() == other_r.size());
+            for (typename reference::iterator j = other_r.begin(); j != other_r.end(); ++j)
+                CHECK(other.count(j->first) == 1);
+            break;
+        }
+        case 14: {
+            // finger searches from anywhere, end() included
+            long at = (long)(rng() % (t.size() + 1));
+            typename Tree::iterator finger = std::next(t.begin(), at);
+            const Tree& ct = t;
+            typename Tree::const_iterator cfinger = std::next(ct.begin(), at);
+            same_position(t.lower_bound(finger, k), r.lower_bound(k));
+            same_position(t.find(finger, k), r.find(k));
+            same_position(ct.lower_bound(cfinger, k), r.lower_bound(k));
+            same_position(ct.find(cfinger, k), r.find(k));
+            // and a sorted batch, repeats included
+            std::vector<key_type> keys(rng() % 16);
+            for (size_t i = 0; i < keys.size(); ++i) keys[i] = random_key();
+            std::sort(keys.begin(), keys.end());
+            std::vector<typename Tree::iterator> found;
+            t.lower_bound_sorted(keys.begin(), keys.end(), std::back_inserter(found));
+            CHECK(found.size() == keys.size());
+            for (size_t i = 0; i < keys.size(); ++i) same_position(found[i], r.lower_bound(keys[i]));
+            break;
+        }
+        case 15:
+            // work off part of the list, or now and then switch modes
+            if (t.relaxed_balancing() && rng() % 4 != 0){
+                size_t left = t.rebalance_some((size_t)(rng() % 8));
+                CHECK(left == t.rebalance_pending());
+            } else if (rng() % 16 == 0){
+                if (t.relaxed_balancing()) t.strict_balancing();
+                else t.relax_balancing((size_t)(rng() % 3), 1 + (size_t)(rng() % 64));
+                if (!t.relaxed_balancing()) CHECK(t.rebalance_pending() == 0);
+            }
+            break;
+        case 16:
+            if (rng() % 4 == 0){
+                // everything not above k, in order, and nothing else
+                std::vector<typename reference::value_type> out;
+                t.drain_until(k, std::back_inserter(out));
+                typename reference::iterator e = r.upper_bound(k);
+                CHECK(out.size() == (size_t)std::distance(r.begin(), e));
+                CHECK(std::equal(out.begin(), out.end(), r.begin()));
+                r.erase(r.begin(), e);
+            } else if (!r.empty()){
+                bool low = rng() % 2 != 0;
+                typename reference::iterator j = low ? r.begin() : std::prev(r.end());
+                const typename Tree::value_type& peek = low ? t.peek_min() : t.peek_max();
+                CHECK(peek.first == j->first && peek.second == j->second);
+                typename Tree::value_type x = low ? t.pop_min() : t.pop_max();
+                CHECK(x.first == j->first && x.second == j->second);
+                r.erase(j);
+            }
+            break;
+        case 17:
+            scan_step(k, random_key());
+            break;
+        case 18: {
+            typename Tree::iterator i = t.find(k);
+            CHECK((i == t.end()) == (r.find(k) == r.end()));
+            if (i != t.end()){
+                t.replace(i, v);
+                r[k] = v;
+                CHECK(t.find(k)->second == v);
+            }
+            break;
+        }
+        default:
+            if (r.count(k) != 0) CHECK(t.at(k) == r[k]);
+            break;
+        }
+    }
+
+    void run(size_t ops, bool relaxed)
+    {
+        if (relaxed) t.relax_balancing(1, 32);
+        std::unique_ptr<Tree> old(new Tree);
+        reference old_r;
+        for (size_t op = 0; op < ops; ++op){
+            step((long)op);
+            t.check_invariants();
+            CHECK(t.size() == r.size());
+            if (op % 64 == 0){
+                compare_all();
+                check_digests(*old, old_r, std::integral_constant<bool, has_digest>());
+                old.reset(new Tree(t));
+                old_r = r;
+                old->check_invariants();
+                // the bound holds once nothing is queued
+                if (t.rebalance_pending() == 0) check_shape();
+            }
+            if (op % 512 == 511 && rng() % 4 == 0){
+                t.clear();
+                r.clear();
+            }
+        }
+        t.strict_balancing();
+        t.check_invariants();
+        compare_all();
+        check_shape();
+        Tree c(t);
+        c.check_invariants();
+        Tree d;
+        d.swap(c);
+        CHECK(c.empty() && d.size() == r.size());
+        c.check_invariants();
+        d.check_invariants();
+#ifdef AVL_MAP_STATS
+        check_rotation_counts();
+#endif
+    }
+};
+
+template <typename Tree>
+void run(const char* name, uint64_t seed, size_t rounds)
+{
+    current = name;
+    for (size_t round = 0; round < rounds; ++round){
+        unsigned keys = 1u << (2 + round % 10);
+        harness<Tree>(seed + round, keys).run(2000, round % 2 == 1);
+    }
+}
+
+template <int Mask>
+struct run_combos
+{
+    static void go(uint64_t seed, size_t rounds)
+    {
+        typedef combo_traits<Mask> traits;
+        std::string name = traits::name();
+        run<avl_tree<long, long, std::less<long>, std::allocator<std::pair<const long, long> >, traits> >(
+            name.c_str(), seed, rounds);
+        run_combos<Mask - 1>::go(seed, rounds);
+    }
+};
+
+template <>
+struct run_combos<-1>
+{
+    static void go(uint64_t, size_t) {}
+};
+
+}
+
+int main(int argc, const char * argv[])
+{
+    uint64_t seed = 1;
+    size_t rounds = 12;
+    for (int i = 1; i < argc; ++i){
+        std::string a = argv[i];
+        if (i + 1 < argc && a == "--seed") seed = std::strtoull(argv[++i], 0, 10);
+        else if (i + 1 < argc && a == "--rounds") rounds = std::strtoul(argv[++i], 0, 10);
+        else {
+            std::fprintf(stderr, "usage: %s [--seed n] [--rounds n]\n", argv[0]);
+            return 2;
+        }
+    }
+    run_combos<combinations - 1>::go(seed, rounds);
+    run<avl_tree<std::string, long, std::less<> > >("string keys", seed, rounds);
+    run<avl_tree<std::string, long, std::less<>, std::allocator<std::pair<const std::string, long> >,
+        string_traits> >("string keys, traits", seed, rounds);
+    std::printf("differential: ok\n");
+    return 0;
+}
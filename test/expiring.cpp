@@ -0,0 +1,195 @@
+//
+//  expiring.cpp
+//  avlmap
+//
+//  Randomized test of expiring_avl_map against a std::map of values and
+//  expiry times, on a simulated clock that the test moves forward: insert
+//  and assign with a time to live, find() and touch() on live and expired
+//  entries, re-insertion over an expired entry, erase of entries anywhere
+//  in the expiry heap, and expire_until(), which must remove exactly the
+//  entries due and leave next_expiry() at the earliest one left.
+//
+//  usage: expiring [--seed n] [--ops n]
+//
+
+#include "../avlmap/avlmap_expiring.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <random>
+#include <string>
+
+#define CHECK(x) do { if (!(x)) fail(#x, __LINE__); } while (0)
+
+namespace {
+
+void fail(const char* what, int line)
+{
+    std::fprintf(stderr, "expiring: line %d: %s\n", line, what);
+    std::exit(1);
+}
+
+// A clock that only moves when the test says so. The map is always given
+// the time, so now() is only there to satisfy the Clock requirements.
+struct sim_clock
+{
+    typedef std::chrono::milliseconds duration;
+    typedef duration::rep rep;
+    typedef duration::period period;
+    typedef std::chrono::time_point<sim_clock> time_point;
+    static const bool is_steady = true;
+
+    static time_point now()
+    {
+        return time_point();
+    }
+};
+
+typedef expiring_avl_map<long, long, sim_clock> map_type;
+typedef sim_clock::time_point time_point;
+typedef sim_clock::duration duration;
+
+struct entry
+{
+    long value;
+    time_point expires;
+};
+
+typedef std::map<long, entry> reference;
+
+bool live(const reference& r, long k, time_point now)
+{
+    reference::const_iterator i = r.find(k);
+    return i != r.end() && now < i->second.expires;
+}
+
+void check_all(const map_type& m, const reference& r, time_point now)
+{
+    CHECK(m.size() == r.size() && m.empty() == r.empty());
+    time_point first = time_point::max();
+    for (reference::const_iterator i = r.begin(); i != r.end(); ++i){
+        const long* v = m.find(i->first, now);
+        CHECK((v != 0) == (now < i->second.expires));
+        if (v != 0) CHECK(*v == i->second.value);
+        if (i->second.expires < first) first = i->second.expires;
+    }
+    if (!r.empty()) CHECK(m.next_expiry() == first);
+}
+
+void run(uint64_t seed, size_t ops)
+{
+    std::mt19937_64 rng(seed);
+    map_type m;
+    reference r;
+    time_point now;
+    for (size_t op = 0; op < ops; ++op){
+        long k = (long)(rng() % 200);
+        long v = (long)(rng() % 1000);
+        duration ttl((long)(1 + rng() % 40));
+        switch (rng() % 8){
+        case 0: {
+            // stored unless live; over an expired entry, a fresh one
+            bool stored = !live(r, k, now);
+            CHECK(m.insert(k, v, ttl, now) == stored);
+            if (stored){
+                entry e = { v, now + ttl };
+                r[k] = e;
+            }
+            break;
+        }
+        case 1: {
+            m.assign(k, v, ttl, now);
+            entry e = { v, now + ttl };
+            r[k] = e;
+            break;
+        }
+        case 2: {
+            const map_type& cm = m;
+            const long* found = cm.find(k, now);
+            CHECK((found != 0) == live(r, k, now));
+            if (found != 0) CHECK(*found == r[k].value);
+            CHECK(m.find(k, now) == found);
+            break;
+        }
+        case 3: {
+            bool was = live(r, k, now);
+            CHECK(m.touch(k, ttl, now) == was);
+            if (was) r[k].expires = now + ttl;
+            break;
+        }
+        case 4:
+            // expired or not, and wherever it sits in the heap
+            CHECK(m.erase(k) == r.erase(k));
+            break;
+        case 5: {
+            // an entry with the earliest expiry: the heap's root, or with
+            // ties one near it
+            if (r.empty()) break;
+            reference::iterator first = r.begin();
+            for (reference::iterator i = r.begin(); i != r.end(); ++i)
+                if (i->second.expires < first->second.expires) first = i;
+            CHECK(m.next_expiry() == first->second.expires);
+            CHECK(m.erase(first->first) == 1);
+            r.erase(first);
+            break;
+        }
+        case 6: {
+            time_point until = now + duration((long)(rng() % 4));
+            size_t due = 0;
+            for (reference::iterator i = r.begin(); i != r.end();){
+                if (until < i->second.expires) ++i;
+                else {
+                    r.erase(i++);
+                    ++due;
+                }
+            }
+            CHECK(m.expire_until(until) == due);
+            break;
+        }
+        default:
+            now += duration((long)(rng() % 4));
+            break;
+        }
+        CHECK(m.size() == r.size());
+        if (op % 64 == 0) check_all(m, r, now);
+        if (op % 4096 == 4095 && rng() % 4 == 0){
+            m.clear();
+            r.clear();
+        }
+    }
+    check_all(m, r, now);
+
+    // an entry that has expired can come back under the same key, and
+    // then expires on its new schedule
+    m.clear();
+    r.clear();
+    CHECK(m.insert(1, 10, duration(5), now));
+    CHECK(!m.insert(1, 11, duration(5), now + duration(4)));
+    CHECK(m.find(1, now + duration(5)) == 0);
+    CHECK(m.insert(1, 12, duration(5), now + duration(5)));
+    CHECK(m.size() == 1 && *m.find(1, now + duration(9)) == 12);
+    CHECK(m.expire_until(now + duration(9)) == 0);
+    CHECK(m.expire_until(now + duration(10)) == 1 && m.empty());
+}
+
+}
+
+int main(int argc, const char * argv[])
+{
+    uint64_t seed = 1;
+    size_t ops = 200000;
+    for (int i = 1; i < argc; ++i){
+        std::string a = argv[i];
+        if (i + 1 < argc && a == "--seed") seed = std::strtoull(argv[++i], 0, 10);
+        else if (i + 1 < argc && a == "--ops") ops = std::strtoul(argv[++i], 0, 10);
+        else {
+            std::fprintf(stderr, "usage: %s [--seed n] [--ops n]\n", argv[0]);
+            return 2;
+        }
+    }
+    for (uint64_t s = seed; s < seed + 4; ++s) run(s, ops / 4);
+    std::printf("expiring: ok\n");
+    return 0;
+}
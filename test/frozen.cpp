@@ -0,0 +1,141 @@
+//
+//  frozen.cpp
+//  avlmap
+//
+//  Tests of frozen_avl_map's Eytzinger layout. A constexpr map is checked
+//  with static_assert, so that its lookups are known to run in the
+//  compiler; then, for every size from 1 to 70, which covers complete and
+//  ragged last levels, a map built from shuffled pairs is compared with a
+//  sorted reference: forward and reverse iteration, find, count, at,
+//  lower_bound, upper_bound and equal_range for every key present and for
+//  the gaps around them. A duplicate key must throw std::invalid_argument.
+//
+//  usage: frozen [--seed n]
+//
+
+#include "../avlmap/avlmap_frozen.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#define CHECK(x) do { if (!(x)) fail(#x, __LINE__); } while (0)
+
+namespace {
+
+size_t current_size = 0;
+
+void fail(const char* what, int line)
+{
+    std::fprintf(stderr, "frozen: size %zu: line %d: %s\n", current_size, line, what);
+    std::exit(1);
+}
+
+constexpr auto primes = make_frozen_avl_map<int, int>({
+    {7, 4}, {2, 1}, {11, 5}, {3, 2}, {13, 6}, {5, 3}});
+
+static_assert(primes.size() == 6, "size");
+static_assert(primes.at(11) == 5, "at");
+static_assert(primes.find(4) == primes.end(), "find of an absent key");
+static_assert(primes.count(13) == 1 && primes.count(1) == 0, "count");
+static_assert(primes.lower_bound(8)->first == 11, "lower_bound between keys");
+static_assert(primes.lower_bound(1)->first == 2, "lower_bound below the first");
+static_assert(primes.upper_bound(7)->first == 11, "upper_bound on a key");
+static_assert(primes.upper_bound(13) == primes.end(), "upper_bound on the last");
+static_assert(primes.begin()->first == 2, "begin");
+static_assert((--primes.end())->first == 13, "decrement from end");
+static_assert((++primes.find(5))->first == 7, "increment");
+
+// Keys 1, 3, 5, ..., so that every gap has an even key in it; the value
+// of key k is k * 10.
+template <size_t N>
+void check_size(std::mt19937_64& rng)
+{
+    current_size = N;
+    std::pair<long, long> items[N];
+    for (size_t i = 0; i < N; ++i) items[i] = std::make_pair((long)(2 * i + 1), (long)(20 * i + 10));
+    std::shuffle(items, items + N, rng);
+    frozen_avl_map<long, long, N> m(items);
+    std::vector<std::pair<long, long> > sorted(items, items + N);
+    std::sort(sorted.begin(), sorted.end());
+
+    CHECK(m.size() == N && !m.empty());
+    typename frozen_avl_map<long, long, N>::const_iterator i = m.begin();
+    for (size_t n = 0; n < N; ++n, ++i){
+        CHECK(i != m.end());
+        CHECK(i->first == sorted[n].first && i->second == sorted[n].second);
+    }
+    CHECK(i == m.end());
+    for (size_t n = N; n-- > 0;){
+        --i;
+        CHECK(i->first == sorted[n].first);
+    }
+    CHECK(i == m.begin());
+    size_t n = N;
+    for (typename frozen_avl_map<long, long, N>::const_reverse_iterator j = m.rbegin(); j != m.rend(); ++j)
+        CHECK(n > 0 && j->first == sorted[--n].first);
+    CHECK(n == 0);
+
+    for (long k = 0; k <= (long)(2 * N + 1); ++k){
+        // (k, 0) sorts before an element with key k, whose value is positive
+        std::vector<std::pair<long, long> >::iterator lb
+            = std::lower_bound(sorted.begin(), sorted.end(), std::make_pair(k, 0L));
+        bool present = lb != sorted.end() && lb->first == k;
+        std::vector<std::pair<long, long> >::iterator ub = present ? lb + 1 : lb;
+
+        CHECK((m.lower_bound(k) == m.end()) == (lb == sorted.end()));
+        if (lb != sorted.end()) CHECK(m.lower_bound(k)->first == lb->first);
+        CHECK((m.upper_bound(k) == m.end()) == (ub == sorted.end()));
+        if (ub != sorted.end()) CHECK(m.upper_bound(k)->first == ub->first);
+        CHECK(m.equal_range(k).first == m.lower_bound(k) && m.equal_range(k).second == m.upper_bound(k));
+        CHECK(m.count(k) == (present ? 1u : 0u));
+        CHECK((m.find(k) == m.end()) == !present);
+        if (present){
+            CHECK(m.find(k)->second == lb->second);
+            CHECK(m.at(k) == lb->second);
+        } else {
+            bool threw = false;
+            try { m.at(k); } catch (std::out_of_range&) { threw = true; }
+            CHECK(threw);
+        }
+    }
+
+    // any key twice, wherever it ends up in the sort
+    if (N > 1){
+        size_t a = rng() % N, b = (a + 1 + rng() % (N - 1)) % N;
+        items[a].first = items[b].first;
+        bool threw = false;
+        try { frozen_avl_map<long, long, N> d(items); } catch (std::invalid_argument&) { threw = true; }
+        CHECK(threw);
+    }
+}
+
+template <size_t... I>
+void check_sizes(std::mt19937_64& rng, std::index_sequence<I...>)
+{
+    (check_size<I + 1>(rng), ...);
+}
+
+}
+
+int main(int argc, const char * argv[])
+{
+    uint64_t seed = 1;
+    for (int i = 1; i < argc; ++i){
+        std::string a = argv[i];
+        if (i + 1 < argc && a == "--seed") seed = std::strtoull(argv[++i], 0, 10);
+        else {
+            std::fprintf(stderr, "usage: %s [--seed n]\n", argv[0]);
+            return 2;
+        }
+    }
+    std::mt19937_64 rng(seed);
+    check_sizes(rng, std::make_index_sequence<70>());
+    std::printf("frozen: ok\n");
+    return 0;
+}
@@ -0,0 +1,282 @@
+//
+//  persistence.cpp
+//  avlmap
+//
+//  Round trips through every on-disk form: save() and load(), including
+//  into trees with a prefix normalizer, a hash index and digests;
+//  mapped_avl_map over a saved file, and its rejection of truncated and
+//  malformed headers; durable_avl_map recovery from checkpoint and log,
+//  from a log with a torn last record, and after a sync that failed part
+//  way through a write.
+//
+//  usage: persistence [--dir path]
+//
+
+#include "../avlmap/avlmap_durable.h"
+#include "../avlmap/avlmap_mmap.h"
+
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <random>
+#include <sstream>
+#include <string>
+#include <sys/resource.h>
+
+#define CHECK(x) do { if (!(x)) fail(#x, __LINE__); } while (0)
+
+namespace {
+
+void fail(const char* what, int line)
+{
+    std::fprintf(stderr, "persistence: line %d: %s\n", line, what);
+    std::exit(1);
+}
+
+typedef std::map<long, double> reference;
+
+struct all_traits : avl_default_traits
+{
+    typedef avl_integer_prefix key_normalizer;
+    typedef std::hash<long> hasher;
+    typedef avl_std_digest digest;
+};
+
+typedef avl_tree<long, double> plain_tree;
+typedef avl_tree<long, double, std::less<long>, std::allocator<std::pair<const long, double> >,
+all_traits> traits_tree;
+
+template <typename Tree>
+void check_same(const Tree& t, const reference& r)
+{
+    t.check_invariants();
+    CHECK(t.size() == r.size());
+    typename reference::const_iterator j = r.begin();
+    for (typename Tree::const_iterator i = t.begin(); i != t.end(); ++i, ++j)
+        CHECK(j != r.end() && i->first == j->first && i->second == j->second);
+}
+
+reference random_content(std::mt19937_64& rng, size_t n)
+{
+    reference r;
+    while (r.size() < n) r[(long)(rng() % (4 * n + 1)) - (long)n] = (double)(rng() % 1000) / 8;
+    return r;
+}
+
+template <typename Tree>
+void save_load(const reference& r)
+{
+    Tree t;
+    t.insert(r.begin(), r.end());
+    std::stringstream s;
+    t.save(s);
+    Tree u;
+    u.insert(std::make_pair(12345L, 1.0));
+    u.load(s);
+    check_same(u, r);
+    // the loaded tree takes further changes like any other
+    u.insert(std::make_pair(-7L, 3.0));
+    u.erase(r.empty() ? 0 : r.begin()->first);
+    u.check_invariants();
+
+    // a stream cut anywhere fails to load
+    std::string bytes = s.str();
+    for (size_t cut = 0; cut + 1 < bytes.size(); cut += 1 + bytes.size() / 7){
+        std::istringstream in(bytes.substr(0, cut));
+        bool threw = false;
+        try { Tree v; v.load(in); } catch (std::runtime_error&) { threw = true; }
+        CHECK(threw);
+    }
+}
+
+void write_file(const std::string& path, const std::string& bytes)
+{
+    std::ofstream os(path.c_str(), std::ios::binary | std::ios::trunc);
+    os.write(bytes.data(), (std::streamsize)bytes.size());
+    CHECK(os.good());
+}
+
+bool mapping_rejected(const std::string& path)
+{
+    try {
+        mapped_avl_map<long, double> m(path);
+    } catch (std::runtime_error&) {
+        return true;
+    }
+    return false;
+}
+
+void mapped(const std::string& dir, const reference& r)
+{
+    plain_tree t;
+    t.insert(r.begin(), r.end());
+    std::ostringstream s;
+    t.save(s);
+    std::string bytes = s.str();
+    std::string path = dir + "/mapped";
+    write_file(path, bytes);
+    {
+        mapped_avl_map<long, double> m(path);
+        CHECK(m.size() == r.size());
+        reference::const_iterator j = r.begin();
+        for (mapped_avl_map<long, double>::const_iterator i = m.begin(); i != m.end(); ++i, ++j)
+            CHECK(j != r.end() && i->first == j->first && i->second == j->second);
+        for (long k = -(long)r.size() - 2; k < 3 * (long)r.size() + 2; ++k){
+            reference::const_iterator lb = r.lower_bound(k);
+            CHECK((m.lower_bound(k) == m.end()) == (lb == r.end()));
+            if (lb != r.end()) CHECK(m.lower_bound(k)->first == lb->first);
+            CHECK(m.count(k) == r.count(k));
+        }
+    }
+    if (!r.empty()){
+        write_file(path, bytes.substr(0, bytes.size() - 1));
+        CHECK(mapping_rejected(path));
+    }
+    write_file(path, bytes.substr(0, sizeof(avl_map_file_header) - 1));
+    CHECK(mapping_rejected(path));
+
+    avl_map_file_header h;
+    std::memcpy(&h, bytes.data(), sizeof(h));
+    avl_map_file_header bad = h;
+    bad.header_size = 1u << 30;
+    write_file(path, std::string((const char*)&bad, sizeof(bad)) + bytes.substr(sizeof(bad)));
+    CHECK(mapping_rejected(path));
+    bad = h;
+    bad.header_size = (uint32_t)sizeof(h) + 4;
+    write_file(path, std::string((const char*)&bad, sizeof(bad)) + std::string(4, '\0')
+               + bytes.substr(sizeof(bad)));
+    CHECK(mapping_rejected(path));
+    bad = h;
+    bad.count = h.count + 1;
+    write_file(path, std::string((const char*)&bad, sizeof(bad)) + bytes.substr(sizeof(bad)));
+    CHECK(mapping_rejected(path));
+    std::remove(path.c_str());
+}
+
+typedef durable_avl_map<long, double> durable_map;
+
+void remove_durable(const std::string& dir)
+{
+    std::remove((dir + "/wal").c_str());
+    std::remove((dir + "/checkpoint").c_str());
+    ::rmdir(dir.c_str());
+}
+
+void durable(const std::string& base, std::mt19937_64& rng)
+{
+    std::string dir = base + "/durable";
+    remove_durable(dir);
+    durable_map::options o;
+    o.write_buffer_bytes = 256;
+    o.checkpoint_log_bytes = 0;
+    reference r;
+    {
+        durable_map m(dir, o);
+        for (int i = 0; i < 3000; ++i){
+            long k = (long)(rng() % 500);
+            if (rng() % 4 == 0){
+                m.erase(k);
+                r.erase(k);
+            } else {
+                m.assign(k, (double)i);
+                r[k] = (double)i;
+            }
+            if (i == 1000) m.checkpoint();
+        }
+        m.sync();
+        check_same(m.map(), r);
+    }
+    {
+        durable_map m(dir, o);
+        check_same(m.map(), r);
+        m.assign(-1, 0.5);
+        m.sync();
+    }
+
+    // a torn tail: the record of the last assign loses its last byte, and
+    // recovery keeps everything before it
+    std::string wal = dir + "/wal";
+    {
+        std::ifstream is(wal.c_str(), std::ios::binary | std::ios::ate);
+        std::streamoff size = is.tellg();
+        CHECK(size > 0 && ::truncate(wal.c_str(), (off_t)size - 1) == 0);
+    }
+    {
+        durable_map m(dir, o);
+        check_same(m.map(), r);
+        // new records follow the last intact one
+        m.assign(-2, 1.5);
+        r[-2] = 1.5;
+    }
+    {
+        durable_map m(dir, o);
+        check_same(m.map(), r);
+    }
+
+    // A sync that dies part way through its write leaves the log as it was
+    // and keeps the mutations for the next sync. The file size limit makes
+    // write() fail with EFBIG once the log reaches it.
+    std::signal(SIGXFSZ, SIG_IGN);
+    struct rlimit saved;
+    CHECK(::getrlimit(RLIMIT_FSIZE, &saved) == 0);
+    o.write_buffer_bytes = 1 << 20;
+    {
+        durable_map m(dir, o);
+        for (long k = 1000; k < 1100; ++k){
+            m.assign(k, (double)k);
+            r[k] = (double)k;
+        }
+        struct rlimit lim = saved;
+        lim.rlim_cur = (rlim_t)m.log_size() - 100;
+        CHECK(::setrlimit(RLIMIT_FSIZE, &lim) == 0);
+        bool threw = false;
+        try { m.sync(); } catch (std::runtime_error&) { threw = true; }
+        CHECK(::setrlimit(RLIMIT_FSIZE, &saved) == 0);
+        CHECK(threw);
+        m.assign(1100, 0);
+        r[1100] = 0;
+        m.sync();
+    }
+    {
+        durable_map m(dir, o);
+        check_same(m.map(), r);
+    }
+    remove_durable(dir);
+}
+
+}
+
+int main(int argc, const char * argv[])
+{
+    std::string dir;
+    for (int i = 1; i < argc; ++i){
+        std::string a = argv[i];
+        if (i + 1 < argc && a == "--dir") dir = argv[++i];
+        else {
+            std::fprintf(stderr, "usage: %s [--dir path]\n", argv[0]);
+            return 2;
+        }
+    }
+    bool temporary = dir.empty();
+    if (temporary){
+        char tmpl[] = "/tmp/avlmap_test.XXXXXX";
+        CHECK(::mkdtemp(tmpl) != 0);
+        dir = tmpl;
+    }
+
+    std::mt19937_64 rng(1);
+    size_t sizes[] = { 0, 1, 2, 3, 7, 100, 1000, 4097 };
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i){
+        reference r = random_content(rng, sizes[i]);
+        save_load<plain_tree>(r);
+        save_load<traits_tree>(r);
+        mapped(dir, r);
+    }
+    durable(dir, rng);
+
+    if (temporary) ::rmdir(dir.c_str());
+    std::printf("persistence: ok\n");
+    return 0;
+}